@@ -0,0 +1,95 @@
+#include "asset_loader.h"
+
+#include <algorithm>
+#include <chrono>
+
+asset_loader::asset_loader(unsigned int num_threads)
+    : stopping(false), done(nullptr), submitted(0), finished(0) {
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0)
+        num_threads = 1;
+    for (unsigned int i = 0; i < num_threads; i++)
+        workers.push_back(std::thread(&asset_loader::worker, this));
+}
+
+asset_loader::~asset_loader() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    for (size_t i = 0; i < tasks.size(); i++)
+        delete tasks[i];
+    collect();
+    for (size_t i = 0; i < ready.size(); i++)
+        delete ready[i];
+}
+
+void asset_loader::worker() {
+    for (;;) {
+        load_job *job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stopping && tasks.empty())
+                wake.wait(guard);
+            if (stopping)
+                return;
+            job = tasks.front();
+            tasks.pop_front();
+        }
+
+        job->run();
+
+        load_job *head = done.load(std::memory_order_relaxed);
+        do {
+            job->next = head;
+        } while (!done.compare_exchange_weak(head, job, std::memory_order_release,
+                                             std::memory_order_relaxed));
+    }
+}
+
+void asset_loader::submit(load_job *job) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push_back(job);
+    }
+    submitted++;
+    wake.notify_one();
+}
+
+// Moves everything the workers finished into 'ready', in completion order.
+void asset_loader::collect() {
+    load_job *list = done.exchange(nullptr, std::memory_order_acquire);
+    size_t start = ready.size();
+    for (; list; list = list->next)
+        ready.push_back(list);
+    std::reverse(ready.begin() + start, ready.end());
+}
+
+unsigned int asset_loader::drain(double budget) {
+    typedef std::chrono::steady_clock clock;
+    clock::time_point end = clock::now() +
+                            std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(budget));
+    collect();
+    unsigned int count = 0;
+    while (!ready.empty() && (count == 0 || clock::now() < end)) {
+        load_job *job = ready.front();
+        ready.pop_front();
+        job->finish();
+        delete job;
+        finished++;
+        count++;
+    }
+    return count;
+}
+
+void asset_loader::wait() {
+    while (pending() > 0) {
+        if (drain(1.0) == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
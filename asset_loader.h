@@ -0,0 +1,71 @@
+#ifndef ASSET_LOADER_H
+#define ASSET_LOADER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// One asset to load. run() does the CPU work (parsing, decoding) on a
+// worker thread; finish() then runs on the thread that calls
+// asset_loader::drain(), which owns the GL context.
+class load_job {
+public:
+    load_job() : next(nullptr) { }
+    virtual ~load_job() { }
+
+    virtual void run() = 0;
+    virtual void finish() = 0;
+
+private:
+    friend class asset_loader;
+    load_job *next; // link in the loader's list of finished jobs
+};
+
+// A pool of worker threads running load_jobs. Workers hand finished jobs
+// back through a lock-free list, so they never wait on the render thread;
+// the render thread takes them all with one atomic exchange and finishes
+// as many as fit in its per-frame budget.
+//
+// submit(), drain(), wait() and pending() must be called from one thread.
+class asset_loader {
+public:
+    // 0 threads means one per hardware thread.
+    explicit asset_loader(unsigned int num_threads = 0);
+    // Stops the workers; jobs not yet finished are deleted unfinished.
+    ~asset_loader();
+
+    // Takes ownership of 'job'.
+    void submit(load_job *job);
+
+    // Finishes done jobs until 'budget' seconds have passed, but at least
+    // one if any is done. Returns the number finished.
+    unsigned int drain(double budget);
+
+    // Blocks until every submitted job is finished.
+    void wait();
+
+    // Jobs submitted but not finished yet.
+    unsigned int pending() const { return submitted - finished; }
+
+private:
+    asset_loader(const asset_loader &);
+    asset_loader &operator=(const asset_loader &);
+
+    void worker();
+    void collect();
+
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<load_job *> tasks; // guarded by 'lock'
+    bool stopping;                // guarded by 'lock'
+
+    std::atomic<load_job *> done; // pushed by workers, newest first
+    std::deque<load_job *> ready; // collected from 'done', oldest first
+    unsigned int submitted, finished;
+};
+
+#endif // ASSET_LOADER_H
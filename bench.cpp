@@ -0,0 +1,467 @@
+// cghw2_bench: microbenchmarks of the loading, texture, transform and
+// culling code, and headless runs of whole scenes and of startup through the
+// cghw2 binary.
+// Run it from the directory cghw2 runs from, as it reads render/ and
+// shader/. Prints one line per benchmark; --json=FILE also saves them in a
+// form meant for comparing commits.
+#include <tiny_obj_loader.h>
+#include "bmp_reader.h"
+#include "camera.h"
+#include "culling.h"
+#include "scene_graph.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+#ifndef CGHW2_PATH
+#define CGHW2_PATH "./cghw2"
+#endif
+
+namespace {
+
+// Times are in milliseconds; fields below 0 are not known.
+struct result {
+    std::string name;
+    unsigned int iterations;
+    double median_ms, min_ms, p95_ms, p99_ms;
+    double rate;
+    const char *unit;
+    std::string error;
+};
+
+std::vector<result> results;
+std::string filter;
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool wanted(const std::string &name) {
+    return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+void report(const result &r) {
+    results.push_back(r);
+    printf("%-28s", r.name.c_str());
+    if (!r.error.empty()) {
+        printf(" failed: %s\n", r.error.c_str());
+        return;
+    }
+    printf(" median %9.4f ms", r.median_ms);
+    if (r.min_ms >= 0)
+        printf("  min %9.4f ms", r.min_ms);
+    if (r.p95_ms >= 0)
+        printf("  p95 %9.4f ms  p99 %9.4f ms", r.p95_ms, r.p99_ms);
+    printf("  %10.2f %s\n", r.rate, r.unit);
+    fflush(stdout);
+}
+
+// Runs 'fn' once to warm up, then until 0.25 s have passed, at least 5
+// times. 'work' per run over the median time gives the rate.
+void measure(const std::string &name, double work, const char *unit, const std::function<void()> &fn) {
+    if (!wanted(name))
+        return;
+    fn();
+    std::vector<double> times;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (times.size() < 1000 && (times.size() < 5 || seconds_since(start) < 0.25)) {
+        std::chrono::steady_clock::time_point run = std::chrono::steady_clock::now();
+        fn();
+        times.push_back(1000.0 * seconds_since(run));
+    }
+    std::sort(times.begin(), times.end());
+    result r = {name, (unsigned int) times.size(), times[times.size() / 2], times[0], -1, -1, 0, unit,
+                std::string()};
+    r.rate = work / (r.median_ms / 1000.0);
+    report(r);
+}
+
+bool read_file(const char *filename, std::string &data) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+        return false;
+    std::ostringstream out;
+    out << in.rdbuf();
+    data = out.str();
+    return true;
+}
+
+void bench_parse(const char *filename) {
+    std::string data;
+    if (!read_file(filename, data)) {
+        std::cerr << "Cannot open file [" << filename << "]" << std::endl;
+        return;
+    }
+    std::string name = filename;
+    name = name.substr(name.find_last_of('/') + 1);
+    double mb = data.size() / (1024.0 * 1024.0);
+    tinyobj::MaterialFileReader reader("");
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    measure("parse/" + name, mb, "MB/s", [&]() {
+        tinyobj::LoadObj(shapes, materials, data.data(), data.size(), reader);
+    });
+    measure("parse_parallel/" + name, mb, "MB/s", [&]() {
+        tinyobj::LoadObjParallel(shapes, materials, data.data(), data.size(), reader);
+    });
+}
+
+// A side x side grid of quads. With 'shared', corners reuse the grid's
+// vertices (6 triangles each), so the parser's vertex dedup mostly hits;
+// otherwise every corner has its own v/vt/vn and every lookup misses.
+std::string synthetic_obj(int side, bool shared) {
+    std::ostringstream obj;
+    int n = side + 1;
+    if (shared) {
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++)
+                obj << "v " << x << " " << y << " 0\nvt " << (float) x / side << " "
+                    << (float) y / side << "\nvn 0 0 1\n";
+        }
+        for (int y = 0; y < side; y++) {
+            for (int x = 0; x < side; x++) {
+                int a = y * n + x + 1, b = a + 1, c = a + n, d = c + 1;
+                obj << "f " << a << "/" << a << "/" << a << " " << b << "/" << b << "/" << b << " "
+                    << d << "/" << d << "/" << d << "\n";
+                obj << "f " << a << "/" << a << "/" << a << " " << d << "/" << d << "/" << d << " "
+                    << c << "/" << c << "/" << c << "\n";
+            }
+        }
+    } else {
+        int v = 1;
+        for (int y = 0; y < side; y++) {
+            for (int x = 0; x < side; x++) {
+                const int corners[6][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 0}, {1, 1}, {0, 1}};
+                for (int k = 0; k < 6; k++)
+                    obj << "v " << x + corners[k][0] << " " << y + corners[k][1] << " 0\nvt "
+                        << (float) (x + corners[k][0]) / side << " "
+                        << (float) (y + corners[k][1]) / side << "\nvn 0 0 1\n";
+                for (int t = 0; t < 2; t++, v += 3)
+                    obj << "f " << v << "/" << v << "/" << v << " " << v + 1 << "/" << v + 1 << "/"
+                        << v + 1 << " " << v + 2 << "/" << v + 2 << "/" << v + 2 << "\n";
+            }
+        }
+    }
+    return obj.str();
+}
+
+void bench_dedup(int side) {
+    tinyobj::MaterialFileReader reader("");
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    double corners = 6.0 * side * side / 1e6;
+    for (int shared = 1; shared >= 0; shared--) {
+        std::string data = synthetic_obj(side, shared != 0);
+        std::ostringstream name;
+        name << "dedup/" << (shared ? "grid_" : "soup_") << side;
+        measure(name.str(), corners, "Mcorners/s", [&]() {
+            tinyobj::LoadObj(shapes, materials, data.data(), data.size(), reader);
+        });
+    }
+}
+
+void bench_bmp(const char *filename) {
+    std::string name = filename;
+    name = "bmp/" + name.substr(name.find_last_of('/') + 1);
+    bmp_reader reader;
+    std::string error = reader.open(filename);
+    if (!error.empty()) {
+        std::cerr << error << std::endl;
+        return;
+    }
+    std::vector<unsigned char> pixels(reader.decoded_size());
+    double mb = reader.size() / (1024.0 * 1024.0);
+    reader.close();
+    measure(name, mb, "MB/s", [&]() {
+        bmp_reader r;
+        if (r.open(filename).empty())
+            r.decode(pixels.data());
+    });
+}
+
+// scene_graph::update() on an 8-ary tree of 'count' nodes with each
+// instruction set the CPU has: once with every node moved, and once with
+// 1% of the nodes, picked at random, moved along with their subtrees.
+void bench_transform(int count) {
+    scene_graph graph;
+    for (int i = 0; i < count; i++) {
+        unsigned int node = i == 0 ? graph.add() : graph.add((i - 1) / 8);
+        graph.set_translation(node, (i % 7) * 0.5f, (i % 5) * 0.5f, (i % 3) * 0.5f);
+        graph.set_rotation(node, i * 0.001f, 0, 1, 0);
+        graph.set_scale(node, 0.99f, 0.99f, 0.99f);
+    }
+    graph.update();
+    for (int level = SIMD_SCALAR; level <= best_simd_level(); level++) {
+        graph.set_simd((simd_level) level);
+        std::ostringstream name;
+        name << "transform/" << simd_name((simd_level) level) << "_" << count;
+        int round = 0;
+        measure(name.str() + "_all", count / 1e6, "Mnodes/s", [&]() {
+            graph.set_rotation(0, ++round * 0.1f, 0, 1, 0);
+            graph.update();
+        });
+        srand(1);
+        measure(name.str() + "_1pct", count / 100 / 1e6, "Mnodes/s", [&]() {
+            for (int i = 0; i < count / 100; i++)
+                graph.set_rotation(rand() % count, ++round * 0.1f, 0, 1, 0);
+            graph.update();
+        });
+    }
+}
+
+// Boxes of random size scattered over 80 units around the origin, of
+// which about a quarter are in view.
+void bench_cull(int count) {
+    culler objects;
+    srand(2);
+    for (int i = 0; i < count; i++) {
+        float half = 0.2f + rand() % 100 / 100.0f;
+        bounds b;
+        for (int k = 0; k < 3; k++) {
+            b.center[k] = rand() % 8000 / 100.0f - 40;
+            b.min[k] = b.center[k] - half;
+            b.max[k] = b.center[k] + half;
+        }
+        b.radius = half * std::sqrt(3.0f);
+        objects.add(b);
+    }
+    float vp[16];
+    camera_view_projection(vp);
+    frustum f = extract_frustum(vp);
+    std::vector<unsigned int> visible;
+    thread_pool workers;
+    std::ostringstream name;
+    name << "cull/" << count;
+    measure(name.str(), count / 1e6, "Mobjects/s", [&]() { objects.cull(f, nullptr, visible); });
+    name << "_threads" << workers.size();
+    measure(name.str(), count / 1e6, "Mobjects/s", [&]() { objects.cull(f, &workers, visible); });
+}
+
+// Renders a scene with 'args' in cghw2, offscreen, and takes the frame
+// percentiles from its --profile output.
+void bench_scene(const std::string &cghw2, const std::string &name, const std::string &args,
+                 int frames) {
+    if (!wanted(name))
+        return;
+    result r = {name, (unsigned int) frames, -1, -1, -1, -1, 0, "fps", std::string()};
+    const char *profile = "cghw2_bench_profile.csv";
+    std::ostringstream command;
+    command << "\"" << cghw2 << "\" --headless --dt=0.016 --frames=" << frames
+            << " --profile=" << profile << " " << args << " 2>&1";
+    FILE *pipe = popen(command.str().c_str(), "r");
+    if (!pipe) {
+        r.error = "cannot run " + cghw2;
+        report(r);
+        return;
+    }
+    char line[512];
+    std::string last_line;
+    double ms_per_frame = -1;
+    while (fgets(line, sizeof(line), pipe)) {
+        int done;
+        double total, per_frame;
+        if (sscanf(line, "%d frames in %lf ms, %lf ms/frame", &done, &total, &per_frame) == 3)
+            ms_per_frame = per_frame;
+        last_line = line;
+    }
+    int status = pclose(pipe);
+
+    std::ifstream csv(profile);
+    std::string row;
+    while (std::getline(csv, row)) {
+        double mean;
+        if (row.compare(0, 10, "frame,cpu,") == 0)
+            sscanf(row.c_str() + 10, "%*u,%lf,%lf,%lf,%lf", &mean, &r.median_ms, &r.p95_ms, &r.p99_ms);
+    }
+    csv.close();
+    remove(profile);
+
+    if (status != 0 || ms_per_frame <= 0 || r.median_ms < 0) {
+        while (!last_line.empty() && (last_line.back() == '\n' || last_line.back() == '\r'))
+            last_line.pop_back();
+        r.error = last_line.empty() ? "no output" : last_line;
+        r.median_ms = r.p95_ms = r.p99_ms = -1;
+    } else {
+        r.rate = 1000.0 / ms_per_frame;
+    }
+    report(r);
+}
+
+// Times cghw2's shader stage from its "shaders:" line, 'runs' times with
+// --no-shader-cache (every program compiled) and 'runs' times with the
+// binaries one earlier run saved.
+void bench_shaders(const std::string &cghw2, int runs) {
+    const char *modes[2] = {"startup/shaders_cold", "startup/shaders_warm"};
+    for (int warm = 0; warm < 2; warm++) {
+        if (!wanted(modes[warm]))
+            continue;
+        result r = {modes[warm], (unsigned int) runs, -1, -1, -1, -1, 0, "programs/s",
+                    std::string()};
+        std::ostringstream command;
+        command << "\"" << cghw2 << "\" --headless --frames=1" << (warm ? "" : " --no-shader-cache")
+                << " 2>&1";
+        std::vector<double> times;
+        unsigned int programs = 0, from_disk = 0;
+        std::string last_line;
+        // The first warm run saves the binaries the others load
+        for (int i = warm ? -1 : 0; i < runs && r.error.empty(); i++) {
+            FILE *pipe = popen(command.str().c_str(), "r");
+            if (!pipe) {
+                r.error = "cannot run " + cghw2;
+                break;
+            }
+            char line[512];
+            double ms = -1;
+            while (fgets(line, sizeof(line), pipe)) {
+                unsigned int requests;
+                if (sscanf(line, "shaders: %u requested, %u programs, %u from saved binaries, %lf ms",
+                           &requests, &programs, &from_disk, &ms) == 4)
+                    continue;
+                last_line = line;
+            }
+            if (pclose(pipe) != 0 || ms < 0) {
+                while (!last_line.empty() && (last_line.back() == '\n' || last_line.back() == '\r'))
+                    last_line.pop_back();
+                r.error = last_line.empty() ? "no output" : last_line;
+            } else if (i >= 0) {
+                times.push_back(ms);
+            }
+        }
+        if (r.error.empty() && warm && from_disk < programs)
+            r.error = "binaries not saved; the driver has no program binary formats";
+        if (r.error.empty()) {
+            std::sort(times.begin(), times.end());
+            r.median_ms = times[times.size() / 2];
+            r.min_ms = times[0];
+            r.rate = programs / (r.median_ms / 1000.0);
+        }
+        report(r);
+    }
+}
+
+std::string json_string(const std::string &text) {
+    std::string quoted = "\"";
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '"' || text[i] == '\\')
+            quoted += '\\';
+        if ((unsigned char) text[i] >= 0x20)
+            quoted += text[i];
+    }
+    return quoted + "\"";
+}
+
+bool write_json(const std::string &filename, const std::string &label) {
+    FILE *fp = fopen(filename.c_str(), "w");
+    if (!fp)
+        return false;
+    fprintf(fp, "{\n  \"label\": %s,\n  \"threads\": %u,\n  \"benchmarks\": [", json_string(label).c_str(),
+            std::thread::hardware_concurrency());
+    for (size_t i = 0; i < results.size(); i++) {
+        const result &r = results[i];
+        fprintf(fp, "%s\n    {\"name\": %s, \"iterations\": %u", i ? "," : "", json_string(r.name).c_str(),
+                r.iterations);
+        if (!r.error.empty()) {
+            fprintf(fp, ", \"error\": %s}", json_string(r.error).c_str());
+            continue;
+        }
+        fprintf(fp, ", \"median_ms\": %.6f", r.median_ms);
+        if (r.min_ms >= 0)
+            fprintf(fp, ", \"min_ms\": %.6f", r.min_ms);
+        if (r.p95_ms >= 0)
+            fprintf(fp, ", \"p95_ms\": %.6f, \"p99_ms\": %.6f", r.p95_ms, r.p99_ms);
+        fprintf(fp, ", \"rate\": %.6g, \"unit\": %s}", r.rate, json_string(r.unit).c_str());
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    return fclose(fp) == 0;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    std::string json_path, label, cghw2 = CGHW2_PATH;
+    int objects = 1000, frames = 300, nodes = 1000000;
+    bool scenes = true, software = true;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 7, "--json=") == 0)
+            json_path = arg.substr(7);
+        else if (arg.compare(0, 8, "--label=") == 0)
+            label = arg.substr(8);
+        else if (arg.compare(0, 9, "--filter=") == 0)
+            filter = arg.substr(9);
+        else if (arg.compare(0, 10, "--objects=") == 0)
+            objects = atoi(arg.c_str() + 10);
+        else if (arg.compare(0, 8, "--nodes=") == 0)
+            nodes = atoi(arg.c_str() + 8);
+        else if (arg.compare(0, 9, "--frames=") == 0)
+            frames = atoi(arg.c_str() + 9);
+        else if (arg.compare(0, 8, "--cghw2=") == 0)
+            cghw2 = arg.substr(8);
+        else if (arg == "--no-scenes")
+            scenes = false;
+        else if (arg == "--hardware-gl")
+            software = false;
+        else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    bench_parse("render/sun.obj");
+    bench_parse("render/earth.obj");
+    bench_dedup(256);
+    bench_bmp("render/sun.bmp");
+    bench_bmp("render/bloom.bmp");
+    bench_transform(nodes);
+    bench_cull(100000);
+
+    if (scenes) {
+        // Mesa's llvmpipe, so numbers do not depend on the GPU
+        if (software) {
+#ifdef _WIN32
+            _putenv("LIBGL_ALWAYS_SOFTWARE=1");
+#else
+            setenv("LIBGL_ALWAYS_SOFTWARE", "1", 1);
+#endif
+        }
+        std::ostringstream n;
+        n << objects;
+        bench_scene(cghw2, "scene/instanced_" + n.str(), "--instances=" + n.str(), frames);
+        bench_scene(cghw2, "scene/queue_" + n.str(), "--instances=" + n.str() + " --no-instancing",
+                    frames);
+        bench_scene(cghw2, "scene/queue_record_" + n.str(),
+                    "--instances=" + n.str() + " --no-instancing --parallel-record", frames);
+        bench_scene(cghw2, "scene/queue_lod_" + n.str(),
+                    "--instances=" + n.str() + " --no-instancing --lod", frames);
+        bench_scene(cghw2, "scene/pool_" + n.str(), "--instances=" + n.str() + " --pool", frames);
+        bench_scene(cghw2, "scene/pool_occlusion_" + n.str(),
+                    "--instances=" + n.str() + " --pool --occlusion", frames);
+        bench_shaders(cghw2, 5);
+    }
+
+    if (!json_path.empty()) {
+        if (!write_json(json_path, label)) {
+            std::cerr << "Cannot write file [" << json_path << "]" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "results saved to " << json_path << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,282 @@
+#include "bmp_reader.h"
+
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+
+enum {
+    BMP_RGB = 0,
+    BMP_RLE8 = 1,
+    BMP_RLE4 = 2,
+    BMP_BITFIELDS = 3,
+    BMP_ALPHABITFIELDS = 6
+};
+
+static const size_t kFileHeaderSize = 14;
+// File header, the largest info header (BITMAPV5HEADER), four masks and a
+// full palette: everything before the pixels, read at once.
+static const size_t kHeaderRead = kFileHeaderSize + 124 + 16 + 256 * 4;
+static const unsigned int kMaxDimension = 1 << 16;
+static const size_t kMaxDecodedSize = (size_t) 1 << 30;
+// Pixel data is read in blocks of whole rows of about this size.
+static const size_t kBlockSize = 256 * 1024;
+
+static unsigned int read_u16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int read_u32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+bmp_reader::bmp_reader()
+    : fp(nullptr), file_size(0), data_offset(0), data_size(0), w(0), h(0), bpp(0),
+      compression(BMP_RGB), top_down(false), row_size(0) { }
+
+bmp_reader::~bmp_reader() {
+    close();
+}
+
+void bmp_reader::close() {
+    if (fp)
+        fclose(fp);
+    fp = nullptr;
+}
+
+std::string bmp_reader::open(const char *filename) {
+    close();
+    name = filename;
+    struct stat st;
+    fp = fopen(filename, "rb");
+    if (!fp || fstat(fileno(fp), &st) != 0) {
+        close();
+        return std::string("Cannot open file [") + filename + "]";
+    }
+    file_size = st.st_size;
+
+    unsigned char header[kHeaderRead];
+    memset(header, 0, sizeof(header));
+    size_t got = fread(header, 1, sizeof(header), fp);
+    std::string invalid = std::string("Invalid BMP file [") + filename + "]: ";
+    if (got < kFileHeaderSize + 40 || header[0] != 'B' || header[1] != 'M')
+        return invalid + "not a BMP file";
+
+    data_offset = read_u32(header + 10);
+    const unsigned char *info = header + kFileHeaderSize;
+    unsigned int info_size = read_u32(info);
+    if (info_size < 40 || info_size > 124)
+        return invalid + "unsupported header size";
+
+    int width = (int) read_u32(info + 4);
+    int height = (int) read_u32(info + 8);
+    unsigned int planes = read_u16(info + 12);
+    bpp = read_u16(info + 14);
+    compression = read_u32(info + 16);
+    data_size = read_u32(info + 20);
+    unsigned int colors = read_u32(info + 32);
+
+    top_down = height < 0;
+    w = width > 0 ? width : 0;
+    h = top_down ? 0u - (unsigned int) height : height;
+    if (w == 0 || h == 0 || w > kMaxDimension || h > kMaxDimension ||
+        decoded_size() > kMaxDecodedSize)
+        return invalid + "bad dimensions";
+    if (planes != 1)
+        return invalid + "bad plane count";
+
+    bool ok;
+    switch (compression) {
+    case BMP_RGB:
+        ok = bpp == 1 || bpp == 4 || bpp == 8 || bpp == 16 || bpp == 24 || bpp == 32;
+        break;
+    case BMP_RLE8:
+        ok = bpp == 8 && !top_down;
+        break;
+    case BMP_RLE4:
+        ok = bpp == 4 && !top_down;
+        break;
+    case BMP_BITFIELDS:
+    case BMP_ALPHABITFIELDS:
+        ok = bpp == 16 || bpp == 32;
+        break;
+    default:
+        ok = false;
+    }
+    if (!ok)
+        return invalid + "unsupported format";
+
+    // Bit masks live inside V2+ headers, or right after a 40-byte one.
+    size_t extra = 0;
+    memset(mask, 0, sizeof(mask));
+    if (compression == BMP_BITFIELDS || compression == BMP_ALPHABITFIELDS) {
+        const unsigned char *m = info + 40;
+        if (info_size == 40)
+            extra = compression == BMP_ALPHABITFIELDS ? 16 : 12;
+        mask[2] = read_u32(m);
+        mask[1] = read_u32(m + 4);
+        mask[0] = read_u32(m + 8);
+        if (info_size >= 56 || compression == BMP_ALPHABITFIELDS)
+            mask[3] = read_u32(m + 12);
+    } else if (bpp == 16) {
+        mask[2] = 0x7c00;
+        mask[1] = 0x03e0;
+        mask[0] = 0x001f;
+    }
+    for (int c = 0; c < 4; c++) {
+        shift[c] = 0;
+        max[c] = 0;
+        if (mask[c] == 0)
+            continue;
+        while (!((mask[c] >> shift[c]) & 1))
+            shift[c]++;
+        max[c] = mask[c] >> shift[c];
+    }
+
+    memset(palette, 0, sizeof(palette));
+    if (bpp <= 8) {
+        unsigned int count = colors ? colors : 1u << bpp;
+        if (count > 256)
+            return invalid + "bad palette size";
+        size_t start = kFileHeaderSize + info_size + extra;
+        if (start + 4 * count > got || start + 4 * count > data_offset)
+            return invalid + "truncated palette";
+        for (unsigned int i = 0; i < count; i++) {
+            memcpy(palette[i], header + start + 4 * i, 3);
+            palette[i][3] = 255;
+        }
+    }
+
+    row_size = (((size_t) w * bpp + 31) / 32) * 4;
+    if (data_offset > file_size)
+        return invalid + "pixel data past the end of the file";
+    if (compression == BMP_RLE8 || compression == BMP_RLE4) {
+        if (data_size == 0 || data_size > file_size - data_offset)
+            data_size = file_size - data_offset;
+    } else if (row_size * h > file_size - data_offset) {
+        return invalid + "truncated pixel data";
+    }
+    return std::string();
+}
+
+// One row of 16-bit, bit field or palette pixels to BGRA.
+void bmp_reader::convert_row(const unsigned char *src, unsigned char *dst) const {
+    switch (bpp) {
+    case 16:
+    case 32:
+        for (unsigned int x = 0; x < w; x++, dst += 4) {
+            unsigned int v = bpp == 16 ? read_u16(src + 2 * x) : read_u32(src + 4 * x);
+            for (int c = 0; c < 4; c++) {
+                if (max[c] == 0)
+                    dst[c] = c == 3 ? 255 : 0;
+                else
+                    dst[c] = (((unsigned long long) ((v & mask[c]) >> shift[c])) * 255 + max[c] / 2) /
+                             max[c];
+            }
+        }
+        return;
+    case 8:
+        for (unsigned int x = 0; x < w; x++, dst += 4)
+            memcpy(dst, palette[src[x]], 4);
+        return;
+    case 4:
+        for (unsigned int x = 0; x < w; x++, dst += 4)
+            memcpy(dst, palette[x & 1 ? src[x / 2] & 15 : src[x / 2] >> 4], 4);
+        return;
+    case 1:
+        for (unsigned int x = 0; x < w; x++, dst += 4)
+            memcpy(dst, palette[(src[x / 8] >> (7 - x % 8)) & 1], 4);
+        return;
+    }
+}
+
+std::string bmp_reader::decode_rows(unsigned char *dst) {
+    std::string truncated = std::string("Invalid BMP file [") + name + "]: truncated pixel data";
+    size_t dst_row = decoded_stride();
+
+    // Rows already in the decoded format are read in place.
+    if (bpp == 24 || (bpp == 32 && compression == BMP_RGB)) {
+        if (!top_down)
+            return fread(dst, row_size, h, fp) == h ? std::string() : truncated;
+        for (unsigned int y = 0; y < h; y++) {
+            if (fread(dst + (h - 1 - y) * dst_row, row_size, 1, fp) != 1)
+                return truncated;
+        }
+        return std::string();
+    }
+
+    size_t block_rows = kBlockSize / row_size;
+    if (block_rows == 0)
+        block_rows = 1;
+    if (block_rows > h)
+        block_rows = h;
+    std::vector<unsigned char> block(block_rows * row_size);
+
+    for (unsigned int y = 0; y < h; y += block_rows) {
+        size_t rows = h - y < block_rows ? h - y : block_rows;
+        if (fread(&block[0], row_size, rows, fp) != rows)
+            return truncated;
+        for (size_t r = 0; r < rows; r++) {
+            size_t row = top_down ? h - 1 - (y + r) : y + r;
+            convert_row(&block[r * row_size], dst + row * dst_row);
+        }
+    }
+    return std::string();
+}
+
+// RLE data is small next to the image, so it is read whole. Pixels the
+// encoding skips are left transparent black.
+std::string bmp_reader::decode_rle(unsigned char *dst) {
+    std::vector<unsigned char> data(data_size);
+    if (data_size > 0 && fread(&data[0], 1, data_size, fp) != data_size)
+        return std::string("Invalid BMP file [") + name + "]: truncated pixel data";
+    memset(dst, 0, decoded_size());
+
+    bool rle8 = compression == BMP_RLE8;
+    size_t p = 0, end = data.size();
+    unsigned int x = 0, y = 0;
+    while (p + 2 <= end && y < h) {
+        unsigned int n = data[p], c = data[p + 1];
+        p += 2;
+        if (n > 0) {
+            // n pixels of one index, or of two alternating nibbles
+            for (unsigned int i = 0; i < n && x < w; i++, x++) {
+                unsigned int index = rle8 ? c : (i & 1 ? c & 15 : c >> 4);
+                memcpy(dst + 4 * ((size_t) y * w + x), palette[index], 4);
+            }
+        } else if (c == 0) {
+            x = 0;
+            y++;
+        } else if (c == 1) {
+            break;
+        } else if (c == 2) {
+            if (p + 2 > end)
+                break;
+            x += data[p];
+            y += data[p + 1];
+            p += 2;
+        } else {
+            // c literal indices, padded to a 16-bit boundary
+            size_t bytes = rle8 ? c : (c + 1) / 2;
+            if (p + bytes > end)
+                return std::string("Invalid BMP file [") + name + "]: truncated RLE data";
+            for (unsigned int i = 0; i < c; i++, x++) {
+                unsigned int index = rle8 ? data[p + i] :
+                                     (i & 1 ? data[p + i / 2] & 15 : data[p + i / 2] >> 4);
+                if (x < w)
+                    memcpy(dst + 4 * ((size_t) y * w + x), palette[index], 4);
+            }
+            p += (bytes + 1) & ~(size_t) 1;
+        }
+    }
+    return std::string();
+}
+
+std::string bmp_reader::decode(unsigned char *dst) {
+    if (!fp)
+        return std::string("BMP file [") + name + "] is not open";
+    if (fseek(fp, data_offset, SEEK_SET) != 0)
+        return std::string("Cannot read file [") + name + "]";
+    if (compression == BMP_RLE8 || compression == BMP_RLE4)
+        return decode_rle(dst);
+    return decode_rows(dst);
+}
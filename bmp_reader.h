@@ -0,0 +1,58 @@
+#ifndef BMP_READER_H
+#define BMP_READER_H
+
+#include <cstdio>
+#include <string>
+
+// Reads Windows BMP files: 1, 4, 8, 16, 24 and 32 bits per pixel,
+// uncompressed, RLE4, RLE8 and BI_BITFIELDS, bottom-up or top-down.
+//
+// open() reads the file header, info header, masks and palette in a single
+// read and validates them against the file size. decode() then streams the
+// pixel array straight into the caller's memory (a staging buffer or a
+// mapped pixel-unpack buffer) with the bottom row first, as glTexImage
+// expects. 24-bit images stay BGR with rows padded to 4 bytes, which GL's
+// default unpack alignment reads as is; everything else becomes BGRA.
+class bmp_reader {
+public:
+    bmp_reader();
+    ~bmp_reader();
+
+    // Both return an empty string on success, like tinyobj::LoadObj.
+    std::string open(const char *filename);
+    // 'dst' must hold decoded_size() bytes.
+    std::string decode(unsigned char *dst);
+
+    // 3 (BGR) or 4 (BGRA) bytes per decoded pixel
+    unsigned int pixel_size() const { return bpp == 24 ? 3 : 4; }
+    size_t decoded_stride() const { return ((size_t) w * pixel_size() + 3) & ~(size_t) 3; }
+    size_t decoded_size() const { return decoded_stride() * h; }
+
+    void close();
+
+    unsigned int width() const { return w; }
+    unsigned int height() const { return h; }
+    unsigned int bits() const { return bpp; }
+    unsigned long long size() const { return file_size; } // of the file, in bytes
+
+private:
+    bmp_reader(const bmp_reader &);
+    bmp_reader &operator=(const bmp_reader &);
+
+    std::string decode_rows(unsigned char *dst);
+    std::string decode_rle(unsigned char *dst);
+    void convert_row(const unsigned char *src, unsigned char *dst) const;
+
+    FILE *fp;
+    std::string name;
+    unsigned long long file_size;
+    unsigned int data_offset, data_size;
+    unsigned int w, h, bpp, compression;
+    bool top_down;
+    size_t row_size; // in the file, padded to 4 bytes
+
+    unsigned char palette[256][4]; // BGRA
+    unsigned int mask[4], shift[4], max[4]; // B, G, R, A for 16 and 32 bits
+};
+
+#endif // BMP_READER_H
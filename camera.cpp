@@ -0,0 +1,12 @@
+#include "camera.h"
+
+#include <cstring>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+void camera_view_projection(float *vp) {
+    glm::mat4 m = glm::perspective(glm::radians(kFovY), 640.0f / 480, kNear, kFar) *
+                  glm::lookAt(glm::vec3(20.0f), glm::vec3(), glm::vec3(0, 1, 0));
+    memcpy(vp, glm::value_ptr(m), sizeof(m));
+}
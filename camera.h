@@ -0,0 +1,12 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+// The fixed camera every scene is drawn with: 45 degrees, 4:3, from
+// (20, 20, 20) looking at the origin.
+const float kFovY = 45.0f; // in degrees
+const float kNear = 1.0f, kFar = 100.0f;
+
+// Fills 'vp' with the camera's view-projection matrix, column-major.
+void camera_view_projection(float *vp);
+
+#endif // CAMERA_H
@@ -0,0 +1,256 @@
+#include "culling.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CULLING_SSE 1
+#include <emmintrin.h>
+#endif
+
+// Entries per chunk of a parallel cull(); a multiple of 4.
+static const size_t kGrain = 4096;
+
+bounds compute_bounds(const float *positions, size_t count) {
+    bounds b;
+    for (int k = 0; k < 3; k++) {
+        b.min[k] = count ? positions[k] : 0;
+        b.max[k] = b.min[k];
+    }
+    for (size_t i = 1; i < count; i++) {
+        for (int k = 0; k < 3; k++) {
+            float v = positions[3 * i + k];
+            if (v < b.min[k])
+                b.min[k] = v;
+            if (v > b.max[k])
+                b.max[k] = v;
+        }
+    }
+    float r2 = 0;
+    for (int k = 0; k < 3; k++)
+        b.center[k] = (b.min[k] + b.max[k]) * 0.5f;
+    for (size_t i = 0; i < count; i++) {
+        float dx = positions[3 * i] - b.center[0];
+        float dy = positions[3 * i + 1] - b.center[1];
+        float dz = positions[3 * i + 2] - b.center[2];
+        float d2 = dx * dx + dy * dy + dz * dz;
+        if (d2 > r2)
+            r2 = d2;
+    }
+    b.radius = std::sqrt(r2);
+    return b;
+}
+
+bounds transform_bounds(const bounds &local, const float *model) {
+    bounds b;
+    float scale2 = 0;
+    for (int col = 0; col < 3; col++) {
+        const float *c = model + 4 * col;
+        float len2 = c[0] * c[0] + c[1] * c[1] + c[2] * c[2];
+        if (len2 > scale2)
+            scale2 = len2;
+    }
+    for (int row = 0; row < 3; row++) {
+        b.center[row] = model[12 + row];
+        b.min[row] = b.max[row] = model[12 + row];
+        for (int col = 0; col < 3; col++) {
+            float m = model[4 * col + row];
+            b.center[row] += m * local.center[col];
+            // The box corner that is furthest in each direction
+            float lo = m * local.min[col], hi = m * local.max[col];
+            b.min[row] += lo < hi ? lo : hi;
+            b.max[row] += lo < hi ? hi : lo;
+        }
+    }
+    b.radius = local.radius * std::sqrt(scale2);
+    return b;
+}
+
+bounds merge_bounds(const bounds &a, const bounds &b) {
+    bounds m;
+    for (int k = 0; k < 3; k++) {
+        m.min[k] = a.min[k] < b.min[k] ? a.min[k] : b.min[k];
+        m.max[k] = a.max[k] > b.max[k] ? a.max[k] : b.max[k];
+        m.center[k] = (m.min[k] + m.max[k]) * 0.5f;
+    }
+    // Far enough to reach around either sphere
+    float ra = 0, rb = 0;
+    for (int k = 0; k < 3; k++) {
+        ra += (a.center[k] - m.center[k]) * (a.center[k] - m.center[k]);
+        rb += (b.center[k] - m.center[k]) * (b.center[k] - m.center[k]);
+    }
+    ra = std::sqrt(ra) + a.radius;
+    rb = std::sqrt(rb) + b.radius;
+    m.radius = ra > rb ? ra : rb;
+    return m;
+}
+
+frustum extract_frustum(const float *vp) {
+    // Rows of the matrix combined, after Gribb and Hartmann
+    frustum f;
+    for (int p = 0; p < 6; p++) {
+        int row = p / 2;
+        float sign = p % 2 ? -1.0f : 1.0f;
+        float len2 = 0;
+        for (int k = 0; k < 4; k++)
+            f.planes[p][k] = vp[4 * k + 3] + sign * vp[4 * k + row];
+        for (int k = 0; k < 3; k++)
+            len2 += f.planes[p][k] * f.planes[p][k];
+        float inv = len2 > 0 ? 1.0f / std::sqrt(len2) : 0.0f;
+        for (int k = 0; k < 4; k++)
+            f.planes[p][k] *= inv;
+    }
+    return f;
+}
+
+culler::culler() {
+    last_stats.tested = 0;
+    last_stats.visible = 0;
+    last_stats.seconds = 0;
+}
+
+unsigned int culler::add(const bounds &world) {
+    unsigned int entry = cx.size();
+    cx.push_back(0);
+    cy.push_back(0);
+    cz.push_back(0);
+    radius.push_back(0);
+    min_x.push_back(0);
+    min_y.push_back(0);
+    min_z.push_back(0);
+    max_x.push_back(0);
+    max_y.push_back(0);
+    max_z.push_back(0);
+    set(entry, world);
+    return entry;
+}
+
+void culler::set(unsigned int entry, const bounds &world) {
+    cx[entry] = world.center[0];
+    cy[entry] = world.center[1];
+    cz[entry] = world.center[2];
+    radius[entry] = world.radius;
+    min_x[entry] = world.min[0];
+    min_y[entry] = world.min[1];
+    min_z[entry] = world.min[2];
+    max_x[entry] = world.max[0];
+    max_y[entry] = world.max[1];
+    max_z[entry] = world.max[2];
+}
+
+bounds culler::get(unsigned int entry) const {
+    bounds b;
+    b.center[0] = cx[entry];
+    b.center[1] = cy[entry];
+    b.center[2] = cz[entry];
+    b.radius = radius[entry];
+    b.min[0] = min_x[entry];
+    b.min[1] = min_y[entry];
+    b.min[2] = min_z[entry];
+    b.max[0] = max_x[entry];
+    b.max[1] = max_y[entry];
+    b.max[2] = max_z[entry];
+    return b;
+}
+
+void culler::clear() {
+    cx.clear();
+    cy.clear();
+    cz.clear();
+    radius.clear();
+    min_x.clear();
+    min_y.clear();
+    min_z.clear();
+    max_x.clear();
+    max_y.clear();
+    max_z.clear();
+}
+
+void culler::cull_range(const frustum &f, size_t begin, size_t end,
+                        std::vector<unsigned int> &out) const {
+    size_t i = begin;
+#ifdef CULLING_SSE
+    __m128 a[6], b[6], c[6], d[6];
+    for (int p = 0; p < 6; p++) {
+        a[p] = _mm_set1_ps(f.planes[p][0]);
+        b[p] = _mm_set1_ps(f.planes[p][1]);
+        c[p] = _mm_set1_ps(f.planes[p][2]);
+        d[p] = _mm_set1_ps(f.planes[p][3]);
+    }
+    for (; i + 4 <= end; i += 4) {
+        __m128 x = _mm_loadu_ps(&cx[i]), y = _mm_loadu_ps(&cy[i]), z = _mm_loadu_ps(&cz[i]);
+        __m128 r = _mm_loadu_ps(&radius[i]);
+        __m128 neg_r = _mm_sub_ps(_mm_setzero_ps(), r);
+        __m128 outside = _mm_setzero_ps();
+        __m128 crossing = _mm_setzero_ps();
+        for (int p = 0; p < 6; p++) {
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[p], x), _mm_mul_ps(b[p], y)),
+                                     _mm_add_ps(_mm_mul_ps(c[p], z), d[p]));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, neg_r));
+            crossing = _mm_or_ps(crossing, _mm_cmplt_ps(dist, r));
+        }
+        int out_mask = _mm_movemask_ps(outside);
+        if (out_mask == 15)
+            continue;
+        int cross_mask = _mm_movemask_ps(crossing);
+        for (int k = 0; k < 4; k++) {
+            if (out_mask & (1 << k))
+                continue;
+            size_t e = i + k;
+            if (cross_mask & (1 << k)) {
+                bool inside = true;
+                for (int p = 0; p < 6 && inside; p++) {
+                    const float *pl = f.planes[p];
+                    float px = pl[0] > 0 ? max_x[e] : min_x[e];
+                    float py = pl[1] > 0 ? max_y[e] : min_y[e];
+                    float pz = pl[2] > 0 ? max_z[e] : min_z[e];
+                    inside = pl[0] * px + pl[1] * py + pl[2] * pz + pl[3] >= 0;
+                }
+                if (!inside)
+                    continue;
+            }
+            out.push_back(e);
+        }
+    }
+#endif
+    for (; i < end; i++) {
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; p++) {
+            const float *pl = f.planes[p];
+            float dist = pl[0] * cx[i] + pl[1] * cy[i] + pl[2] * cz[i] + pl[3];
+            if (dist < -radius[i])
+                inside = false;
+            else if (dist < radius[i]) {
+                float px = pl[0] > 0 ? max_x[i] : min_x[i];
+                float py = pl[1] > 0 ? max_y[i] : min_y[i];
+                float pz = pl[2] > 0 ? max_z[i] : min_z[i];
+                inside = pl[0] * px + pl[1] * py + pl[2] * pz + pl[3] >= 0;
+            }
+        }
+        if (inside)
+            out.push_back(i);
+    }
+}
+
+void culler::cull(const frustum &f, thread_pool *pool, std::vector<unsigned int> &visible) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    visible.clear();
+    size_t n = size();
+    if (!pool || pool->size() == 1 || n <= kGrain) {
+        cull_range(f, 0, n, visible);
+    } else {
+        // Each chunk fills its own list; joined in order afterwards
+        chunk_visible.resize((n + kGrain - 1) / kGrain);
+        pool->parallel_for(n, kGrain, [&](size_t begin, size_t end) {
+            std::vector<unsigned int> &out = chunk_visible[begin / kGrain];
+            out.clear();
+            cull_range(f, begin, end, out);
+        });
+        for (size_t c = 0; c < chunk_visible.size(); c++)
+            visible.insert(visible.end(), chunk_visible[c].begin(), chunk_visible[c].end());
+    }
+    last_stats.tested = n;
+    last_stats.visible = visible.size();
+    last_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,74 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+class thread_pool;
+
+// A bounding sphere and an axis-aligned box around the same points.
+struct bounds {
+    float center[3];
+    float radius;
+    float min[3], max[3];
+};
+
+// Bounds of 'count' xyz positions. The sphere is centred on the box.
+bounds compute_bounds(const float *positions, size_t count);
+
+// 'local' moved by the column-major 4x4 'model'. The box is the
+// axis-aligned box around the moved box; the sphere grows with the
+// largest scale.
+bounds transform_bounds(const bounds &local, const float *model);
+
+// Bounds around both 'a' and 'b'.
+bounds merge_bounds(const bounds &a, const bounds &b);
+
+// The six planes (a, b, c, d), normals pointing inwards, of the frustum
+// of a column-major view-projection matrix.
+struct frustum {
+    float planes[6][4];
+};
+
+frustum extract_frustum(const float *vp);
+
+// Work done by the last culler::cull().
+struct cull_stats {
+    unsigned int tested;
+    unsigned int visible;
+    double seconds;
+};
+
+// World-space bounds of everything drawn, tested against a frustum to find
+// what needs drawing. Spheres go first, four at a time with SSE; only
+// those crossing a plane get the tighter box test.
+class culler {
+public:
+    culler();
+
+    // Returns the entry's index, used by set() and in cull()'s results.
+    unsigned int add(const bounds &world);
+    void set(unsigned int entry, const bounds &world);
+    bounds get(unsigned int entry) const;
+    void clear();
+
+    // Fills 'visible' with the entries inside or crossing 'f', in entry
+    // order. With a pool the entries are split between its threads.
+    void cull(const frustum &f, thread_pool *pool, std::vector<unsigned int> &visible);
+
+    size_t size() const { return cx.size(); }
+    const cull_stats &stats() const { return last_stats; }
+
+private:
+    void cull_range(const frustum &f, size_t begin, size_t end, std::vector<unsigned int> &out) const;
+
+    // Structure of arrays, by entry
+    std::vector<float> cx, cy, cz, radius;
+    std::vector<float> min_x, min_y, min_z, max_x, max_y, max_z;
+
+    std::vector<std::vector<unsigned int> > chunk_visible; // per chunk of a parallel cull()
+    cull_stats last_stats;
+};
+
+#endif // CULLING_H
@@ -24,12 +24,30 @@
 #include <cstring>
 #include <cassert>
 #include <cmath>
+#include <climits>
+#include <algorithm>
 
 #include <string>
 #include <vector>
 #include <map>
 #include <fstream>
 #include <sstream>
+#include <thread>
+#include <functional>
+
+#ifdef _WIN32
+#include <cstdio>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TINY_OBJ_LOADER_SSE2
+#endif
 
 #include "tiny_obj_loader.h"
 
@@ -42,17 +60,90 @@ struct vertex_index {
   vertex_index(int vidx, int vtidx, int vnidx)
       : v_idx(vidx), vt_idx(vtidx), vn_idx(vnidx){};
 };
-// for std::map
-static inline bool operator<(const vertex_index &a, const vertex_index &b) {
-  if (a.v_idx != b.v_idx)
-    return (a.v_idx < b.v_idx);
-  if (a.vn_idx != b.vn_idx)
-    return (a.vn_idx < b.vn_idx);
-  if (a.vt_idx != b.vt_idx)
-    return (a.vt_idx < b.vt_idx);
 
-  return false;
-}
+// Maps a (v, vt, vn) triple to the index of the vertex emitted for it.
+// Open addressing with linear probing over a power-of-two table, so a lookup
+// is a hash and a short scan of adjacent slots with no per-entry allocation.
+class vertex_cache {
+public:
+  vertex_cache() : m_size(0) {}
+
+  // Sizes the table for up to 'n' entries at a load factor of at most 1/2.
+  // Call on an empty cache.
+  void reserve(size_t n) {
+    assert(m_size == 0);
+    size_t cap = 16;
+    while (cap < 2 * n)
+      cap <<= 1;
+    // Also shrink, so that clear() stays cheap after a large group.
+    if (cap > m_slots.size() || cap * 4 < m_slots.size())
+      m_slots.assign(cap, slot());
+  }
+
+  // Returns the value stored for 'key'. If 'key' is not present, it is
+  // inserted, 'inserted' is set and the returned value must be assigned.
+  unsigned int &insert(const vertex_index &key, bool &inserted) {
+    if (2 * (m_size + 1) > m_slots.size())
+      grow();
+    size_t mask = m_slots.size() - 1;
+    size_t i = hash(key) & mask;
+    for (;;) {
+      slot &s = m_slots[i];
+      if (s.value == kEmpty) {
+        s.key = key;
+        m_size++;
+        inserted = true;
+        return s.value;
+      }
+      if (s.key.v_idx == key.v_idx && s.key.vt_idx == key.vt_idx &&
+          s.key.vn_idx == key.vn_idx) {
+        inserted = false;
+        return s.value;
+      }
+      i = (i + 1) & mask;
+    }
+  }
+
+  void clear() {
+    if (m_size == 0)
+      return;
+    std::fill(m_slots.begin(), m_slots.end(), slot());
+    m_size = 0;
+  }
+
+private:
+  static const unsigned int kEmpty = ~0u;
+
+  struct slot {
+    vertex_index key;
+    unsigned int value;
+    slot() : value(kEmpty) {}
+  };
+
+  static size_t hash(const vertex_index &k) {
+    unsigned long long h = (unsigned int)k.v_idx;
+    h = h * 0x9E3779B97F4A7C15ULL ^ (unsigned int)k.vt_idx;
+    h = h * 0x9E3779B97F4A7C15ULL ^ (unsigned int)k.vn_idx;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32);
+  }
+
+  void grow() {
+    std::vector<slot> old;
+    old.swap(m_slots);
+    m_slots.assign(old.empty() ? 16 : 2 * old.size(), slot());
+    m_size = 0;
+    for (size_t i = 0; i < old.size(); i++) {
+      if (old[i].value != kEmpty) {
+        bool inserted;
+        insert(old[i].key, inserted) = old[i].value;
+      }
+    }
+  }
+
+  std::vector<slot> m_slots;
+  size_t m_size;
+};
 
 struct obj_shape {
   std::vector<float> v;
@@ -60,12 +151,89 @@ struct obj_shape {
   std::vector<float> vt;
 };
 
+// Faces of the current group, flattened: face i uses the next face_sizes[i]
+// entries of 'corners'.
+struct face_group {
+  std::vector<vertex_index> corners;
+  std::vector<unsigned int> face_sizes;
+
+  bool empty() const { return face_sizes.empty(); }
+  void clear() {
+    corners.clear();
+    face_sizes.clear();
+  }
+};
+
 static inline bool isSpace(const char c) { return (c == ' ') || (c == '\t'); }
 
 static inline bool isNewLine(const char c) {
   return (c == '\r') || (c == '\n') || (c == '\0');
 }
 
+// Skips ' ' and '\t' (and '\r' if 'skipCR'). Same as strspn(s, " \t[\r]"),
+// without the libc call.
+static inline const char *skipSpace(const char *s, bool skipCR = false) {
+  while (isSpace(*s) || (skipCR && *s == '\r'))
+    s++;
+  return s;
+}
+
+#ifdef TINY_OBJ_LOADER_SSE2
+static inline int countTrailingZeros(unsigned int mask) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward(&i, mask);
+  return (int)i;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+// Bit i is set if byte i of 'chunk' ends a field.
+template <bool kStopAtSlash>
+static inline unsigned int delimiterMask(__m128i chunk) {
+  __m128i m = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                   _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+      _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r')),
+                   _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(chunk, _mm_setzero_si128()));
+  if (kStopAtSlash)
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('/')));
+  return (unsigned int)_mm_movemask_epi8(m);
+}
+#endif
+
+// Returns the length of the field at 's', i.e. strcspn(s, " \t\r\n") or,
+// with 'kStopAtSlash', strcspn(s, "/ \t\r\n").
+//
+// The SSE2 path tests 16 bytes per step. Loads are 16-byte aligned, so they
+// never cross into the next page; bytes before 's' are masked off and bytes
+// after the terminator are ignored. Every line handed to the parser ends in
+// '\n' or '\0', so the scan always stops inside the line.
+template <bool kStopAtSlash>
+static inline size_t fieldLength(const char *s) {
+#ifdef TINY_OBJ_LOADER_SSE2
+  size_t misalign = reinterpret_cast<size_t>(s) & 15;
+  const char *p = s - misalign;
+  unsigned int mask =
+      delimiterMask<kStopAtSlash>(
+          _mm_load_si128(reinterpret_cast<const __m128i *>(p))) &
+      (0xFFFFu << misalign);
+  while (mask == 0) {
+    p += 16;
+    mask = delimiterMask<kStopAtSlash>(
+        _mm_load_si128(reinterpret_cast<const __m128i *>(p)));
+  }
+  return p + countTrailingZeros(mask) - s;
+#else
+  const char *p = s;
+  while (!isSpace(*p) && !isNewLine(*p) && !(kStopAtSlash && *p == '/'))
+    p++;
+  return p - s;
+#endif
+}
+
 // Make index zero-base, and also support relative index.
 static inline int fixIndex(int idx, int n) {
   if (idx > 0) return idx - 1;
@@ -73,23 +241,62 @@ static inline int fixIndex(int idx, int n) {
   return n + idx; // negative value = relative
 }
 
+// Lines handed to the parser are not necessarily NUL-terminated (see
+// buffer_line_reader), so every scan below also stops at '\n'.
+
+// Like atoi(), but never skips leading whitespace, so it cannot run past the
+// end of the current line.
+static inline int parseIntNoSkip(const char *s) {
+  bool neg = false;
+  if (*s == '+' || *s == '-') {
+    neg = (*s == '-');
+    s++;
+  }
+  int i = 0;
+  while (*s >= '0' && *s <= '9') {
+    i = i * 10 + (*s - '0');
+    s++;
+  }
+  return neg ? -i : i;
+}
+
 static inline std::string parseString(const char *&token) {
   std::string s;
-  token += strspn(token, " \t");
-  int e = strcspn(token, " \t\r");
+  token = skipSpace(token);
+  int e = fieldLength<false>(token);
   s = std::string(token, &token[e]);
   token += e;
   return s;
 }
 
 static inline int parseInt(const char *&token) {
-  token += strspn(token, " \t");
-  int i = atoi(token);
-  token += strcspn(token, " \t\r");
+  token = skipSpace(token);
+  int i = parseIntNoSkip(token);
+  token += fieldLength<false>(token);
   return i;
 }
 
 
+static inline bool isDigit(const char c) {
+  return static_cast<unsigned int>(c - '0') < 10;
+}
+
+// pow(10, -k) for the k-th fractional digit, computed once with the very
+// same pow() call the parser used per digit, so results stay bit-identical.
+static const int kNegPow10Count = 32;
+struct neg_pow10_table {
+  double value[kNegPow10Count];
+  neg_pow10_table() {
+    for (int k = 0; k < kNegPow10Count; k++)
+      value[k] = pow(10, -k);
+  }
+};
+
+static inline double negPow10(int k) {
+  static const neg_pow10_table table;
+  return k < kNegPow10Count ? table.value[k] : pow(10, -k);
+}
+
 // Tries to parse a floating point number located at s.
 //
 // s_end should be a location in the string where reading should absolutely
@@ -155,14 +362,26 @@ static bool tryParseDouble(const char *s, const char *s_end, double *result)
 		sign = *curr;
 		curr++;
 	}
-	else if (isdigit(*curr)) { /* Pass through. */ }
+	else if (isDigit(*curr)) { /* Pass through. */ }
 	else
 	{
 		goto fail;
 	}
 
 	// Read the integer part.
-	while ((end_not_reached = (curr != s_end)) && isdigit(*curr))
+	// Up to 15 digits the value stays below 2^53, where every step of the
+	// double accumulation is exact, so an integer accumulator gives the same
+	// result without the int->double conversion per digit.
+	{
+		unsigned long long ipart = 0;
+		while ((end_not_reached = (curr != s_end)) && isDigit(*curr) && read < 15)
+		{
+			ipart = ipart * 10 + static_cast<int>(*curr - 0x30);
+			curr++;	read++;
+		}
+		mantissa = static_cast<double>(ipart);
+	}
+	while ((end_not_reached = (curr != s_end)) && isDigit(*curr))
 	{
 		mantissa *= 10;
 		mantissa += static_cast<int>(*curr - 0x30);
@@ -181,10 +400,10 @@ static bool tryParseDouble(const char *s, const char *s_end, double *result)
 	{
 		curr++;
 		read = 1;
-		while ((end_not_reached = (curr != s_end)) && isdigit(*curr))
+		while ((end_not_reached = (curr != s_end)) && isDigit(*curr))
 		{
 			// NOTE: Don't use powf here, it will absolutely murder precision.
-			mantissa += static_cast<int>(*curr - 0x30) * pow(10, -read);
+			mantissa += static_cast<int>(*curr - 0x30) * negPow10(read);
 			read++; curr++;
 		}
 	}
@@ -207,7 +426,7 @@ static bool tryParseDouble(const char *s, const char *s_end, double *result)
 			exp_sign = *curr;
 			curr++;
 		}
-		else if (isdigit(*curr)) { /* Pass through. */ }
+		else if (isDigit(*curr)) { /* Pass through. */ }
 		else
 		{
 			// Empty E is not allowed.
@@ -215,7 +434,7 @@ static bool tryParseDouble(const char *s, const char *s_end, double *result)
 		}
 
 		read = 0;
-		while ((end_not_reached = (curr != s_end)) && isdigit(*curr))
+		while ((end_not_reached = (curr != s_end)) && isDigit(*curr))
 		{
 			exponent *= 10;
 			exponent += static_cast<int>(*curr - 0x30);
@@ -227,18 +446,21 @@ static bool tryParseDouble(const char *s, const char *s_end, double *result)
 	}
 
 assemble:
-	*result = (sign == '+'? 1 : -1) * ldexp(mantissa * pow(5, exponent), exponent);
+	// pow(5, 0) and ldexp(x, 0) are exact, so the common no-exponent case
+	// can skip both.
+	*result = (sign == '+'? 1 : -1) *
+		(exponent != 0 ? ldexp(mantissa * pow(5, exponent), exponent) : mantissa);
 	return true;
 fail:
 	return false;
 }
 static inline float parseFloat(const char *&token) {
-  token += strspn(token, " \t");
+  token = skipSpace(token);
 #ifdef TINY_OBJ_LOADER_OLD_FLOAT_PARSER
   float f = (float)atof(token);
-  token += strcspn(token, " \t\r");
+  token += strcspn(token, " \t\r\n");
 #else
-  const char *end = token + strcspn(token, " \t\r");
+  const char *end = token + fieldLength<false>(token);
   double val = 0.0;
   tryParseDouble(token, end, &val);
   float f = static_cast<float>(val);
@@ -260,13 +482,16 @@ static inline void parseFloat3(float &x, float &y, float &z,
   z = parseFloat(token);
 }
 
-// Parse triples: i, i/j/k, i//k, i/j
-static vertex_index parseTriple(const char *&token, int vsize, int vnsize,
-                                int vtsize) {
-  vertex_index vi(-1);
+// Marks a component that is not present in a raw triple.
+static const int kMissingIndex = INT_MIN;
+
+// Parse triples as written in the file: i, i/j/k, i//k, i/j
+// Missing components are set to kMissingIndex.
+static vertex_index parseRawTriple(const char *&token) {
+  vertex_index vi(kMissingIndex);
 
-  vi.v_idx = fixIndex(atoi(token), vsize);
-  token += strcspn(token, "/ \t\r");
+  vi.v_idx = parseIntNoSkip(token);
+  token += fieldLength<true>(token);
   if (token[0] != '/') {
     return vi;
   }
@@ -275,37 +500,57 @@ static vertex_index parseTriple(const char *&token, int vsize, int vnsize,
   // i//k
   if (token[0] == '/') {
     token++;
-    vi.vn_idx = fixIndex(atoi(token), vnsize);
-    token += strcspn(token, "/ \t\r");
+    vi.vn_idx = parseIntNoSkip(token);
+    token += fieldLength<true>(token);
     return vi;
   }
 
   // i/j/k or i/j
-  vi.vt_idx = fixIndex(atoi(token), vtsize);
-  token += strcspn(token, "/ \t\r");
+  vi.vt_idx = parseIntNoSkip(token);
+  token += fieldLength<true>(token);
   if (token[0] != '/') {
     return vi;
   }
 
   // i/j/k
   token++; // skip '/'
-  vi.vn_idx = fixIndex(atoi(token), vnsize);
-  token += strcspn(token, "/ \t\r");
+  vi.vn_idx = parseIntNoSkip(token);
+  token += fieldLength<true>(token);
+  return vi;
+}
+
+// Resolves a raw triple against the attribute counts seen so far.
+// Missing components become -1.
+static inline vertex_index fixTriple(const vertex_index &raw, int vsize,
+                                     int vnsize, int vtsize) {
+  vertex_index vi(-1);
+  vi.v_idx = fixIndex(raw.v_idx, vsize);
+  if (raw.vn_idx != kMissingIndex)
+    vi.vn_idx = fixIndex(raw.vn_idx, vnsize);
+  if (raw.vt_idx != kMissingIndex)
+    vi.vt_idx = fixIndex(raw.vt_idx, vtsize);
   return vi;
 }
 
+// Parse triples: i, i/j/k, i//k, i/j
+static vertex_index parseTriple(const char *&token, int vsize, int vnsize,
+                                int vtsize) {
+  return fixTriple(parseRawTriple(token), vsize, vnsize, vtsize);
+}
+
 static unsigned int
-updateVertex(std::map<vertex_index, unsigned int> &vertexCache,
+updateVertex(vertex_cache &vertexCache,
              std::vector<float> &positions, std::vector<float> &normals,
              std::vector<float> &texcoords,
              const std::vector<float> &in_positions,
              const std::vector<float> &in_normals,
              const std::vector<float> &in_texcoords, const vertex_index &i) {
-  const std::map<vertex_index, unsigned int>::iterator it = vertexCache.find(i);
+  bool inserted;
+  unsigned int &cached = vertexCache.insert(i, inserted);
 
-  if (it != vertexCache.end()) {
+  if (!inserted) {
     // found cache
-    return it->second;
+    return cached;
   }
 
   assert(in_positions.size() > (unsigned int)(3 * i.v_idx + 2));
@@ -326,7 +571,7 @@ updateVertex(std::map<vertex_index, unsigned int> &vertexCache,
   }
 
   unsigned int idx = positions.size() / 3 - 1;
-  vertexCache[i] = idx;
+  cached = idx;
 
   return idx;
 }
@@ -352,26 +597,41 @@ void InitMaterial(material_t &material) {
 }
 
 static bool exportFaceGroupToShape(
-    shape_t &shape, std::map<vertex_index, unsigned int> vertexCache,
+    shape_t &shape, vertex_cache &vertexCache,
     const std::vector<float> &in_positions,
     const std::vector<float> &in_normals,
     const std::vector<float> &in_texcoords,
-    const std::vector<std::vector<vertex_index> > &faceGroup,
-    const int material_id, const std::string &name, bool clearCache) {
+    const face_group &faceGroup, const int material_id,
+    const std::string &name, bool clearCache) {
   if (faceGroup.empty()) {
     return false;
   }
 
+  // A group cannot emit more unique vertices than it has corners.
+  size_t ntriangles = 0;
+  for (size_t i = 0; i < faceGroup.face_sizes.size(); i++) {
+    if (faceGroup.face_sizes[i] >= 3)
+      ntriangles += faceGroup.face_sizes[i] - 2;
+  }
+  vertexCache.reserve(faceGroup.corners.size());
+  shape.mesh.indices.reserve(shape.mesh.indices.size() + 3 * ntriangles);
+  shape.mesh.material_ids.reserve(shape.mesh.material_ids.size() + ntriangles);
+
   // Flatten vertices and indices
-  for (size_t i = 0; i < faceGroup.size(); i++) {
-    const std::vector<vertex_index> &face = faceGroup[i];
+  const vertex_index *face = faceGroup.corners.empty()
+                                 ? NULL
+                                 : &faceGroup.corners[0];
+  for (size_t i = 0; i < faceGroup.face_sizes.size(); i++) {
+    size_t npolys = faceGroup.face_sizes[i];
+    if (npolys < 3) {
+      face += npolys;
+      continue;
+    }
 
     vertex_index i0 = face[0];
     vertex_index i1(-1);
     vertex_index i2 = face[1];
 
-    size_t npolys = face.size();
-
     // Polygon -> triangle fan conversion
     for (size_t k = 2; k < npolys; k++) {
       i1 = i2;
@@ -393,6 +653,7 @@ static bool exportFaceGroupToShape(
 
       shape.mesh.material_ids.push_back(material_id);
     }
+    face += npolys;
   }
 
   shape.name = name;
@@ -615,181 +876,228 @@ std::string MaterialFileReader::operator()(const std::string &matId,
   return LoadMtl(matMap, materials, matIStream);
 }
 
-std::string LoadObj(std::vector<shape_t> &shapes,
-                    std::vector<material_t> &materials, // [output]
-                    const char *filename, const char *mtl_basepath) {
-
-  shapes.clear();
-
-  std::stringstream err;
-
-  std::ifstream ifs(filename);
-  if (!ifs) {
-    err << "Cannot open file [" << filename << "]" << std::endl;
-    return err.str();
+// Reads lines from a std::istream into a fixed-size buffer.
+class istream_line_reader {
+public:
+  istream_line_reader(std::istream &inStream)
+      : m_inStream(inStream), m_buf(8192) {} // Alloc enough size.
+
+  bool next(const char *&line) {
+    if (m_inStream.peek() == -1)
+      return false;
+    m_inStream.getline(&m_buf[0], m_buf.size());
+    line = &m_buf[0];
+    return true;
   }
 
-  std::string basePath;
-  if (mtl_basepath) {
-    basePath = mtl_basepath;
-  }
-  MaterialFileReader matFileReader(basePath);
-
-  return LoadObj(shapes, materials, ifs, matFileReader);
-}
-
-std::string LoadObj(std::vector<shape_t> &shapes,
-                    std::vector<material_t> &materials, // [output]
-                    std::istream &inStream, MaterialReader &readMatFn) {
-  std::stringstream err;
-
-  std::vector<float> v;
-  std::vector<float> vn;
-  std::vector<float> vt;
-  std::vector<std::vector<vertex_index> > faceGroup;
-  std::string name;
-
-  // material
-  std::map<std::string, int> material_map;
-  std::map<vertex_index, unsigned int> vertexCache;
-  int material = -1;
+private:
+  std::istream &m_inStream;
+  std::vector<char> m_buf;
+};
 
-  shape_t shape;
+// Hands out lines in place from a memory buffer. A line ends at '\n' rather
+// than '\0', so nothing is copied, except for a last line without a trailing
+// newline: reading up to its terminator could run off the end of the buffer.
+class buffer_line_reader {
+public:
+  buffer_line_reader(const char *buf, size_t len)
+      : m_cur(buf), m_end(buf + len) {}
+
+  bool next(const char *&line) {
+    if (m_cur >= m_end)
+      return false;
+    const char *nl =
+        static_cast<const char *>(memchr(m_cur, '\n', m_end - m_cur));
+    if (!nl) {
+      m_tail.assign(m_cur, m_end);
+      line = m_tail.c_str();
+      m_cur = m_end;
+      return true;
+    }
+    line = m_cur;
+    m_cur = nl + 1;
+    return true;
+  }
 
-  int maxchars = 8192;             // Alloc enough size.
-  std::vector<char> buf(maxchars); // Alloc enough size.
-  while (inStream.peek() != -1) {
-    inStream.getline(&buf[0], maxchars);
+private:
+  const char *m_cur;
+  const char *m_end;
+  std::string m_tail;
+};
 
-    std::string linebuf(&buf[0]);
+// Read-only view of a whole file, memory-mapped where the platform allows it.
+class mapped_file {
+public:
+  mapped_file() : m_data(NULL), m_size(0), m_mapped(false) {}
+  ~mapped_file() {
+#ifndef _WIN32
+    if (m_mapped)
+      munmap(const_cast<char *>(m_data), m_size);
+#endif
+  }
 
-    // Trim newline '\r\n' or '\n'
-    if (linebuf.size() > 0) {
-      if (linebuf[linebuf.size() - 1] == '\n')
-        linebuf.erase(linebuf.size() - 1);
+  bool open(const char *filename) {
+#ifdef _WIN32
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+      return false;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    m_copy.resize(len > 0 ? len : 0);
+    if (len > 0 && fread(&m_copy[0], 1, len, fp) != (size_t)len) {
+      fclose(fp);
+      return false;
     }
-    if (linebuf.size() > 0) {
-      if (linebuf[linebuf.size() - 1] == '\r')
-        linebuf.erase(linebuf.size() - 1);
+    fclose(fp);
+    m_data = m_copy.empty() ? NULL : &m_copy[0];
+    m_size = m_copy.size();
+    return true;
+#else
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return false;
     }
-
-    // Skip if empty line.
-    if (linebuf.empty()) {
-      continue;
+    m_size = st.st_size;
+    if (m_size > 0) {
+      void *p = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        return false;
+      }
+      madvise(p, m_size, MADV_SEQUENTIAL);
+      m_data = static_cast<const char *>(p);
+      m_mapped = true;
     }
+    close(fd);
+    return true;
+#endif
+  }
 
-    // Skip leading space.
-    const char *token = linebuf.c_str();
-    token += strspn(token, " \t");
+  const char *data() const { return m_data; }
+  size_t size() const { return m_size; }
 
-    assert(token);
-    if (token[0] == '\0')
-      continue; // empty line
+private:
+  mapped_file(const mapped_file &);
+  mapped_file &operator=(const mapped_file &);
 
-    if (token[0] == '#')
-      continue; // comment line
-
-    // vertex
-    if (token[0] == 'v' && isSpace((token[1]))) {
-      token += 2;
-      float x, y, z;
-      parseFloat3(x, y, z, token);
-      v.push_back(x);
-      v.push_back(y);
-      v.push_back(z);
-      continue;
-    }
-
-    // normal
-    if (token[0] == 'v' && token[1] == 'n' && isSpace((token[2]))) {
-      token += 3;
-      float x, y, z;
-      parseFloat3(x, y, z, token);
-      vn.push_back(x);
-      vn.push_back(y);
-      vn.push_back(z);
-      continue;
-    }
+  const char *m_data;
+  size_t m_size;
+  bool m_mapped;
+#ifdef _WIN32
+  std::vector<char> m_copy;
+#endif
+};
 
-    // texcoord
-    if (token[0] == 'v' && token[1] == 't' && isSpace((token[2]))) {
-      token += 3;
-      float x, y;
-      parseFloat2(x, y, token);
-      vt.push_back(x);
-      vt.push_back(y);
-      continue;
-    }
+// Parses a vertex, normal or texcoord record into 'attribs'.
+// Returns false if 'token' is not one of those.
+static bool parseAttribute(const char *token, obj_shape &attribs) {
+  // vertex
+  if (token[0] == 'v' && isSpace((token[1]))) {
+    token += 2;
+    float x, y, z;
+    parseFloat3(x, y, z, token);
+    attribs.v.push_back(x);
+    attribs.v.push_back(y);
+    attribs.v.push_back(z);
+    return true;
+  }
 
-    // face
-    if (token[0] == 'f' && isSpace((token[1]))) {
-      token += 2;
-      token += strspn(token, " \t");
+  // normal
+  if (token[0] == 'v' && token[1] == 'n' && isSpace((token[2]))) {
+    token += 3;
+    float x, y, z;
+    parseFloat3(x, y, z, token);
+    attribs.vn.push_back(x);
+    attribs.vn.push_back(y);
+    attribs.vn.push_back(z);
+    return true;
+  }
 
-      std::vector<vertex_index> face;
-      while (!isNewLine(token[0])) {
-        vertex_index vi =
-            parseTriple(token, v.size() / 3, vn.size() / 3, vt.size() / 2);
-        face.push_back(vi);
-        int n = strspn(token, " \t\r");
-        token += n;
-      }
+  // texcoord
+  if (token[0] == 'v' && token[1] == 't' && isSpace((token[2]))) {
+    token += 3;
+    float x, y;
+    parseFloat2(x, y, token);
+    attribs.vt.push_back(x);
+    attribs.vt.push_back(y);
+    return true;
+  }
 
-      faceGroup.push_back(face);
+  return false;
+}
 
-      continue;
-    }
+// Collects faces into groups and turns the usemtl/mtllib/g/o records into
+// shapes. Shared by the serial and the parallel parser, so that both produce
+// exactly the same output.
+class shape_builder {
+public:
+  shape_builder(std::vector<shape_t> &shapes,
+                std::vector<material_t> &materials, const obj_shape &attribs,
+                MaterialReader &readMatFn)
+      : m_shapes(shapes), m_materials(materials), m_attribs(attribs),
+        m_readMatFn(readMatFn), m_material(-1) {}
+
+  static bool isCommand(const char *token) {
+    return ((0 == strncmp(token, "usemtl", 6)) && isSpace((token[6]))) ||
+           ((0 == strncmp(token, "mtllib", 6)) && isSpace((token[6]))) ||
+           (token[0] == 'g' && isSpace((token[1]))) ||
+           (token[0] == 'o' && isSpace((token[1])));
+  }
 
+  // Handles a usemtl/mtllib/g/o record. Returns false if 'token' is none of
+  // those. 'err' is set when the material library fails to load.
+  bool parseCommand(const char *token, std::string &err) {
     // use mtl
     if ((0 == strncmp(token, "usemtl", 6)) && isSpace((token[6]))) {
 
-      char namebuf[4096];
       token += 7;
-      sscanf(token, "%s", namebuf);
+      std::string namebuf = parseString(token);
 
       // Create face group per material.
-      bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
-                                        faceGroup, material, name, true);
+      bool ret = exportFaceGroup();
       if (ret) {
         faceGroup.clear();
       }
 
-      if (material_map.find(namebuf) != material_map.end()) {
-        material = material_map[namebuf];
+      if (m_material_map.find(namebuf) != m_material_map.end()) {
+        m_material = m_material_map[namebuf];
       } else {
         // { error!! material not found }
-        material = -1;
+        m_material = -1;
       }
 
-      continue;
+      return true;
     }
 
     // load mtl
     if ((0 == strncmp(token, "mtllib", 6)) && isSpace((token[6]))) {
-      char namebuf[4096];
       token += 7;
-      sscanf(token, "%s", namebuf);
+      std::string namebuf = parseString(token);
 
-      std::string err_mtl = readMatFn(namebuf, materials, material_map);
+      std::string err_mtl = m_readMatFn(namebuf, m_materials, m_material_map);
       if (!err_mtl.empty()) {
         faceGroup.clear(); // for safety
-        return err_mtl;
+        err = err_mtl;
       }
 
-      continue;
+      return true;
     }
 
     // group name
     if (token[0] == 'g' && isSpace((token[1]))) {
 
       // flush previous face group.
-      bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
-                                        faceGroup, material, name, true);
+      bool ret = exportFaceGroup();
       if (ret) {
-        shapes.push_back(shape);
+        m_shapes.push_back(m_shape);
       }
 
-      shape = shape_t();
+      m_shape = shape_t();
 
       // material = -1;
       faceGroup.clear();
@@ -805,47 +1113,404 @@ std::string LoadObj(std::vector<shape_t> &shapes,
 
       // names[0] must be 'g', so skip the 0th element.
       if (names.size() > 1) {
-        name = names[1];
+        m_name = names[1];
       } else {
-        name = "";
+        m_name = "";
       }
 
-      continue;
+      return true;
     }
 
     // object name
     if (token[0] == 'o' && isSpace((token[1]))) {
 
       // flush previous face group.
-      bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
-                                        faceGroup, material, name, true);
+      bool ret = exportFaceGroup();
       if (ret) {
-        shapes.push_back(shape);
+        m_shapes.push_back(m_shape);
       }
 
       // material = -1;
       faceGroup.clear();
-      shape = shape_t();
+      m_shape = shape_t();
 
       // @todo { multiple object name? }
-      char namebuf[4096];
       token += 2;
-      sscanf(token, "%s", namebuf);
-      name = std::string(namebuf);
+      m_name = parseString(token);
+
+      return true;
+    }
+
+    return false;
+  }
+
+  // Flushes the last face group.
+  void finish() {
+    bool ret = exportFaceGroup();
+    if (ret) {
+      m_shapes.push_back(m_shape);
+    }
+    faceGroup.clear(); // for safety
+  }
+
+  face_group faceGroup;
+
+private:
+  bool exportFaceGroup() {
+    return exportFaceGroupToShape(m_shape, m_vertexCache, m_attribs.v,
+                                  m_attribs.vn, m_attribs.vt, faceGroup,
+                                  m_material, m_name, true);
+  }
+
+  std::vector<shape_t> &m_shapes;
+  std::vector<material_t> &m_materials;
+  const obj_shape &m_attribs;
+  MaterialReader &m_readMatFn;
+
+  std::string m_name;
+
+  // material
+  std::map<std::string, int> m_material_map;
+  vertex_cache m_vertexCache;
+  int m_material;
+
+  shape_t m_shape;
+};
+
+template <typename LineReader>
+static std::string LoadObjLines(std::vector<shape_t> &shapes,
+                                std::vector<material_t> &materials,
+                                LineReader &lineReader,
+                                MaterialReader &readMatFn) {
+  std::stringstream err;
+
+  obj_shape attribs;
+  shape_builder builder(shapes, materials, attribs, readMatFn);
+
+  const char *line;
+  while (lineReader.next(line)) {
+    // Skip leading space.
+    const char *token = skipSpace(line);
+
+    assert(token);
+    if (isNewLine(token[0]))
+      continue; // empty line
+
+    if (token[0] == '#')
+      continue; // comment line
+
+    if (parseAttribute(token, attribs))
+      continue;
+
+    // face
+    if (token[0] == 'f' && isSpace((token[1]))) {
+      token = skipSpace(token + 2);
+
+      int vsize = attribs.v.size() / 3;
+      int vnsize = attribs.vn.size() / 3;
+      int vtsize = attribs.vt.size() / 2;
+      unsigned int npolys = 0;
+      while (!isNewLine(token[0])) {
+        vertex_index vi = parseTriple(token, vsize, vnsize, vtsize);
+        builder.faceGroup.corners.push_back(vi);
+        npolys++;
+        token = skipSpace(token, true);
+      }
+
+      builder.faceGroup.face_sizes.push_back(npolys);
 
       continue;
     }
 
+    std::string err_cmd;
+    if (builder.parseCommand(token, err_cmd)) {
+      if (!err_cmd.empty())
+        return err_cmd;
+      continue;
+    }
+
     // Ignore unknown command.
   }
 
-  bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt, faceGroup,
-                                    material, name, true);
-  if (ret) {
-    shapes.push_back(shape);
-  }
-  faceGroup.clear(); // for safety
+  builder.finish();
 
   return err.str();
 }
+
+std::string LoadObj(std::vector<shape_t> &shapes,
+                    std::vector<material_t> &materials, // [output]
+                    const char *filename, const char *mtl_basepath) {
+
+  shapes.clear();
+
+  std::stringstream err;
+
+  std::ifstream ifs(filename);
+  if (!ifs) {
+    err << "Cannot open file [" << filename << "]" << std::endl;
+    return err.str();
+  }
+
+  std::string basePath;
+  if (mtl_basepath) {
+    basePath = mtl_basepath;
+  }
+  MaterialFileReader matFileReader(basePath);
+
+  return LoadObj(shapes, materials, ifs, matFileReader);
+}
+
+std::string LoadObj(std::vector<shape_t> &shapes,
+                    std::vector<material_t> &materials, // [output]
+                    std::istream &inStream, MaterialReader &readMatFn) {
+  istream_line_reader lineReader(inStream);
+  return LoadObjLines(shapes, materials, lineReader, readMatFn);
+}
+
+std::string LoadObj(std::vector<shape_t> &shapes,
+                    std::vector<material_t> &materials, // [output]
+                    const char *buf, size_t len, MaterialReader &readMatFn) {
+  buffer_line_reader lineReader(buf, len);
+  return LoadObjLines(shapes, materials, lineReader, readMatFn);
+}
+
+std::string LoadObjMapped(std::vector<shape_t> &shapes,
+                          std::vector<material_t> &materials, // [output]
+                          const char *filename, const char *mtl_basepath) {
+
+  shapes.clear();
+
+  std::stringstream err;
+
+  mapped_file file;
+  if (!file.open(filename)) {
+    err << "Cannot open file [" << filename << "]" << std::endl;
+    return err.str();
+  }
+
+  std::string basePath;
+  if (mtl_basepath) {
+    basePath = mtl_basepath;
+  }
+  MaterialFileReader matFileReader(basePath);
+
+  return LoadObj(shapes, materials, file.data(), file.size(), matFileReader);
+}
+
+// Attribute counts seen before a face, used to resolve its relative indices.
+struct attrib_counts {
+  int v, vn, vt;
+};
+
+// A usemtl/mtllib/g/o record, kept to be replayed in file order.
+struct chunk_command {
+  size_t face; // number of faces in the chunk before this record
+  std::string line;
+};
+
+// Output of parsing one newline-aligned chunk of an .obj on a worker thread.
+// Faces are kept as raw triples until the attribute counts of all previous
+// chunks are known.
+struct obj_chunk {
+  const char *begin;
+  const char *end;
+  obj_shape attribs;
+  face_group faces;
+  std::vector<attrib_counts> counts; // per face, local to this chunk
+  std::vector<chunk_command> commands;
+};
+
+static void parseChunk(obj_chunk &chunk) {
+  buffer_line_reader lineReader(chunk.begin, chunk.end - chunk.begin);
+  obj_shape &attribs = chunk.attribs;
+
+  const char *line;
+  while (lineReader.next(line)) {
+    // Skip leading space.
+    const char *token = skipSpace(line);
+
+    if (isNewLine(token[0]) || token[0] == '#')
+      continue;
+
+    if (parseAttribute(token, attribs))
+      continue;
+
+    // face
+    if (token[0] == 'f' && isSpace((token[1]))) {
+      token = skipSpace(token + 2);
+
+      unsigned int npolys = 0;
+      while (!isNewLine(token[0])) {
+        chunk.faces.corners.push_back(parseRawTriple(token));
+        npolys++;
+        token = skipSpace(token, true);
+      }
+
+      chunk.faces.face_sizes.push_back(npolys);
+      attrib_counts c = {(int)attribs.v.size() / 3, (int)attribs.vn.size() / 3,
+                         (int)attribs.vt.size() / 2};
+      chunk.counts.push_back(c);
+      continue;
+    }
+
+    if (shape_builder::isCommand(token)) {
+      chunk_command cmd;
+      cmd.face = chunk.faces.face_sizes.size();
+      cmd.line.assign(token, token + strcspn(token, "\r\n"));
+      chunk.commands.push_back(cmd);
+    }
+  }
+}
+
+// Resolves the raw triples of 'chunk' now that 'base' attributes precede it,
+// and copies its attributes into the merged arrays.
+static void mergeChunk(obj_chunk &chunk, const attrib_counts &base,
+                       obj_shape &merged) {
+  const obj_shape &a = chunk.attribs;
+  if (!a.v.empty())
+    memcpy(&merged.v[3 * base.v], &a.v[0], sizeof(float) * a.v.size());
+  if (!a.vn.empty())
+    memcpy(&merged.vn[3 * base.vn], &a.vn[0], sizeof(float) * a.vn.size());
+  if (!a.vt.empty())
+    memcpy(&merged.vt[2 * base.vt], &a.vt[0], sizeof(float) * a.vt.size());
+
+  size_t corner = 0;
+  for (size_t i = 0; i < chunk.faces.face_sizes.size(); i++) {
+    const attrib_counts &c = chunk.counts[i];
+    int vsize = base.v + c.v;
+    int vnsize = base.vn + c.vn;
+    int vtsize = base.vt + c.vt;
+    for (unsigned int k = 0; k < chunk.faces.face_sizes[i]; k++, corner++) {
+      vertex_index &vi = chunk.faces.corners[corner];
+      vi = fixTriple(vi, vsize, vnsize, vtsize);
+    }
+  }
+}
+
+// Appends faces [first, last) of 'chunk' to the builder's current group.
+static void appendChunkFaces(shape_builder &builder, const obj_chunk &chunk,
+                             size_t first, size_t last, size_t &corner) {
+  const face_group &faces = chunk.faces;
+  size_t ncorners = 0;
+  for (size_t i = first; i < last; i++)
+    ncorners += faces.face_sizes[i];
+  builder.faceGroup.face_sizes.insert(builder.faceGroup.face_sizes.end(),
+                                      faces.face_sizes.begin() + first,
+                                      faces.face_sizes.begin() + last);
+  builder.faceGroup.corners.insert(builder.faceGroup.corners.end(),
+                                   faces.corners.begin() + corner,
+                                   faces.corners.begin() + corner + ncorners);
+  corner += ncorners;
+}
+
+std::string LoadObjParallel(std::vector<shape_t> &shapes,
+                            std::vector<material_t> &materials, // [output]
+                            const char *buf, size_t len,
+                            MaterialReader &readMatFn,
+                            unsigned int num_threads) {
+  // Chunks smaller than this are not worth a thread.
+  const size_t kMinChunkSize = 1 << 20;
+
+  if (num_threads == 0)
+    num_threads = std::thread::hardware_concurrency();
+  if (num_threads > len / kMinChunkSize)
+    num_threads = len / kMinChunkSize;
+  if (num_threads <= 1)
+    return LoadObj(shapes, materials, buf, len, readMatFn);
+
+  // Split at newlines.
+  std::vector<obj_chunk> chunks(num_threads);
+  const char *end = buf + len;
+  const char *p = buf;
+  for (unsigned int i = 0; i < num_threads; i++) {
+    chunks[i].begin = p;
+    if (i + 1 == num_threads) {
+      p = end;
+    } else {
+      const char *q = buf + len / num_threads * (i + 1);
+      if (q < p)
+        q = p;
+      const char *nl = static_cast<const char *>(memchr(q, '\n', end - q));
+      p = nl ? nl + 1 : end;
+    }
+    chunks[i].end = p;
+  }
+
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < num_threads; i++)
+    workers.push_back(std::thread(parseChunk, std::ref(chunks[i])));
+  for (unsigned int i = 0; i < num_threads; i++)
+    workers[i].join();
+  workers.clear();
+
+  // Prefix sums of the attribute counts give each chunk its global base.
+  std::vector<attrib_counts> bases(num_threads);
+  attrib_counts total = {0, 0, 0};
+  for (unsigned int i = 0; i < num_threads; i++) {
+    bases[i] = total;
+    total.v += chunks[i].attribs.v.size() / 3;
+    total.vn += chunks[i].attribs.vn.size() / 3;
+    total.vt += chunks[i].attribs.vt.size() / 2;
+  }
+
+  obj_shape attribs;
+  attribs.v.resize(3 * total.v);
+  attribs.vn.resize(3 * total.vn);
+  attribs.vt.resize(2 * total.vt);
+
+  for (unsigned int i = 0; i < num_threads; i++)
+    workers.push_back(std::thread(mergeChunk, std::ref(chunks[i]),
+                                  std::cref(bases[i]), std::ref(attribs)));
+  for (unsigned int i = 0; i < num_threads; i++)
+    workers[i].join();
+
+  // Replay faces and records in file order.
+  shape_builder builder(shapes, materials, attribs, readMatFn);
+  for (unsigned int i = 0; i < num_threads; i++) {
+    const obj_chunk &chunk = chunks[i];
+    size_t face = 0;
+    size_t corner = 0;
+    for (size_t k = 0; k < chunk.commands.size(); k++) {
+      const chunk_command &cmd = chunk.commands[k];
+      appendChunkFaces(builder, chunk, face, cmd.face, corner);
+      face = cmd.face;
+
+      std::string err_cmd;
+      builder.parseCommand(cmd.line.c_str(), err_cmd);
+      if (!err_cmd.empty())
+        return err_cmd;
+    }
+    appendChunkFaces(builder, chunk, face, chunk.faces.face_sizes.size(),
+                     corner);
+  }
+
+  builder.finish();
+
+  return std::string();
+}
+
+std::string LoadObjParallel(std::vector<shape_t> &shapes,
+                            std::vector<material_t> &materials, // [output]
+                            const char *filename, const char *mtl_basepath,
+                            unsigned int num_threads) {
+
+  shapes.clear();
+
+  std::stringstream err;
+
+  mapped_file file;
+  if (!file.open(filename)) {
+    err << "Cannot open file [" << filename << "]" << std::endl;
+    return err.str();
+  }
+
+  std::string basePath;
+  if (mtl_basepath) {
+    basePath = mtl_basepath;
+  }
+  MaterialFileReader matFileReader(basePath);
+
+  return LoadObjParallel(shapes, materials, file.data(), file.size(),
+                         matFileReader, num_threads);
+}
 }
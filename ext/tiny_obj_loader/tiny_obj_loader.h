@@ -85,6 +85,40 @@ std::string LoadObj(std::vector<shape_t> &shapes,       // [output]
                     std::vector<material_t> &materials, // [output]
                     std::istream &inStream, MaterialReader &readMatFn);
 
+/// Loads object from a memory buffer of 'len' bytes. The buffer does not
+/// need to be NUL-terminated; lines are tokenized in place without copying.
+/// Returns empty string when loading .obj success.
+std::string LoadObj(std::vector<shape_t> &shapes,       // [output]
+                    std::vector<material_t> &materials, // [output]
+                    const char *buf, size_t len, MaterialReader &readMatFn);
+
+/// Loads .obj from a file by memory-mapping it and parsing the mapped bytes
+/// directly, skipping the per-line copies of the std::istream path.
+/// Produces the same 'shapes' as LoadObj(shapes, materials, filename).
+/// Returns empty string when loading .obj success.
+std::string LoadObjMapped(std::vector<shape_t> &shapes,       // [output]
+                          std::vector<material_t> &materials, // [output]
+                          const char *filename,
+                          const char *mtl_basepath = NULL);
+
+/// Loads .obj from a file like LoadObjMapped(), but splits it into
+/// newline-aligned chunks that are parsed on 'num_threads' worker threads
+/// (0 picks one per hardware thread). Small files are parsed serially.
+/// Produces the same 'shapes' as LoadObj(shapes, materials, filename).
+/// Returns empty string when loading .obj success.
+std::string LoadObjParallel(std::vector<shape_t> &shapes,       // [output]
+                            std::vector<material_t> &materials, // [output]
+                            const char *filename,
+                            const char *mtl_basepath = NULL,
+                            unsigned int num_threads = 0);
+
+/// Parallel variant of the memory buffer LoadObj().
+std::string LoadObjParallel(std::vector<shape_t> &shapes,       // [output]
+                            std::vector<material_t> &materials, // [output]
+                            const char *buf, size_t len,
+                            MaterialReader &readMatFn,
+                            unsigned int num_threads = 0);
+
 /// Loads materials into std::map
 /// Returns an empty string if successful
 std::string LoadMtl(std::map<std::string, int> &material_map,
@@ -0,0 +1,371 @@
+#include "geometry_pool.h"
+
+#include <GL/glew.h>
+#include <algorithm>
+#include <cstring>
+
+static const size_t kVertexSize = 8 * sizeof(float);
+static const size_t kInitialVertices = 1 << 16;
+static const size_t kInitialIndices = 1 << 18;
+
+geometry_pool::geometry_pool()
+    : use_indirect(false), vao(0), vertex_buffer(0), index_buffer(0), command_buffer(0),
+      draw_id_buffer(0),
+      vertex_count(0), vertex_capacity(0), index_count(0), index_capacity(0),
+      commands_dirty(false), data_dirty(false), frame(0), draw_id_capacity(0) {
+    last_stats.draw_calls = 0;
+    last_stats.draws = 0;
+    last_stats.culled = 0;
+    last_stats.triangles = 0;
+}
+
+void geometry_pool::init(bool indirect, bool persistent) {
+    use_indirect = indirect;
+
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vertex_buffer);
+    glGenBuffers(1, &index_buffer);
+    glGenBuffers(1, &command_buffer);
+    glGenBuffers(1, &draw_id_buffer);
+    data_stream.init(persistent, GL_RGBA32F);
+    if (use_indirect)
+        command_stream.init(persistent);
+
+    vertex_capacity = kInitialVertices;
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertex_capacity * kVertexSize, nullptr, GL_STATIC_DRAW);
+
+    glBindVertexArray(vao);
+    bind_vertex_buffer();
+    index_capacity = kInitialIndices;
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_capacity * sizeof(unsigned short), nullptr,
+                 GL_STATIC_DRAW);
+    if (use_indirect) {
+        // draw_id_buffer holds 0, 1, 2, ...; a command's base instance
+        // selects the entry, and so the draw.
+        glBindBuffer(GL_ARRAY_BUFFER, draw_id_buffer);
+        glEnableVertexAttribArray(kDrawIdAttrib);
+        glVertexAttribIPointer(kDrawIdAttrib, 1, GL_UNSIGNED_INT, 0, 0);
+        glVertexAttribDivisor(kDrawIdAttrib, 1);
+    }
+    glBindVertexArray(0);
+}
+
+void geometry_pool::release() {
+    glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &vertex_buffer);
+    glDeleteBuffers(1, &index_buffer);
+    glDeleteBuffers(1, &command_buffer);
+    glDeleteBuffers(1, &draw_id_buffer);
+    data_stream.release();
+    command_stream.release();
+    vao = vertex_buffer = index_buffer = command_buffer = draw_id_buffer = 0;
+    vertex_count = vertex_capacity = index_count = index_capacity = draw_id_capacity = 0;
+    meshes.clear();
+    draws.clear();
+    draw_frames.clear();
+    draw_data.clear();
+    commands.clear();
+    groups.clear();
+}
+
+// Attribute pointers of the bound VAO into vertex_buffer.
+void geometry_pool::bind_vertex_buffer() {
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, kVertexSize, 0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, kVertexSize, (const void *) (3 * sizeof(float)));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, kVertexSize, (const void *) (5 * sizeof(float)));
+}
+
+// Replaces 'buffer' with a bigger one holding the same first 'used_bytes'.
+void geometry_pool::grow(unsigned int &buffer, size_t used_bytes, size_t new_bytes) {
+    unsigned int bigger;
+    glGenBuffers(1, &bigger);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, bigger);
+    glBufferData(GL_COPY_WRITE_BUFFER, new_bytes, nullptr, GL_STATIC_DRAW);
+    if (used_bytes > 0) {
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used_bytes);
+    }
+    glDeleteBuffers(1, &buffer);
+    buffer = bigger;
+}
+
+unsigned int geometry_pool::add_mesh(const mesh_view &shape) {
+    size_t count = shape.num_positions / 3;
+    packed_indices indices = pack_lods(shape, 2);
+    if (indices.index_size != 2)
+        return kInvalid;
+    size_t num_indices = indices.data.size() / sizeof(unsigned short);
+
+    bool has_texcoords = shape.num_texcoords >= 2 * count;
+    bool has_normals = shape.num_normals >= 3 * count;
+    std::vector<float> vertices(8 * count, 0.0f);
+    for (size_t i = 0; i < count; i++) {
+        float *dst = &vertices[8 * i];
+        memcpy(dst, shape.positions + 3 * i, 3 * sizeof(float));
+        if (has_texcoords)
+            memcpy(dst + 3, shape.texcoords + 2 * i, 2 * sizeof(float));
+        if (has_normals)
+            memcpy(dst + 5, shape.normals + 3 * i, 3 * sizeof(float));
+    }
+
+    if (vertex_count + count > vertex_capacity) {
+        size_t capacity = vertex_capacity;
+        while (vertex_count + count > capacity)
+            capacity *= 2;
+        grow(vertex_buffer, vertex_count * kVertexSize, capacity * kVertexSize);
+        vertex_capacity = capacity;
+        glBindVertexArray(vao);
+        bind_vertex_buffer();
+        glBindVertexArray(0);
+    }
+    if (index_count + num_indices > index_capacity) {
+        size_t capacity = index_capacity;
+        while (index_count + num_indices > capacity)
+            capacity *= 2;
+        grow(index_buffer, index_count * sizeof(unsigned short), capacity * sizeof(unsigned short));
+        index_capacity = capacity;
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+        glBindVertexArray(0);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, vertex_count * kVertexSize, vertices.size() * sizeof(float),
+                    vertices.data());
+    // Upload through the copy target so no VAO's element binding changes
+    glBindBuffer(GL_COPY_WRITE_BUFFER, index_buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, index_count * sizeof(unsigned short),
+                    indices.data.size(), indices.data.data());
+
+    pool_mesh mesh;
+    mesh.first_index = index_count;
+    mesh.base_vertex = vertex_count;
+    mesh.ranges = indices.ranges;
+    mesh.lod_starts = indices.lod_starts;
+    meshes.push_back(mesh);
+
+    vertex_count += count;
+    index_count += num_indices;
+    return meshes.size() - 1;
+}
+
+unsigned int geometry_pool::add_draw(unsigned int mesh, unsigned int program, unsigned int texture,
+                                     unsigned int layer) {
+    static const float identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    pool_draw d;
+    d.mesh = mesh;
+    d.lod = 0;
+    d.program = program;
+    d.texture = texture;
+    draws.push_back(d);
+    draw_frames.push_back(0);
+    draw_data.insert(draw_data.end(), identity, identity + 16);
+    const float extra[4] = {(float) layer, 0, 0, 0};
+    draw_data.insert(draw_data.end(), extra, extra + 4);
+    commands_dirty = true;
+    data_dirty = true;
+    return draws.size() - 1;
+}
+
+void geometry_pool::set_model(unsigned int draw, const float *model) {
+    if (draw >= draws.size())
+        return;
+    memcpy(&draw_data[4 * kDrawTexels * draw], model, 16 * sizeof(float));
+    data_dirty = true;
+}
+
+void geometry_pool::set_texture(unsigned int draw, unsigned int texture, unsigned int layer) {
+    if (draw >= draws.size())
+        return;
+    draws[draw].texture = texture;
+    draw_data[4 * kDrawTexels * draw + 16] = (float) layer;
+    commands_dirty = true;
+    data_dirty = true;
+}
+
+void geometry_pool::set_lod(unsigned int draw, unsigned int lod) {
+    if (draw >= draws.size())
+        return;
+    unsigned int levels = meshes[draws[draw].mesh].lod_starts.size() - 1;
+    if (lod >= levels)
+        lod = levels - 1;
+    if (lod != draws[draw].lod) {
+        draws[draw].lod = lod;
+        commands_dirty = true;
+    }
+}
+
+namespace {
+struct draw_order {
+    const std::vector<unsigned int> *programs, *textures;
+    bool operator()(unsigned int a, unsigned int b) const {
+        if ((*programs)[a] != (*programs)[b])
+            return (*programs)[a] < (*programs)[b];
+        return (*textures)[a] < (*textures)[b];
+    }
+};
+}
+
+void geometry_pool::build_commands() {
+    std::vector<unsigned int> programs(draws.size()), textures(draws.size()), order(draws.size());
+    for (size_t i = 0; i < draws.size(); i++) {
+        programs[i] = draws[i].program;
+        textures[i] = draws[i].texture;
+        order[i] = i;
+    }
+    draw_order less = {&programs, &textures};
+    std::stable_sort(order.begin(), order.end(), less);
+
+    commands.clear();
+    groups.clear();
+    for (size_t i = 0; i < order.size(); i++) {
+        const pool_draw &d = draws[order[i]];
+        if (groups.empty() || groups.back().program != d.program ||
+            groups.back().texture != d.texture) {
+            draw_group group = {d.program, d.texture, commands.size(), 0};
+            groups.push_back(group);
+        }
+        const pool_mesh &mesh = meshes[d.mesh];
+        for (size_t r = mesh.lod_starts[d.lod]; r < mesh.lod_starts[d.lod + 1]; r++) {
+            draw_command cmd;
+            cmd.count = mesh.ranges[r].count;
+            cmd.instance_count = 1;
+            cmd.first_index = mesh.first_index + mesh.ranges[r].first;
+            cmd.base_vertex = mesh.base_vertex + mesh.ranges[r].base_vertex;
+            cmd.base_instance = order[i];
+            commands.push_back(cmd);
+            groups.back().count++;
+        }
+    }
+
+    // The sampler only needs setting once per program.
+    for (size_t g = 0; g < groups.size(); g++) {
+        if (g == 0 || groups[g].program != groups[g - 1].program) {
+            glUseProgram(groups[g].program);
+            glUniform1i(glGetUniformLocation(groups[g].program, "draws"), kDrawDataUnit);
+        }
+    }
+
+    if (use_indirect) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(draw_command),
+                     commands.data(), GL_STATIC_DRAW);
+        if (draws.size() > draw_id_capacity) {
+            std::vector<unsigned int> ids(draws.size());
+            for (size_t i = 0; i < ids.size(); i++)
+                ids[i] = i;
+            glBindBuffer(GL_ARRAY_BUFFER, draw_id_buffer);
+            glBufferData(GL_ARRAY_BUFFER, ids.size() * sizeof(unsigned int), ids.data(),
+                         GL_STATIC_DRAW);
+            draw_id_capacity = ids.size();
+        }
+    }
+    commands_dirty = false;
+}
+
+// Copies the commands of the draws in 'visible' into visible_commands and
+// visible_groups, keeping their order. Returns the number of draws culled.
+unsigned int geometry_pool::compact_commands(const std::vector<unsigned int> &visible) {
+    frame++;
+    unsigned int shown = 0;
+    for (size_t i = 0; i < visible.size(); i++) {
+        unsigned int d = visible[i];
+        if (d < draws.size() && draw_frames[d] != frame) {
+            draw_frames[d] = frame;
+            shown++;
+        }
+    }
+
+    visible_commands.clear();
+    visible_groups.clear();
+    for (size_t g = 0; g < groups.size(); g++) {
+        draw_group group = groups[g];
+        size_t end = group.first + group.count;
+        group.first = visible_commands.size();
+        for (size_t c = groups[g].first; c < end; c++) {
+            if (draw_frames[commands[c].base_instance] == frame)
+                visible_commands.push_back(commands[c]);
+        }
+        group.count = visible_commands.size() - group.first;
+        if (group.count > 0)
+            visible_groups.push_back(group);
+    }
+
+    if (use_indirect && !visible_commands.empty()) {
+        size_t bytes = visible_commands.size() * sizeof(draw_command);
+        memcpy(command_stream.map(bytes), visible_commands.data(), bytes);
+        command_stream.unmap();
+    }
+    return draws.size() - shown;
+}
+
+void geometry_pool::draw(const std::vector<unsigned int> *visible) {
+    pool_stats stats = {0, (unsigned int) draws.size(), 0, 0};
+    if (draws.empty()) {
+        last_stats = stats;
+        return;
+    }
+    if (commands_dirty)
+        build_commands();
+
+    const std::vector<draw_command> *cmds = &commands;
+    const std::vector<draw_group> *grps = &groups;
+    unsigned int indirect_buffer = command_buffer;
+    if (visible) {
+        stats.culled = compact_commands(*visible);
+        stats.draws -= stats.culled;
+        cmds = &visible_commands;
+        grps = &visible_groups;
+        indirect_buffer = command_stream.buffer();
+    }
+    if (data_dirty) {
+        size_t bytes = draw_data.size() * sizeof(float);
+        memcpy(data_stream.map(bytes), draw_data.data(), bytes);
+        data_stream.unmap();
+        data_dirty = false;
+    }
+
+    glBindVertexArray(vao);
+    glActiveTexture(GL_TEXTURE0 + kDrawDataUnit);
+    glBindTexture(GL_TEXTURE_BUFFER, data_stream.texture());
+    glActiveTexture(GL_TEXTURE0);
+    if (use_indirect)
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+
+    for (size_t g = 0; g < grps->size(); g++) {
+        const draw_group &group = (*grps)[g];
+        if (g == 0 || group.program != (*grps)[g - 1].program)
+            glUseProgram(group.program);
+        if (g == 0 || group.texture != (*grps)[g - 1].texture)
+            glBindTexture(GL_TEXTURE_2D_ARRAY, group.texture);
+
+        for (size_t c = group.first; c < group.first + group.count; c++)
+            stats.triangles += (*cmds)[c].count / 3;
+        if (use_indirect) {
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT,
+                                        (const void *) (group.first * sizeof(draw_command)),
+                                        group.count, 0);
+            stats.draw_calls++;
+            continue;
+        }
+        for (size_t c = group.first; c < group.first + group.count; c++) {
+            const draw_command &cmd = (*cmds)[c];
+            glVertexAttribI1ui(kDrawIdAttrib, cmd.base_instance);
+            glDrawElementsBaseVertex(GL_TRIANGLES, cmd.count, GL_UNSIGNED_SHORT,
+                                     (const void *) ((size_t) cmd.first_index * sizeof(unsigned short)),
+                                     cmd.base_vertex);
+            stats.draw_calls++;
+        }
+    }
+    data_stream.fence();
+    if (visible && use_indirect)
+        command_stream.fence();
+    glBindVertexArray(0);
+    last_stats = stats;
+}
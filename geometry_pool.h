@@ -0,0 +1,142 @@
+#ifndef GEOMETRY_POOL_H
+#define GEOMETRY_POOL_H
+
+#include <vector>
+#include "mesh_cache.h"
+#include "stream_buffer.h"
+#include "vertex_format.h"
+
+// Vertex attribute holding the draw's index into the per-draw data; see
+// shader/pool_vs.txt.
+const unsigned int kDrawIdAttrib = 7;
+
+// Texels of per-draw data: the model matrix's columns, then the texture
+// layer in x.
+const unsigned int kDrawTexels = 5;
+
+// Texture unit the per-draw data buffer is bound to.
+const unsigned int kDrawDataUnit = 1;
+
+// Work done by the last geometry_pool::draw().
+struct pool_stats {
+    unsigned int draw_calls; // glMultiDrawElementsIndirect or glDrawElementsBaseVertex
+    unsigned int draws;      // draws drawn, i.e. objects
+    unsigned int culled;     // draws left out of the visible list
+    unsigned int triangles;  // submitted
+};
+
+// Static meshes suballocated from one shared vertex buffer and one shared
+// 16-bit index buffer, drawn with a single VAO.
+//
+// Vertices are position, texcoord and normal as 32-bit floats (32 bytes);
+// attributes a mesh lacks are zero. Each draw is a (mesh, program, texture
+// array) with its own model matrix and layer, kept in a texture buffer that
+// the vertex shader reads at 'draw_id'. That data is streamed: on frames
+// where a model changed, all of it is copied into the next buffer of a
+// stream_buffer ring with one memcpy. Draws are grouped by program and texture; with
+// ARB_multi_draw_indirect each group is one glMultiDrawElementsIndirect
+// whose commands pass the draw's index as base instance. Without it, every
+// draw is a glDrawElementsBaseVertex with 'draw_id' set as a constant
+// attribute.
+//
+// Meshes and draws are never freed, so their ids stay valid until
+// release(). The command list is rebuilt only after add_draw(), or a
+// set_texture() or set_lod() that changes something. When
+// draw() is given a visible list, the commands of the listed draws are
+// copied into a per-frame list instead, streamed for the indirect path.
+class geometry_pool {
+public:
+    static const unsigned int kInvalid = ~0u;
+
+    geometry_pool();
+
+    // Creates the GL objects; needs a current context. 'persistent' maps the
+    // per-draw data persistently (ARB_buffer_storage).
+    void init(bool indirect, bool persistent);
+    void release();
+
+    // Uploads 'shape', with all its levels of detail. Returns kInvalid if
+    // it cannot use 16-bit indices, which only happens when a triangle
+    // spans more than 65536 vertices.
+    unsigned int add_mesh(const mesh_view &shape);
+
+    unsigned int add_draw(unsigned int mesh, unsigned int program, unsigned int texture,
+                          unsigned int layer);
+
+    // 'model' is a column-major 4x4 matrix.
+    void set_model(unsigned int draw, const float *model);
+    void set_texture(unsigned int draw, unsigned int texture, unsigned int layer);
+    // Draws level of detail 'lod' of the draw's mesh, clamped to those it has.
+    void set_lod(unsigned int draw, unsigned int lod);
+
+    // Binds its own VAO and leaves VAO 0 bound. If 'visible' is given, only
+    // the draws it lists are drawn.
+    void draw(const std::vector<unsigned int> *visible = nullptr);
+
+    bool indirect() const { return use_indirect; }
+    const stream_stats &data_stats() const { return data_stream.stats(); }
+    const pool_stats &stats() const { return last_stats; }
+
+private:
+    struct pool_mesh {
+        unsigned int first_index;
+        int base_vertex;
+        std::vector<index_range> ranges;
+        std::vector<unsigned int> lod_starts; // as in packed_indices
+    };
+
+    struct pool_draw {
+        unsigned int mesh;
+        unsigned int lod;
+        unsigned int program;
+        unsigned int texture;
+    };
+
+    // Same layout as GL's DrawElementsIndirectCommand.
+    struct draw_command {
+        unsigned int count;
+        unsigned int instance_count;
+        unsigned int first_index;
+        int base_vertex;
+        unsigned int base_instance;
+    };
+
+    // A run of commands sharing program and texture.
+    struct draw_group {
+        unsigned int program;
+        unsigned int texture;
+        size_t first;
+        size_t count;
+    };
+
+    void grow(unsigned int &buffer, size_t used_bytes, size_t new_bytes);
+    void bind_vertex_buffer();
+    void build_commands();
+    unsigned int compact_commands(const std::vector<unsigned int> &visible);
+
+    bool use_indirect;
+    unsigned int vao;
+    unsigned int vertex_buffer, index_buffer, command_buffer, draw_id_buffer;
+    stream_buffer data_stream;
+    size_t vertex_count, vertex_capacity; // in vertices
+    size_t index_count, index_capacity;   // in indices
+
+    std::vector<pool_mesh> meshes;
+    std::vector<pool_draw> draws;
+    std::vector<float> draw_data; // 4 * kDrawTexels per draw
+    std::vector<draw_command> commands;
+    std::vector<draw_group> groups;
+    bool commands_dirty, data_dirty;
+
+    // Compacted per draw(visible)
+    std::vector<unsigned int> draw_frames; // by draw, last frame it was visible
+    std::vector<draw_command> visible_commands;
+    std::vector<draw_group> visible_groups;
+    stream_buffer command_stream;
+    unsigned int frame;
+    size_t draw_id_capacity;
+
+    pool_stats last_stats;
+};
+
+#endif // GEOMETRY_POOL_H
@@ -1,26 +1,127 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <iostream>
-#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <chrono>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
 #include <tiny_obj_loader.h>
+#include "mesh_cache.h"
+#include "vertex_format.h"
+#include "mesh_optimizer.h"
+#include "render_queue.h"
+#include "geometry_pool.h"
+#include "texture_manager.h"
+#include "bmp_reader.h"
+#include "asset_loader.h"
+#include "stream_buffer.h"
+#include "scene_graph.h"
+#include "culling.h"
+#include "thread_pool.h"
+#include "occlusion.h"
+#include "render_target.h"
+#include "profiler.h"
+#include "simulation.h"
+#include "shader_cache.h"
+#include "camera.h"
+
+// Levels of detail of a mesh, for picking one by its size on screen.
+struct lod_table {
+    unsigned int count; // 1 for the full mesh only
+    float error[kMaxLods]; // per level, relative to the mesh's bounding radius
+};
 
 struct object_struct {
     unsigned int program;
     unsigned int vao;
     unsigned int vbo[4];
-    unsigned int texture;
+    unsigned int texture; // shared, owned by 'textures'
+    unsigned int layer;
+    unsigned int instance_vbo; // per-instance model matrices, 0 if not instanced
+    unsigned int queue_handle; // this object's entry in 'queue', ~0u while loading
+    unsigned int pool_mesh, pool_draw; // in 'pool', or geometry_pool::kInvalid
+    unsigned int cull_entry; // in 'cull_set', ~0u while loading
+    bounds local_bounds; // of the mesh, before 'model'
+    lod_table lods;
     glm::mat4 model;
 
-    object_struct() : model(glm::mat4(1.0f)) { }
+    object_struct()
+        : program(0), vao(0), vbo(), texture(0), layer(0), instance_vbo(0), queue_handle(~0u),
+          pool_mesh(geometry_pool::kInvalid), pool_draw(geometry_pool::kInvalid),
+          cull_entry(~0u), local_bounds(), lods(), model(glm::mat4(1.0f)) { }
 };
 
 std::vector<object_struct> objects; // vertex array object,vertex buffer object and texture(color) for objs
-unsigned int program, program2;
-std::vector<int> indicesCount; // number of indice of objs
+render_queue queue; // what render() draws, sorted by state
+unsigned int program, program2, pool_program;
+program_cache shaders; // holds a reference to each of them
+geometry_pool pool; // shared buffers for static meshes, with --pool
+texture_manager textures; // every texture, shared between objects
+std::vector<unsigned char> texture_staging; // decoded pixels, reused for every texture
+double texture_decode_time = 0; // seconds spent decoding .bmp files, for the startup report
+size_t texture_decode_bytes = 0;
+asset_loader *loader = nullptr; // loads in the background, with --async
+std::set<std::string> textures_loading; // paths submitted to 'loader' but not added yet
+typedef std::multimap<std::string, int> waiter_map;
+waiter_map texture_waiters; // objects loaded before their texture, by texture path
+const double kUploadBudget = 0.004; // seconds per frame spent finishing loads
+
+// The 'frame' uniform block of the shaders, std140
+struct frame_uniforms {
+    glm::mat4 vp;
+};
+const unsigned int kFrameBlock = 0; // its binding point
+stream_buffer frame_stream; // frame_uniforms, written every frame
+bool use_pool = false;
+vertex_layout mesh_layout = LAYOUT_INTERLEAVED; // how add_obj lays out vertex buffers
+unsigned int mesh_optimize_flags = 0; // OPTIMIZE_* passes add_obj runs on new meshes
+int bench_instances = 0; // extra earth copies drawn for the instancing benchmark
+bool bench_instancing = true; // draw them instanced rather than one draw each
+int bench_assets = 0; // extra suns and earths loaded, for timing loads
+scene_graph scene; // transform hierarchy of the objects
+std::vector<std::pair<int, unsigned int> > scene_objects; // (object, node) whose model follows 'scene'
+
+// With --sim-thread, 'scene' is only touched by the simulation's thread
+const double kSimStep = 1.0 / 60; // seconds per tick
+simulation *sim = nullptr;
+double sim_load = 0; // --sim-load: extra seconds of work per tick
+std::vector<float> sim_worlds; // the render thread's interpolated matrices
+
+// What a culler entry stands for: a draw of 'pool' or an item of 'queue'
+struct cull_target {
+    bool pooled;
+    unsigned int handle;
+    lod_table lods;
+    unsigned int lod; // drawn now
+};
+culler cull_set; // world bounds of everything drawn
+std::vector<cull_target> cull_targets; // by culler entry
+thread_pool *workers = nullptr; // split culling and --parallel-record between threads
+bool parallel_record = false; // record the queue's draws on 'workers'
+bool use_culling = true;
+std::vector<unsigned int> visible_entries; // found by the last cull_objects()
+std::vector<unsigned int> queue_visible, pool_visible; // their handles, for render()
+
+// A mesh drawn into 'occlusion' every frame, moved like objects[obj]
+struct occluder {
+    int obj;
+    cached_mesh mesh;
+};
+std::vector<occluder *> occluders;
+occlusion_buffer occlusion; // hides objects behind the occluders, with --occlusion
+bool use_occlusion = false;
+bool use_lod = false; // pick levels of detail by size on screen
+const float kDepthSteps = 256.0f; // distances the queue tells apart
+const float kLodPixels = 1.0f; // error allowed on screen
+float lod_pixel_scale = 1.0f; // pixels per unit at distance 1
+
+profiler prof; // enabled by --profile
 
 static void error_callback(int error, const char *description) {
     fputs(description, stderr);
@@ -31,225 +132,752 @@ static void key_callback(GLFWwindow *window, int key, int scancode, int action,
         glfwSetWindowShouldClose(window, GL_TRUE);
 }
 
-static unsigned int setup_shader(const char *vertex_shader, const char *fragment_shader) {
-    GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vs, 1, (const GLchar **) &vertex_shader, nullptr);
+// Uploads each attribute of 'shape' into its own buffer of the bound VAO.
+static void upload_separate(object_struct &node, const mesh_view &shape) {
+    // Upload postion array
+    glBindBuffer(GL_ARRAY_BUFFER, node.vbo[0]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * shape.num_positions,
+                 shape.positions, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
 
-    glCompileShader(vs);
+    if (shape.num_texcoords > 0) {
+        // Upload texCoord array
+        glBindBuffer(GL_ARRAY_BUFFER, node.vbo[1]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * shape.num_texcoords,
+                     shape.texcoords, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    }
 
-    int status, maxLength;
-    char *infoLog = nullptr;
-    glGetShaderiv(vs, GL_COMPILE_STATUS, &status);
-    if (status == GL_FALSE) {
-        glGetShaderiv(vs, GL_INFO_LOG_LENGTH, &maxLength);
+    if (shape.num_normals > 0) {
+        // Upload normal array
+        glBindBuffer(GL_ARRAY_BUFFER, node.vbo[2]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * shape.num_normals,
+                     shape.normals, GL_STATIC_DRAW);
 
-        /* The maxLength includes the NULL character */
-        infoLog = new char[maxLength];
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    }
+}
 
-        glGetShaderInfoLog(vs, maxLength, &maxLength, infoLog);
+// Uploads vertices built by interleave_vertices() into vbo[0] of the bound VAO.
+static void upload_interleaved(object_struct &node, const std::vector<unsigned char> &vertices,
+                               const vertex_format &format, bool compact) {
+    glBindBuffer(GL_ARRAY_BUFFER, node.vbo[0]);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size(), vertices.data(), GL_STATIC_DRAW);
 
-        fprintf(stderr, "Vertex Shader Error: %s\n", infoLog);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, format.stride,
+                          (const void *) (size_t) format.position_offset);
 
-        /* Handle the error in an appropriate way such as displaying a message or writing to a log file. */
-        /* In this simple program, we'll just leave */
-        delete[] infoLog;
-        return 0;
+    if (format.texcoord_offset >= 0) {
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, compact ? GL_HALF_FLOAT : GL_FLOAT, GL_FALSE, format.stride,
+                              (const void *) (size_t) format.texcoord_offset);
     }
 
-    GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fs, 1, (const GLchar **) &fragment_shader, nullptr);
-    glCompileShader(fs);
-
-    glGetShaderiv(fs, GL_COMPILE_STATUS, &status);
-    if (status == GL_FALSE) {
-        glGetShaderiv(fs, GL_INFO_LOG_LENGTH, &maxLength);
+    if (format.normal_offset >= 0) {
+        glEnableVertexAttribArray(2);
+        if (compact)
+            glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, format.stride,
+                                  (const void *) (size_t) format.normal_offset);
+        else
+            glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, format.stride,
+                                  (const void *) (size_t) format.normal_offset);
+    }
+}
 
-        /* The maxLength includes the NULL character */
-        infoLog = new char[maxLength];
+// A .bmp decoded to memory, or the reason it could not be.
+struct texture_payload {
+    std::string path;
+    std::string error;
+    unsigned int width, height, pixel_size;
+    size_t file_size;
+    double seconds; // spent decoding
+    std::vector<unsigned char> pixels;
 
-        glGetShaderInfoLog(fs, maxLength, &maxLength, infoLog);
+    texture_payload() : width(0), height(0), pixel_size(0), file_size(0), seconds(0) { }
+};
 
-        fprintf(stderr, "Fragment Shader Error: %s\n", infoLog);
+// Reads 'tex.path' into 'tex'. Touches no GL or global state, so it can
+// run on a loader thread.
+static void decode_texture(texture_payload &tex) {
+    double start = glfwGetTime();
+    bmp_reader bmp;
+    tex.error = bmp.open(tex.path.c_str());
+    if (tex.error.empty()) {
+        if (tex.pixels.size() < bmp.decoded_size())
+            tex.pixels.resize(bmp.decoded_size());
+        tex.error = bmp.decode(&tex.pixels[0]);
+    }
+    tex.seconds = glfwGetTime() - start;
+    tex.width = bmp.width();
+    tex.height = bmp.height();
+    tex.pixel_size = bmp.pixel_size();
+    tex.file_size = bmp.size();
+}
 
-        /* Handle the error in an appropriate way such as displaying a message or writing to a log file. */
-        /* In this simple program, we'll just leave */
-        delete[] infoLog;
-        return 0;
+// Hands a decoded texture to 'textures', or records it as missing.
+static void add_texture(texture_payload &tex) {
+    texture_decode_time += tex.seconds;
+    if (tex.error.empty()) {
+        texture_decode_bytes += tex.file_size;
+        GLenum format = (tex.pixel_size == 3 ? GL_BGR : GL_BGRA);
+        textures.add(tex.path, tex.width, tex.height, format, tex.pixel_size, &tex.pixels[0]);
+    } else {
+        std::cerr << tex.error << std::endl;
+        textures.add_missing(tex.path);
     }
+}
 
-    unsigned int program = glCreateProgram();
-    // Attach our shaders to our program
-    glAttachShader(program, vs);
-    glAttachShader(program, fs);
+// Loads 'texbmp' into 'textures' now, unless it is there already.
+static void load_texture(const char *texbmp) {
+    if (textures.has(texbmp))
+        return;
+    texture_payload tex;
+    tex.path = texbmp;
+    tex.pixels.swap(texture_staging);
+    decode_texture(tex);
+    add_texture(tex);
+    tex.pixels.swap(texture_staging);
+}
 
-    glLinkProgram(program);
+// Everything about a mesh that can be worked out without GL.
+struct obj_payload {
+    std::string texbmp;
+    std::string error;
+    cached_mesh mesh;
+    std::vector<unsigned char> vertices; // interleaved layouts only
+    vertex_format format;
+    packed_indices indices; // every level of detail
+    bounds local_bounds;
+    lod_table lods;
+};
 
-    glGetProgramiv(program, GL_LINK_STATUS, &status);
+// Parses (or maps) the mesh and builds its vertex and index data. Touches
+// no GL or global state but the options, so it can run on a loader thread.
+static void prepare_obj(obj_payload &p, const char *filename, const char *texbmp) {
+    p.texbmp = texbmp;
+    p.error = p.mesh.load(filename, mesh_optimize_flags);
+    if (!p.error.empty() || p.mesh.shape_count() == 0)
+        return;
+    const mesh_view &shape = p.mesh.shape(0);
+    p.local_bounds = compute_bounds(shape.positions, shape.num_positions / 3);
+    p.lods.count = shape.num_lods;
+    for (unsigned int l = 0; l < shape.num_lods; l++)
+        p.lods.error[l] = p.local_bounds.radius > 0 ? shape.lods[l].error / p.local_bounds.radius : 0;
+    if (mesh_layout != LAYOUT_SEPARATE)
+        p.format = interleave_vertices(shape, mesh_layout == LAYOUT_COMPACT, p.vertices);
+    // In the narrowest index type
+    p.indices = pack_lods(shape);
+}
 
-    if (status == GL_FALSE) {
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &maxLength);
+// Creates the VAO and buffers for a prepared mesh; fills in what 'item'
+// needs to draw it.
+static void upload_obj(unsigned int program, const obj_payload &p, object_struct &new_node,
+                       draw_item &item) {
+    const mesh_view &shape = p.mesh.shape(0);
 
+    glGenVertexArrays(1, &new_node.vao);
+    glGenBuffers(4, new_node.vbo);
 
-        /* The maxLength includes the NULL character */
-        infoLog = new char[maxLength];
-        glGetProgramInfoLog(program, maxLength, NULL, infoLog);
+    glBindVertexArray(new_node.vao);
 
-        glGetProgramInfoLog(program, maxLength, &maxLength, infoLog);
+    // The VAO records the layout, so render() is the same for all of them.
+    if (mesh_layout == LAYOUT_SEPARATE)
+        upload_separate(new_node, shape);
+    else
+        upload_interleaved(new_node, p.vertices, p.format, mesh_layout == LAYOUT_COMPACT);
 
-        fprintf(stderr, "Link Error: %s\n", infoLog);
+    // Setup index buffer for glDrawElements
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, new_node.vbo[3]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, p.indices.data.size(), p.indices.data.data(),
+                 GL_STATIC_DRAW);
 
-        /* Handle the error in an appropriate way such as displaying a message or writing to a log file. */
-        /* In this simple program, we'll just leave */
-        delete[] infoLog;
-        return 0;
-    }
-    return program;
-}
+    glBindVertexArray(0);
 
-static std::string readfile(const char *filename) {
-    std::ifstream ifs(filename);
-    if (!ifs)
-        exit(EXIT_FAILURE);
-    return std::string((std::istreambuf_iterator<char>(ifs)),
-                       (std::istreambuf_iterator<char>()));
-}
-
-// mini bmp loader written by HSU YOU-LUN
-static unsigned char *load_bmp(const char *bmp, unsigned int *width, unsigned int *height, unsigned short int *bits) {
-    unsigned char *result = nullptr;
-    FILE *fp = fopen(bmp, "rb");
-    if (!fp)
-        return nullptr;
-    char type[2];
-    unsigned int size, offset;
-    // check for magic signature
-    fread(type, sizeof(type), 1, fp);
-    if (type[0] == 0x42 || type[1] == 0x4d) {
-        fread(&size, sizeof(size), 1, fp);
-        // ignore 2 two-byte reversed fields
-        fseek(fp, 4, SEEK_CUR);
-        fread(&offset, sizeof(offset), 1, fp);
-        // ignore size of bmpinfoheader field
-        fseek(fp, 4, SEEK_CUR);
-        fread(width, sizeof(*width), 1, fp);
-        fread(height, sizeof(*height), 1, fp);
-        // ignore planes field
-        fseek(fp, 2, SEEK_CUR);
-        fread(bits, sizeof(*bits), 1, fp);
-        unsigned char *pos = result = new unsigned char[size - offset];
-        fseek(fp, offset, SEEK_SET);
-        while (size - ftell(fp) > 0)
-            pos += fread(pos, 1, size - ftell(fp), fp);
-    }
-    fclose(fp);
-    return result;
+    new_node.program = program;
+
+    item.program = program;
+    item.vao = new_node.vao;
+    item.texture = new_node.texture;
+    item.layer = new_node.layer;
+    item.index_size = p.indices.index_size;
+    item.index_type = p.indices.index_size == 1 ? GL_UNSIGNED_BYTE :
+                      p.indices.index_size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    item.draws = p.indices.ranges;
+    item.lod_starts = p.indices.lod_starts;
 }
 
-static int add_obj(unsigned int program, const char *filename, const char *texbmp) {
-    object_struct new_node;
+// Puts the mesh into 'pool' instead of giving it its own buffers, drawn
+// with pool_program. Returns false if the pool cannot take it.
+static bool upload_pooled(const obj_payload &p, object_struct &new_node) {
+    new_node.pool_mesh = pool.add_mesh(p.mesh.shape(0));
+    if (new_node.pool_mesh == geometry_pool::kInvalid)
+        return false;
+    new_node.program = pool_program;
+    new_node.pool_draw = pool.add_draw(new_node.pool_mesh, pool_program, new_node.texture,
+                                       new_node.layer);
+    return true;
+}
 
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
+// Gives a drawn object a culler entry, with 'local' moved by 'model'.
+static unsigned int add_cull_entry(bool pooled, unsigned int handle, const bounds &local,
+                                   const glm::mat4 &model, const lod_table &lods) {
+    cull_target target = {pooled, handle, lods, 0};
+    cull_targets.push_back(target);
+    return cull_set.add(transform_bounds(local, glm::value_ptr(model)));
+}
 
-    std::string err = tinyobj::LoadObj(shapes, materials, filename);
+static void set_model(int obj, const glm::mat4 &model) {
+    objects[obj].model = model;
+    if (objects[obj].pool_draw != geometry_pool::kInvalid)
+        pool.set_model(objects[obj].pool_draw, glm::value_ptr(model));
+    else
+        queue.set_model(objects[obj].queue_handle, glm::value_ptr(model));
+    if (objects[obj].cull_entry != ~0u)
+        cull_set.set(objects[obj].cull_entry,
+                     transform_bounds(objects[obj].local_bounds, glm::value_ptr(model)));
+}
 
-    if (!err.empty() || shapes.size() == 0) {
-        std::cerr << err << std::endl;
+// Makes objects[obj] from a prepared mesh and queues it for drawing. If its
+// texture is still being loaded, it is drawn untextured until then.
+static void finish_obj(unsigned int program, const obj_payload &p, int obj) {
+    if (!p.error.empty() || p.mesh.shape_count() == 0) {
+        std::cerr << p.error << std::endl;
         exit(1);
     }
 
-    glGenVertexArrays(1, &new_node.vao);
-    glGenBuffers(4, new_node.vbo);
-    glGenTextures(1, &new_node.texture);
+    object_struct new_node;
+    texture_ref ref = {0, 0};
+    if (p.mesh.shape(0).num_texcoords > 0 && !textures.find(p.texbmp, ref))
+        texture_waiters.insert(std::make_pair(p.texbmp, obj));
+    new_node.texture = ref.texture;
+    new_node.layer = ref.layer;
+    new_node.local_bounds = p.local_bounds;
+    new_node.lods = p.lods;
 
-    glBindVertexArray(new_node.vao);
+    if (!use_pool || !upload_pooled(p, new_node)) {
+        draw_item item;
+        upload_obj(program, p, new_node, item);
+        new_node.queue_handle = queue.add(item);
+        new_node.cull_entry = add_cull_entry(false, new_node.queue_handle, p.local_bounds,
+                                             objects[obj].model, p.lods);
+    } else {
+        new_node.cull_entry = add_cull_entry(true, new_node.pool_draw, p.local_bounds,
+                                             objects[obj].model, p.lods);
+    }
 
-    // Upload postion array
-    glBindBuffer(GL_ARRAY_BUFFER, new_node.vbo[0]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * shapes[0].mesh.positions.size(),
-                 shapes[0].mesh.positions.data(), GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    if (shapes[0].mesh.texcoords.size() > 0) {
+    // Keep a model set while the object was loading
+    glm::mat4 model = objects[obj].model;
+    objects[obj] = new_node;
+    set_model(obj, model);
+}
 
-        // Upload texCoord array
-        glBindBuffer(GL_ARRAY_BUFFER, new_node.vbo[1]);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * shapes[0].mesh.texcoords.size(),
-                     shapes[0].mesh.texcoords.data(), GL_STATIC_DRAW);
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+static int add_obj(unsigned int program, const char *filename, const char *texbmp) {
+    objects.push_back(object_struct());
+    int obj = objects.size() - 1;
 
-        glBindTexture(GL_TEXTURE_2D, new_node.texture);
-        unsigned int width, height;
-        unsigned short int bits;
-        unsigned char *bgr = load_bmp(texbmp, &width, &height, &bits);
-        GLenum format = (bits == 24 ? GL_BGR : GL_BGRA);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, format, GL_UNSIGNED_BYTE, bgr);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
-        glGenerateMipmap(GL_TEXTURE_2D);
-        delete[] bgr;
-    }
+    obj_payload p;
+    prepare_obj(p, filename, texbmp);
+    if (p.error.empty() && p.mesh.shape_count() > 0 && p.mesh.shape(0).num_texcoords > 0)
+        load_texture(texbmp);
+    finish_obj(program, p, obj);
+    return obj;
+}
 
-    if (shapes[0].mesh.normals.size() > 0) {
-        // Upload normal array
-        glBindBuffer(GL_ARRAY_BUFFER, new_node.vbo[2]);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * shapes[0].mesh.normals.size(),
-                     shapes[0].mesh.normals.data(), GL_STATIC_DRAW);
+// A mesh parsed on a loader thread.
+class obj_job : public load_job {
+public:
+    obj_job(unsigned int program, const char *filename, const char *texbmp, int obj)
+        : program(program), filename(filename), texbmp(texbmp), obj(obj) { }
 
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    void run() { prepare_obj(payload, filename.c_str(), texbmp.c_str()); }
+    void finish() { finish_obj(program, payload, obj); }
+
+private:
+    unsigned int program;
+    std::string filename, texbmp;
+    int obj;
+    obj_payload payload;
+};
+
+// A texture decoded on a loader thread. Objects that finished first get it
+// once it is added.
+class texture_job : public load_job {
+public:
+    explicit texture_job(const char *texbmp) { tex.path = texbmp; }
+
+    void run() { decode_texture(tex); }
+
+    void finish() {
+        add_texture(tex);
+        textures_loading.erase(tex.path);
+        std::pair<waiter_map::iterator, waiter_map::iterator> range =
+            texture_waiters.equal_range(tex.path);
+        for (waiter_map::iterator it = range.first; it != range.second; ++it) {
+            texture_ref ref;
+            textures.find(tex.path, ref);
+            object_struct &node = objects[it->second];
+            node.texture = ref.texture;
+            node.layer = ref.layer;
+            if (node.pool_draw != geometry_pool::kInvalid)
+                pool.set_texture(node.pool_draw, ref.texture, ref.layer);
+            else
+                queue.set_texture(node.queue_handle, ref.texture, ref.layer);
+        }
+        texture_waiters.erase(range.first, range.second);
     }
 
-    // Setup index buffer for glDrawElements
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, new_node.vbo[3]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * shapes[0].mesh.indices.size(),
-                 shapes[0].mesh.indices.data(), GL_STATIC_DRAW);
+private:
+    texture_payload tex;
+};
 
-    indicesCount.push_back(shapes[0].mesh.indices.size());
+// Like add_obj, but the mesh and texture load on 'loader' threads. The
+// object exists at once but is only drawn after loader->drain() finishes
+// it; set_model() can be called before that.
+static int add_obj_async(unsigned int program, const char *filename, const char *texbmp) {
+    objects.push_back(object_struct());
+    int obj = objects.size() - 1;
 
+    // Each texture is decoded once, however many objects ask for it
+    if (!textures.has(texbmp) && textures_loading.insert(texbmp).second)
+        loader->submit(new texture_job(texbmp));
+    loader->submit(new obj_job(program, filename, texbmp, obj));
+    return obj;
+}
+
+// Like add_obj, but the object is drawn once per matrix given to
+// set_instances(), with a single draw call. Starts with no instances.
+static int add_instanced_obj(unsigned int program, const char *filename, const char *texbmp) {
+    obj_payload p;
+    prepare_obj(p, filename, texbmp);
+    if (!p.error.empty() || p.mesh.shape_count() == 0) {
+        std::cerr << p.error << std::endl;
+        exit(1);
+    }
+
+    object_struct new_node;
+    if (p.mesh.shape(0).num_texcoords > 0) {
+        load_texture(texbmp);
+        texture_ref ref;
+        textures.find(texbmp, ref);
+        new_node.texture = ref.texture;
+        new_node.layer = ref.layer;
+    }
+    draw_item item;
+    upload_obj(program, p, new_node, item);
+
+    glGenBuffers(1, &new_node.instance_vbo);
+    glBindVertexArray(new_node.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, new_node.instance_vbo);
+    // A mat4 attribute takes four locations, one column each
+    for (unsigned int c = 0; c < 4; c++) {
+        glEnableVertexAttribArray(kModelAttrib + c);
+        glVertexAttribPointer(kModelAttrib + c, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4),
+                              (const void *) (sizeof(glm::vec4) * c));
+        glVertexAttribDivisor(kModelAttrib + c, 1);
+    }
     glBindVertexArray(0);
 
-    new_node.program = program;
+    item.instanced = true;
+    new_node.queue_handle = queue.add(item);
+    // Instances share one level, so they stay at full detail
+    new_node.local_bounds = p.local_bounds;
+    new_node.lods.count = 1;
+    new_node.cull_entry = add_cull_entry(false, new_node.queue_handle, p.local_bounds,
+                                         new_node.model, new_node.lods);
 
     objects.push_back(new_node);
     return objects.size() - 1;
 }
 
+// The instances are culled together, as one draw, by bounds around all
+// of them.
+static void set_instances(int obj, const std::vector<glm::mat4> &models) {
+    glBindBuffer(GL_ARRAY_BUFFER, objects[obj].instance_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(glm::mat4) * models.size(),
+                 models.empty() ? nullptr : &models[0], GL_DYNAMIC_DRAW);
+    queue.set_instance_count(objects[obj].queue_handle, models.size());
+
+    if (models.empty())
+        return;
+    const bounds &local = objects[obj].local_bounds;
+    bounds all = transform_bounds(local, glm::value_ptr(models[0]));
+    for (size_t i = 1; i < models.size(); i++)
+        all = merge_bounds(all, transform_bounds(local, glm::value_ptr(models[i])));
+    cull_set.set(objects[obj].cull_entry, all);
+}
+
+// 'count' copies of a sphere of radius 'radius' on a cube grid filling the
+// view, for the instancing benchmark.
+static std::vector<glm::mat4> grid_models(int count, float radius) {
+    int side = 1;
+    while (side * side * side < count)
+        side++;
+    float spacing = 16.0f / side;
+    float scale = 0.4f * spacing / radius;
+    std::vector<glm::mat4> models;
+    for (int i = 0; i < count; i++) {
+        glm::vec3 pos(i % side, (i / side) % side, i / (side * side));
+        pos = (pos - glm::vec3((side - 1) * 0.5f)) * spacing;
+        models.push_back(glm::scale(glm::translate(glm::mat4(1.0f), pos), glm::vec3(scale)));
+    }
+    return models;
+}
+
+// Makes objects[obj], drawn from 'filename', hide what is behind it. The
+// mesh is kept on the CPU for occlusion to draw.
+static void add_occluder(int obj, const char *filename) {
+    occluder *o = new occluder;
+    o->obj = obj;
+    std::string error = o->mesh.load(filename, mesh_optimize_flags);
+    if (!error.empty() || o->mesh.shape_count() == 0) {
+        std::cerr << error << std::endl;
+        delete o;
+        return;
+    }
+    occluders.push_back(o);
+}
+
 static void releaseObjects() {
     for (int i = 0; i < objects.size(); i++) {
         glDeleteVertexArrays(1, &objects[i].vao);
-        glDeleteTextures(1, &objects[i].texture);
         glDeleteBuffers(4, objects[i].vbo);
-        glDeleteProgram(objects[i].program);
+        if (objects[i].instance_vbo)
+            glDeleteBuffers(1, &objects[i].instance_vbo);
     }
+    queue.clear();
+    queue.release();
+    pool.release();
+    textures.release();
+    cull_set.clear();
+    cull_targets.clear();
+    for (size_t i = 0; i < occluders.size(); i++)
+        delete occluders[i];
+    occluders.clear();
 }
 
-static void setUniformMat4(unsigned int program, const std::string &name, const glm::mat4 &mat) {
-    // This line can be ignore. But, if you have multiple shader program
-    // You must check if currect binding is the one you want
-    glUseProgram(program);
-    GLint loc = glGetUniformLocation(program, name.c_str());
-    if (loc == -1) return;
+// Points the program's 'frame' block at kFrameBlock. Looked up once here,
+// so drawing never asks GL for uniforms by name.
+static void bind_frame_block(unsigned int program) {
+    GLuint index = glGetUniformBlockIndex(program, "frame");
+    if (index != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, index, kFrameBlock);
+}
+
+// Streams this frame's uniforms and binds them for render().
+static void upload_frame(const frame_uniforms &frame) {
+    // mat4 of glm is column major, same as std140
+    memcpy(frame_stream.map(sizeof(frame)), &frame, sizeof(frame));
+    frame_stream.unmap();
+    glBindBufferBase(GL_UNIFORM_BUFFER, kFrameBlock, frame_stream.buffer());
+}
 
-    // mat4 of glm is column major, same as opengl
-    // we don't need to transpose it. so..GL_FALSE
-    glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(mat));
+// Prints how long loading took and what the textures cost.
+static void report_loading(double seconds) {
+    std::cout << objects.size() << " objects loaded after " << 1000.0 * seconds << " ms"
+              << std::endl;
+    const texture_stats &tex = textures.stats();
+    std::cout << "textures: " << tex.requests << " requested, " << tex.unique << " unique in "
+              << tex.arrays << " arrays, " << tex.bytes / (1024.0 * 1024.0) << " MB";
+    if (texture_decode_time > 0)
+        std::cout << ", decoded at " << texture_decode_bytes / (1024.0 * 1024.0) / texture_decode_time
+                  << " MB/s";
+    std::cout << std::endl;
+}
+
+// Prints how long the shader stage took and what the cache saved.
+static void report_shaders() {
+    const shader_cache_stats &stats = shaders.stats();
+    std::cout << "shaders: " << stats.requests << " requested, " << stats.programs << " programs, "
+              << stats.from_disk << " from saved binaries, " << 1000.0 * stats.seconds << " ms";
+    if (!shaders.saves_binaries())
+        std::cout << " (binaries not saved)";
+    std::cout << std::endl;
+}
+
+// Drops the entries of 'visible_entries' hidden behind the occluders,
+// which are drawn into 'occlusion' first. Occluders are never dropped.
+static void occlude(const glm::mat4 &vp) {
+    occlusion.begin(glm::value_ptr(vp));
+    for (size_t i = 0; i < occluders.size(); i++) {
+        const object_struct &node = objects[occluders[i]->obj];
+        if (node.cull_entry == ~0u)
+            continue; // still loading
+        const mesh_view &shape = occluders[i]->mesh.shape(0);
+        occlusion.add_occluder(shape.positions, shape.num_positions, shape.indices,
+                               shape.num_indices, glm::value_ptr(node.model));
+    }
+    occlusion.finish();
+
+    size_t kept = 0;
+    for (size_t i = 0; i < visible_entries.size(); i++) {
+        unsigned int entry = visible_entries[i];
+        bool keep = false;
+        for (size_t k = 0; k < occluders.size() && !keep; k++)
+            keep = objects[occluders[k]->obj].cull_entry == entry;
+        if (keep || occlusion.visible(cull_set.get(entry)))
+            visible_entries[kept++] = entry;
+    }
+    visible_entries.resize(kept);
+}
+
+// Finds what is inside the frustum of 'vp', and with --occlusion not
+// hidden, for render() to draw.
+static void cull_objects(const glm::mat4 &vp) {
+    cull_set.cull(extract_frustum(glm::value_ptr(vp)), workers, visible_entries);
+    if (use_occlusion)
+        occlude(vp);
+    queue_visible.clear();
+    pool_visible.clear();
+    for (size_t i = 0; i < visible_entries.size(); i++) {
+        const cull_target &target = cull_targets[visible_entries[i]];
+        (target.pooled ? pool_visible : queue_visible).push_back(target.handle);
+    }
+}
+
+// For each drawn entry, picks the coarsest level of detail whose error
+// covers at most kLodPixels on screen.
+static void select_lods(const glm::mat4 &vp) {
+    const float *m = glm::value_ptr(vp);
+    size_t count = use_culling ? visible_entries.size() : cull_targets.size();
+    for (size_t i = 0; i < count; i++) {
+        unsigned int entry = use_culling ? visible_entries[i] : i;
+        cull_target &target = cull_targets[entry];
+        if (target.lods.count <= 1)
+            continue;
+        bounds world = cull_set.get(entry);
+        // Clip w is the distance along the view direction
+        float w = m[3] * world.center[0] + m[7] * world.center[1] + m[11] * world.center[2] + m[15];
+        unsigned int lod = 0;
+        if (w > world.radius) {
+            float pixels = world.radius * lod_pixel_scale / w; // the radius on screen
+            lod = target.lods.count - 1;
+            while (lod > 0 && target.lods.error[lod] * pixels > kLodPixels)
+                lod--;
+        }
+        if (lod != target.lod) {
+            target.lod = lod;
+            if (target.pooled)
+                pool.set_lod(target.handle, lod);
+            else
+                queue.set_lod(target.handle, lod);
+        }
+    }
+}
+
+// Gives each drawn queue item its distance along the view direction, so
+// that items sharing state are drawn front to back. Distances are rounded
+// to kDepthSteps of the view range; finer, things moving a little would
+// re-sort the queue every frame.
+static void set_depths(const glm::mat4 &vp) {
+    const float *m = glm::value_ptr(vp);
+    size_t count = use_culling ? visible_entries.size() : cull_targets.size();
+    for (size_t i = 0; i < count; i++) {
+        unsigned int entry = use_culling ? visible_entries[i] : i;
+        const cull_target &target = cull_targets[entry];
+        if (target.pooled)
+            continue;
+        bounds world = cull_set.get(entry);
+        float w = m[3] * world.center[0] + m[7] * world.center[1] + m[11] * world.center[2] + m[15];
+        queue.set_depth(target.handle, std::floor((w - kNear) / (kFar - kNear) * kDepthSteps) /
+                                           kDepthSteps);
+    }
 }
 
 static void render() {
+    prof.begin_gpu("render");
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    for (int i = 0; i < objects.size(); i++) {
-        glUseProgram(objects[i].program);
-        glBindVertexArray(objects[i].vao);
-        glBindTexture(GL_TEXTURE_2D, objects[i].texture);
-        //you should send some data to shader here
-        glDrawElements(GL_TRIANGLES, indicesCount[i], GL_UNSIGNED_INT, nullptr);
+    prof.begin_gpu("queue");
+    queue.draw(use_culling ? &queue_visible : nullptr, parallel_record ? workers : nullptr);
+    prof.end_gpu();
+    prof.begin_gpu("pool");
+    pool.draw(use_culling ? &pool_visible : nullptr);
+    prof.end_gpu();
+    prof.end_gpu();
+    frame_stream.fence();
+}
+
+// Copies the world matrices update() changed to the objects using them.
+static void apply_scene() {
+    scene.update();
+    for (size_t i = 0; i < scene_objects.size(); i++) {
+        unsigned int node = scene_objects[i].second;
+        if (scene.changed(node))
+            set_model(scene_objects[i].first, glm::make_mat4(scene.world(node)));
     }
-    glBindVertexArray(0);
+}
+
+// The camera, which does not move.
+static glm::mat4 view_projection() {
+    float vp[16];
+    camera_view_projection(vp);
+    return glm::make_mat4(vp);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// One tick of the simulation thread: the sun/earth system at 'time'.
+// Spins for --sim-load to stand in for heavier simulation.
+static void simulate(unsigned int rot, unsigned int rev, double time, std::vector<float> &worlds) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    scene.set_rotation(rot, time * 2.0f, 0, 1, 0);
+    scene.set_rotation(rev, time * 0.5f, 0, 1, 0);
+    scene.update();
+    for (size_t i = 0; i < scene_objects.size(); i++)
+        memcpy(&worlds[16 * i], scene.world(scene_objects[i].second), 16 * sizeof(float));
+    while (seconds_since(start) < sim_load) {
+    }
+}
+
+// Moves the scene's objects to where the simulation thread has them now.
+static void apply_simulation() {
+    if (!sim->sample(sim_worlds))
+        return;
+    for (size_t i = 0; i < scene_objects.size(); i++)
+        set_model(scene_objects[i].first, glm::make_mat4(&sim_worlds[16 * i]));
+}
+
+// Times occlusion culling of 'count' earth boxes on the grid of
+// --instances, around and behind the sun as the camera sees it.
+static void bench_occlusion(int count) {
+    cached_mesh sun, earth;
+    std::string error = sun.load("render/sun.obj", mesh_optimize_flags);
+    if (error.empty())
+        error = earth.load("render/earth.obj", mesh_optimize_flags);
+    if (!error.empty() || sun.shape_count() == 0 || earth.shape_count() == 0) {
+        std::cerr << error << std::endl;
+        return;
+    }
+    const mesh_view &occluder_shape = sun.shape(0);
+    const mesh_view &shape = earth.shape(0);
+    bounds local = compute_bounds(shape.positions, shape.num_positions / 3);
+    std::vector<glm::mat4> models = grid_models(count, 4.9f);
+    culler boxes;
+    for (size_t i = 0; i < models.size(); i++)
+        boxes.add(transform_bounds(local, glm::value_ptr(models[i])));
+
+    glm::mat4 vp = view_projection();
+    glm::mat4 sun_model = glm::scale(glm::mat4(1.0f), glm::vec3(0.85f));
+    thread_pool workers;
+    std::vector<unsigned int> visible;
+    const int rounds = 10;
+    double raster = 0, test = 0;
+    unsigned int occluded = 0;
+    for (int r = 0; r < rounds; r++) {
+        boxes.cull(extract_frustum(glm::value_ptr(vp)), &workers, visible);
+        occlusion.begin(glm::value_ptr(vp));
+        occlusion.add_occluder(occluder_shape.positions, occluder_shape.num_positions,
+                               occluder_shape.indices, occluder_shape.num_indices,
+                               glm::value_ptr(sun_model));
+        occlusion.finish();
+        raster += occlusion.stats().raster_seconds;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        occluded = 0;
+        for (size_t i = 0; i < visible.size(); i++) {
+            if (!occlusion.visible(boxes.get(visible[i])))
+                occluded++;
+        }
+        test += seconds_since(start);
+    }
+
+    std::cout << "occlusion: " << count << " boxes, " << visible.size() << " in the frustum, "
+              << occluded << " occluded (" << 100.0 * occluded / std::max<size_t>(visible.size(), 1)
+              << "%)" << std::endl;
+    std::cout << "  " << occlusion.width() << "x" << occlusion.height() << " depth, "
+              << occlusion.stats().triangles << " occluder triangles: "
+              << 1000.0 * raster / rounds << " ms to draw and build the pyramid, "
+              << 1000.0 * test / rounds << " ms to test ("
+              << 1e9 * test / rounds / std::max<size_t>(visible.size(), 1) << " ns per box)"
+              << std::endl;
 }
 
 int main(int argc, char *argv[]) {
+    bool use_async = false;
+    int bench_occlusion_boxes = 0;
+    bool headless = false;
+    int max_frames = 0; // 0 runs until the window is closed
+    double fixed_dt = 0; // simulated seconds per frame; 0 follows the clock
+    std::set<int> dump_frames;
+    std::string profile_path;
+    bool use_sim = false;
+    bool use_shader_cache = true;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--layout=separate")
+            mesh_layout = LAYOUT_SEPARATE;
+        else if (arg == "--layout=interleaved")
+            mesh_layout = LAYOUT_INTERLEAVED;
+        else if (arg == "--layout=compact")
+            mesh_layout = LAYOUT_COMPACT;
+        else if (arg == "--optimize")
+            mesh_optimize_flags = OPTIMIZE_VERTEX_CACHE | OPTIMIZE_VERTEX_FETCH;
+        else if (arg == "--optimize=overdraw")
+            mesh_optimize_flags = OPTIMIZE_VERTEX_CACHE | OPTIMIZE_OVERDRAW | OPTIMIZE_VERTEX_FETCH;
+        else if (arg.compare(0, 12, "--instances=") == 0)
+            bench_instances = atoi(arg.c_str() + 12);
+        else if (arg == "--no-instancing")
+            bench_instancing = false;
+        else if (arg == "--pool")
+            use_pool = true;
+        else if (arg == "--async")
+            use_async = true;
+        else if (arg == "--no-culling")
+            use_culling = false;
+        else if (arg.compare(0, 9, "--assets=") == 0)
+            bench_assets = atoi(arg.c_str() + 9);
+        else if (arg == "--occlusion")
+            use_occlusion = true;
+        else if (arg == "--lod")
+            use_lod = true;
+        else if (arg == "--parallel-record")
+            parallel_record = true;
+        else if (arg == "--sim-thread")
+            use_sim = true;
+        else if (arg.compare(0, 11, "--sim-load=") == 0)
+            sim_load = atof(arg.c_str() + 11) / 1000;
+        else if (arg == "--no-shader-cache")
+            use_shader_cache = false;
+        else if (arg.compare(0, 18, "--bench-occlusion=") == 0)
+            bench_occlusion_boxes = atoi(arg.c_str() + 18);
+        else if (arg.compare(0, 10, "--profile=") == 0)
+            profile_path = arg.substr(10);
+        else if (arg == "--headless")
+            headless = true;
+        else if (arg.compare(0, 9, "--frames=") == 0)
+            max_frames = atoi(arg.c_str() + 9);
+        else if (arg.compare(0, 5, "--dt=") == 0)
+            fixed_dt = atof(arg.c_str() + 5);
+        else if (arg.compare(0, 7, "--dump=") == 0) {
+            // A comma-separated list of frame numbers, from 0
+            for (const char *p = arg.c_str() + 7; *p; p++) {
+                dump_frames.insert(atoi(p));
+                p = strchr(p, ',');
+                if (!p)
+                    break;
+            }
+        }
+        else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Levels of detail are built with the mesh and cached with it
+    if (use_lod)
+        mesh_optimize_flags |= OPTIMIZE_LOD;
+
+    // Needs no window
+    if (bench_occlusion_boxes > 0) {
+        bench_occlusion(bench_occlusion_boxes);
+        return EXIT_SUCCESS;
+    }
+
     GLFWwindow *window;
     glfwSetErrorCallback(error_callback);
     if (!glfwInit())
@@ -260,6 +888,9 @@ int main(int argc, char *argv[]) {
     // For Mac OS X
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    // Headless runs only need the context; they draw into 'offscreen'
+    if (headless)
+        glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
     window = glfwCreateWindow(800, 600, "Simple Example", NULL, NULL);
     if (!window) {
         glfwTerminate();
@@ -272,18 +903,117 @@ int main(int argc, char *argv[]) {
     glewExperimental = GL_TRUE;
     glewInit();
 
-    // Enable vsync
-    glfwSwapInterval(1);
+    // Enable vsync, except when benchmarking so that frame times show
+    glfwSwapInterval(headless || bench_instances > 0 || bench_assets > 0 ? 0 : 1);
+
+    int fb_width, fb_height;
+    glfwGetFramebufferSize(window, &fb_width, &fb_height);
+    render_target offscreen;
+    if (headless) {
+        std::string error = offscreen.init(fb_width, fb_height);
+        if (!error.empty()) {
+            std::cerr << error << std::endl;
+            glfwTerminate();
+            return EXIT_FAILURE;
+        }
+        offscreen.bind();
+        std::cout << "headless: " << fb_width << "x" << fb_height << " offscreen" << std::endl;
+    }
 
     // Setup input callback
     glfwSetKeyCallback(window, key_callback);
 
-    // load shader program
-    program = setup_shader(readfile("shader/vs.txt").c_str(), readfile("shader/fs.txt").c_str());
-    program2 = setup_shader(readfile("shader/vs.txt").c_str(), readfile("shader/fs.txt").c_str());
+    if (use_lod)
+        lod_pixel_scale = 0.5f * fb_height / std::tan(glm::radians(kFovY) / 2);
+
+    // load shader program; program2 is the same shaders, so the cache hands
+    // back program
+    shaders.init(use_shader_cache ? "shader" : "");
+    std::string shader_error;
+    program = shaders.acquire("shader/vs.txt", "shader/fs.txt", "", shader_error);
+    program2 = shaders.acquire("shader/vs.txt", "shader/fs.txt", "", shader_error);
+    pool_program = shaders.acquire("shader/pool_vs.txt", "shader/fs.txt", "", shader_error);
+    if (!program || !program2 || !pool_program) {
+        std::cerr << shader_error << std::endl;
+        glfwTerminate();
+        return EXIT_FAILURE;
+    }
+    report_shaders();
+    bind_frame_block(program);
+    bind_frame_block(program2);
+    bind_frame_block(pool_program);
+
+    // Streamed data stays mapped if the driver allows it
+    bool persistent = GLEW_ARB_buffer_storage;
+    frame_stream.init(persistent);
+    std::cout << "stream buffers: " << (persistent ? "persistent" : "mapped per frame") << std::endl;
+    queue.init(GLEW_ARB_base_instance, persistent);
+    std::cout << "queue models: "
+              << (GLEW_ARB_base_instance ? "picked by base instance" : "picked per draw") << std::endl;
+
+    if (use_pool) {
+        // The base instance carries the draw id, so both are needed
+        bool indirect = GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance;
+        pool.init(indirect, persistent);
+        std::cout << "geometry pool: " << (indirect ? "multi-draw indirect" : "one draw per object")
+                  << std::endl;
+    }
+
+    if (!profile_path.empty())
+        prof.init(GLEW_ARB_timer_query);
+
+    if (use_culling || parallel_record)
+        workers = new thread_pool();
+    if (use_culling)
+        std::cout << "culling: " << workers->size() << " threads" << std::endl;
+    if (parallel_record)
+        std::cout << "command recording: " << workers->size() << " threads" << std::endl;
 
-    int sun = add_obj(program, "render/sun.obj", "render/sun.bmp");
-    int earth = add_obj(program, "render/earth.obj", "render/earth.bmp");
+    double load_start = glfwGetTime();
+    if (use_async)
+        loader = new asset_loader();
+    int (*add)(unsigned int, const char *, const char *) = loader ? add_obj_async : add_obj;
+
+    int sun = add(program, "render/sun.obj", "render/sun.bmp");
+    if (use_occlusion)
+        add_occluder(sun, "render/sun.obj");
+    int earth = add(program, "render/earth.obj", "render/earth.bmp");
+
+    if (bench_assets > 0) {
+        std::vector<glm::mat4> models = grid_models(bench_assets, 4.9f);
+        for (int i = 0; i < bench_assets; i++) {
+            int obj = i % 2 ? add(program, "render/earth.obj", "render/earth.bmp") :
+                              add(program, "render/sun.obj", "render/sun.bmp");
+            set_model(obj, models[i]);
+        }
+    }
+
+    if (bench_instances > 0) {
+        if (loader)
+            loader->wait(); // the copies are made from the loaded earth
+        std::vector<glm::mat4> models = grid_models(bench_instances, 4.9f);
+        if (objects[earth].pool_draw != geometry_pool::kInvalid) {
+            // Separate pool draws of the same mesh, batched by the pool
+            for (size_t i = 0; i < models.size(); i++) {
+                unsigned int draw = pool.add_draw(objects[earth].pool_mesh, pool_program,
+                                                  objects[earth].texture, objects[earth].layer);
+                pool.set_model(draw, glm::value_ptr(models[i]));
+                add_cull_entry(true, draw, objects[earth].local_bounds, models[i],
+                               objects[earth].lods);
+            }
+        } else if (bench_instancing) {
+            int copies = add_instanced_obj(program, "render/earth.obj", "render/earth.bmp");
+            set_instances(copies, models);
+        } else {
+            // One draw per copy, sharing the earth's buffers and texture
+            draw_item item = queue.item(objects[earth].queue_handle);
+            for (size_t i = 0; i < models.size(); i++) {
+                memcpy(item.model, glm::value_ptr(models[i]), sizeof(item.model));
+                add_cull_entry(false, queue.add(item), objects[earth].local_bounds, models[i],
+                               objects[earth].lods);
+            }
+        }
+    }
 
     glEnable(GL_DEPTH_TEST);
     glCullFace(GL_BACK);
@@ -291,31 +1021,165 @@ int main(int argc, char *argv[]) {
     //glEnable(GL_BLEND);
     //glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    setUniformMat4(program, "vp", glm::perspective(glm::radians(45.0f), 640.0f / 480, 1.0f, 100.f) *
-                                  glm::lookAt(glm::vec3(20.0f), glm::vec3(), glm::vec3(0, 1, 0)) * glm::mat4(1.0f));
-    setUniformMat4(program2, "vp", glm::mat4(1.0));
-    glm::mat4 tl = glm::translate(glm::mat4(), glm::vec3(15.0f, 0.0f, 0.0));
-    glm::mat4 rot;
-    glm::mat4 rev;
+    frame_uniforms frame;
+    frame.vp = view_projection();
+    // The earth spins and circles the sun: 'rev' turns the orbit, the
+    // earth sits 15 out on it and 'rot' turns the earth itself.
+    unsigned int system = scene.add();
+    unsigned int sun_node = scene.add(system);
+    unsigned int rev = scene.add(system);
+    unsigned int rot = scene.add(rev);
+    scene.set_scale(sun_node, 0.85f, 0.85f, 0.85f);
+    scene.set_translation(rot, 15.0f, 0.0f, 0.0f);
+    scene_objects.push_back(std::make_pair(sun, sun_node));
+    scene_objects.push_back(std::make_pair(earth, rot));
+    // --dt frames must not depend on timing, so they keep the scene here
+    if (use_sim && fixed_dt == 0) {
+        sim = new simulation(kSimStep);
+        sim->start(scene_objects.size(), std::bind(simulate, rot, rev, std::placeholders::_1,
+                                                   std::placeholders::_2));
+        std::cout << "simulation: " << 1 / kSimStep << " ticks/s on its own thread" << std::endl;
+    }
+
+    // A fixed step should give the same frames every run, which loading
+    // while drawing would not
+    if (fixed_dt > 0 && loader)
+        loader->wait();
 
     float last, start;
     last = start = glfwGetTime();
+    int frame_index = 0;
     int fps = 0;
-    objects[sun].model = glm::scale(glm::mat4(1.0f), glm::vec3(0.85f));
-    while (!glfwWindowShouldClose(window)) {//program will keep draw here until you close the window
-        float delta = glfwGetTime() - start;
+    double submit = 0; // CPU time spent in upload_frame() and render() since 'last'
+    double cull_time = 0; // and in cull_objects()
+    double record_time = 0, replay_time = 0; // of the queue's draws, with --parallel-record
+    unsigned long long last_ticks = 0; // of the simulation, at 'last'
+    bool first_frame = true, loading = true;
+    //program will keep draw here until you close the window, or for --frames
+    while (!glfwWindowShouldClose(window) && (max_frames == 0 || frame_index < max_frames)) {
+        prof.begin_frame();
+        float delta = fixed_dt > 0 ? frame_index * fixed_dt : glfwGetTime() - start;
+        if (loader) {
+            profile_scope scope(prof, "uploads");
+            loader->drain(kUploadBudget);
+        }
+        prof.begin("scene");
+        if (sim) {
+            apply_simulation();
+        } else {
+            scene.set_rotation(rot, delta * 2.0f, 0, 1, 0);
+            scene.set_rotation(rev, delta * 0.5f, 0, 1, 0);
+            apply_scene();
+        }
+        prof.end();
+        if (use_culling) {
+            profile_scope scope(prof, "cull");
+            std::chrono::steady_clock::time_point cull_start = std::chrono::steady_clock::now();
+            cull_objects(frame.vp);
+            cull_time += seconds_since(cull_start);
+        }
+        if (use_lod) {
+            profile_scope scope(prof, "lod");
+            select_lods(frame.vp);
+        }
+        {
+            profile_scope scope(prof, "depth");
+            set_depths(frame.vp);
+        }
+        prof.begin("render");
+        double render_start = glfwGetTime();
+        upload_frame(frame);
         render();
-        glfwSwapBuffers(window);
+        submit += glfwGetTime() - render_start;
+        record_time += queue.stats().record_seconds;
+        replay_time += queue.stats().replay_seconds;
+        prof.end();
+        if (dump_frames.count(frame_index)) {
+            profile_scope scope(prof, "dump");
+            char filename[32];
+            snprintf(filename, sizeof(filename), "frame_%d.bmp", frame_index);
+            std::string error = save_framebuffer(filename, fb_width, fb_height);
+            std::cout << (error.empty() ? std::string("saved ") + filename : error) << std::endl;
+        }
+        prof.begin("swap");
+        if (!headless)
+            glfwSwapBuffers(window);
         glfwPollEvents();
+        prof.end();
+        prof.end_frame();
+        if (first_frame) {
+            std::cout << "first frame after " << 1000.0 * (glfwGetTime() - load_start) << " ms"
+                      << std::endl;
+            first_frame = false;
+        }
+        if (loading && (!loader || loader->pending() == 0)) {
+            report_loading(glfwGetTime() - load_start);
+            loading = false;
+        }
         fps++;
         if (glfwGetTime() - last > 1.0) {
-            std::cout << (double) fps / (glfwGetTime() - last) << std::endl;
+            const render_stats &stats = queue.stats();
+            const pool_stats &pooled = pool.stats();
+            std::cout << (double) fps / (glfwGetTime() - last) << " fps ("
+                      << 1000.0 * (glfwGetTime() - last) / fps << " ms/frame, "
+                      << 1000.0 * submit / fps << " ms submit), "
+                      << stats.draw_calls + pooled.draw_calls << " draws, "
+                      << stats.instances + pooled.draws << " objects, "
+                      << stats.triangles + pooled.triangles << " triangles, "
+                      << stats.state_changes << " state changes, "
+                      << stats.state_skipped << " skipped";
+            if (use_culling)
+                std::cout << ", " << stats.culled + pooled.culled << " culled ("
+                          << (use_occlusion ? occlusion.stats().occluded : 0) << " occluded) in "
+                          << 1000.0 * cull_time / fps << " ms";
+            if (parallel_record) {
+                // Per thread for the last frame, then averages
+                std::cout << ", recorded in";
+                const std::vector<command_buffer> &buffers = queue.buffers();
+                for (size_t b = 0; b < buffers.size(); b++)
+                    std::cout << (b ? "/" : " ") << 1000.0 * buffers[b].record_seconds;
+                std::cout << " ms (slowest " << 1000.0 * record_time / fps << " ms), replayed in "
+                          << 1000.0 * replay_time / fps << " ms";
+            }
+            if (sim) {
+                sim_stats ticks = sim->stats();
+                std::cout << ", " << (ticks.ticks - last_ticks) / (glfwGetTime() - last)
+                          << " ticks/s of " << 1000.0 * ticks.tick_seconds << " ms";
+                if (ticks.resyncs)
+                    std::cout << " (" << ticks.resyncs << " resyncs)";
+                last_ticks = ticks.ticks;
+            }
+            std::cout << std::endl;
             fps = 0;
+            submit = 0;
+            cull_time = 0;
+            record_time = replay_time = 0;
             last = glfwGetTime();
         }
+        frame_index++;
+    }
+    if (max_frames > 0) {
+        glFinish();
+        double seconds = glfwGetTime() - start;
+        std::cout << frame_index << " frames in " << 1000.0 * seconds << " ms, "
+                  << 1000.0 * seconds / frame_index << " ms/frame" << std::endl;
+    }
+    if (prof.enabled()) {
+        prof.print_summary();
+        std::string error = prof.write(profile_path);
+        std::cout << (error.empty() ? "profile saved to " + profile_path : error) << std::endl;
+        prof.release();
     }
 
+    delete sim; // before the scene it updates goes
+    delete loader;
+    delete workers;
     releaseObjects();
+    shaders.release(program);
+    shaders.release(program2);
+    shaders.release(pool_program);
+    frame_stream.release();
+    offscreen.release();
     glfwDestroyWindow(window);
     glfwTerminate();
     return EXIT_SUCCESS;
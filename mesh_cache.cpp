@@ -0,0 +1,434 @@
+#include "mesh_cache.h"
+#include "mesh_optimizer.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// .objc layout (native byte order):
+//
+//   objc_header
+//   objc_shape[shape_count]
+//   position, texcoord, normal, index and LOD index blocks, each 16-byte
+//   aligned
+//
+// Bump kObjcVersion whenever the layout or the meaning of a field changes;
+// caches with another version are rebuilt.
+static const uint32_t kObjcMagic = 0x434a424f; // "OBJC"
+static const uint32_t kObjcVersion = 3;
+static const size_t kObjcAlign = 16;
+// Timestamps are only trusted this far apart: some file systems keep
+// mtimes in whole seconds, FAT in two.
+static const int64_t kMtimeSlack = 2000000000LL; // ns
+
+enum { BLOCK_POSITIONS, BLOCK_TEXCOORDS, BLOCK_NORMALS, BLOCK_INDICES, BLOCK_LODS, BLOCK_COUNT };
+
+struct objc_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_size;
+    int64_t source_mtime; // ns since the epoch, where the file system has them
+    uint64_t source_hash;
+    uint32_t flags;
+    uint32_t shape_count;
+    int64_t written; // when the source was last hashed, ns since the epoch
+};
+
+struct objc_shape {
+    uint64_t offset[BLOCK_COUNT]; // from the start of the file
+    uint64_t count[BLOCK_COUNT];  // in elements
+    // Levels 1 and up, within the LOD block
+    uint32_t lod_count; // levels, level 0 included
+    uint32_t lod_first[kMaxLods];
+    uint32_t lod_size[kMaxLods];
+    float lod_error[kMaxLods];
+};
+
+// 'mtime' in nanoseconds since the epoch.
+static bool stat_file(const char *filename, unsigned long long &size, long long &mtime) {
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return false;
+    size = st.st_size;
+#if defined(__APPLE__)
+    mtime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    mtime = st.st_mtime * 1000000000LL;
+#else
+    mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Maps a whole file read-only. Returns nullptr on failure; an empty file maps
+// to a non-null pointer with size 0.
+static const char *map_file(const char *filename, size_t &size) {
+    static const char empty = 0;
+#ifdef _WIN32
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return nullptr;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (len <= 0) {
+        fclose(fp);
+        size = 0;
+        return &empty;
+    }
+    char *data = new char[len];
+    if (fread(data, 1, len, fp) != (size_t) len) {
+        delete[] data;
+        fclose(fp);
+        return nullptr;
+    }
+    fclose(fp);
+    size = len;
+    return data;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return &empty;
+    }
+    void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return p == MAP_FAILED ? nullptr : static_cast<const char *>(p);
+#endif
+}
+
+static void unmap_file(const char *data, size_t size) {
+    if (size == 0)
+        return;
+#ifdef _WIN32
+    delete[] data;
+#else
+    munmap(const_cast<char *>(data), size);
+#endif
+}
+
+// 64-bit FNV-1a over 8-byte words, then the tail bytes.
+static uint64_t hash_bytes(const char *data, size_t size) {
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t h = 0xcbf29ce484222325ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * prime;
+    }
+    for (; i < size; i++)
+        h = (h ^ (unsigned char) data[i]) * prime;
+    return h;
+}
+
+static size_t align_up(size_t n) {
+    return (n + kObjcAlign - 1) & ~(kObjcAlign - 1);
+}
+
+// A temporary name no other writer uses, so that threads or processes
+// caching the same file at once never write into each other's file.
+static std::string temp_path(const std::string &path) {
+    static std::atomic<unsigned int> counter(0);
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp%d.%u", pid, counter++);
+    return path + suffix;
+}
+
+static bool write_cache(const std::string &path, const objc_header &header,
+                        const std::vector<tinyobj::shape_t> &shapes,
+                        const std::vector<lod_chain> &chains) {
+    std::vector<objc_shape> table(shapes.size());
+    if (!table.empty())
+        memset(&table[0], 0, sizeof(objc_shape) * table.size());
+    size_t offset = align_up(sizeof(objc_header) + sizeof(objc_shape) * shapes.size());
+    for (size_t i = 0; i < shapes.size(); i++) {
+        const tinyobj::mesh_t &mesh = shapes[i].mesh;
+        size_t lod_indices = i < chains.size() ? chains[i].indices.size() : 0;
+        const size_t counts[BLOCK_COUNT] = {mesh.positions.size(), mesh.texcoords.size(),
+                                            mesh.normals.size(), mesh.indices.size(), lod_indices};
+        table[i].lod_count = 1;
+        for (size_t l = 0; lod_indices && l < chains[i].first.size(); l++) {
+            table[i].lod_first[l + 1] = chains[i].first[l];
+            table[i].lod_size[l + 1] = chains[i].count[l];
+            table[i].lod_error[l + 1] = chains[i].error[l];
+            table[i].lod_count++;
+        }
+        for (int b = 0; b < BLOCK_COUNT; b++) {
+            table[i].offset[b] = offset;
+            table[i].count[b] = counts[b];
+            offset = align_up(offset + 4 * counts[b]);
+        }
+    }
+
+    // Write to a temporary file and rename it, so that a crash never leaves a
+    // truncated cache behind.
+    std::string tmp = temp_path(path);
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+        return false;
+
+    static const char padding[kObjcAlign] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if (!table.empty())
+        ok = ok && fwrite(&table[0], sizeof(objc_shape), table.size(), fp) == table.size();
+    size_t written = sizeof(header) + sizeof(objc_shape) * table.size();
+    for (size_t i = 0; ok && i < shapes.size(); i++) {
+        const tinyobj::mesh_t &mesh = shapes[i].mesh;
+        const void *blocks[BLOCK_COUNT] = {mesh.positions.data(), mesh.texcoords.data(),
+                                           mesh.normals.data(), mesh.indices.data(),
+                                           i < chains.size() ? chains[i].indices.data() : nullptr};
+        for (int b = 0; ok && b < BLOCK_COUNT; b++) {
+            ok = fwrite(padding, 1, table[i].offset[b] - written, fp) == table[i].offset[b] - written;
+            written = table[i].offset[b];
+            if (table[i].count[b] > 0)
+                ok = ok && fwrite(blocks[b], 4, table[i].count[b], fp) == table[i].count[b];
+            written += 4 * table[i].count[b];
+        }
+    }
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Replaces the header of the cache mapped at 'data', through a temporary
+// file like write_cache(), so that no reader ever maps a half-written one.
+static bool rewrite_header(const std::string &path, const objc_header &header, const char *data,
+                           size_t size) {
+    std::string tmp = temp_path(path);
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(data + sizeof(header), 1, size - sizeof(header), fp) == size - sizeof(header);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+cached_mesh::cached_mesh() : mapped(nullptr), mapped_size(0) { }
+
+cached_mesh::~cached_mesh() {
+    unmap();
+}
+
+void cached_mesh::unmap() {
+    if (mapped)
+        unmap_file(mapped, mapped_size);
+    mapped = nullptr;
+    mapped_size = 0;
+}
+
+bool cached_mesh::map_cache(const std::string &path, unsigned long long size, long long mtime,
+                            unsigned int flags, const char *filename) {
+    size_t cache_size;
+    const char *data = map_file(path.c_str(), cache_size);
+    if (!data)
+        return false;
+
+    objc_header header;
+    if (cache_size < sizeof(header)) {
+        unmap_file(data, cache_size);
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != kObjcMagic || header.version != kObjcVersion ||
+        header.source_size != size || header.flags != flags ||
+        (cache_size - sizeof(header)) / sizeof(objc_shape) < header.shape_count) {
+        unmap_file(data, cache_size);
+        return false;
+    }
+
+    // An edit in the same mtime tick as the last hash keeps the mtime, so
+    // near that time only the contents tell.
+    if (header.source_mtime != mtime || mtime + kMtimeSlack >= header.written) {
+        size_t src_size;
+        const char *src = map_file(filename, src_size);
+        bool same = src && hash_bytes(src, src_size) == header.source_hash;
+        if (src)
+            unmap_file(src, src_size);
+        if (!same) {
+            unmap_file(data, cache_size);
+            return false;
+        }
+        // Record the new mtime and hash time so the next load can skip
+        // the hash. Still within the slack, it hashes again next time.
+        header.source_mtime = mtime;
+        header.written = now_ns();
+        rewrite_header(path, header, data, cache_size);
+    }
+
+    const objc_shape *table = reinterpret_cast<const objc_shape *>(data + sizeof(header));
+    std::vector<mesh_view> shape_views(header.shape_count);
+    for (size_t i = 0; i < header.shape_count; i++) {
+        const void *blocks[BLOCK_COUNT];
+        for (int b = 0; b < BLOCK_COUNT; b++) {
+            uint64_t offset = table[i].offset[b];
+            uint64_t count = table[i].count[b];
+            if (offset % kObjcAlign != 0 || offset > cache_size ||
+                count > (cache_size - offset) / 4) {
+                unmap_file(data, cache_size);
+                return false;
+            }
+            blocks[b] = count > 0 ? data + offset : nullptr;
+        }
+        mesh_view &view = shape_views[i];
+        view.positions = static_cast<const float *>(blocks[BLOCK_POSITIONS]);
+        view.num_positions = table[i].count[BLOCK_POSITIONS];
+        view.texcoords = static_cast<const float *>(blocks[BLOCK_TEXCOORDS]);
+        view.num_texcoords = table[i].count[BLOCK_TEXCOORDS];
+        view.normals = static_cast<const float *>(blocks[BLOCK_NORMALS]);
+        view.num_normals = table[i].count[BLOCK_NORMALS];
+        view.indices = static_cast<const unsigned int *>(blocks[BLOCK_INDICES]);
+        view.num_indices = table[i].count[BLOCK_INDICES];
+
+        const objc_shape &entry = table[i];
+        if (entry.lod_count < 1 || entry.lod_count > kMaxLods) {
+            unmap_file(data, cache_size);
+            return false;
+        }
+        const unsigned int *lod_block = static_cast<const unsigned int *>(blocks[BLOCK_LODS]);
+        view.num_lods = entry.lod_count;
+        view.lods[0].indices = view.indices;
+        view.lods[0].num_indices = view.num_indices;
+        view.lods[0].error = 0;
+        for (unsigned int l = 1; l < entry.lod_count; l++) {
+            if ((uint64_t) entry.lod_first[l] + entry.lod_size[l] > table[i].count[BLOCK_LODS]) {
+                unmap_file(data, cache_size);
+                return false;
+            }
+            view.lods[l].indices = lod_block + entry.lod_first[l];
+            view.lods[l].num_indices = entry.lod_size[l];
+            view.lods[l].error = entry.lod_error[l];
+        }
+    }
+
+    mapped = data;
+    mapped_size = cache_size;
+    views.swap(shape_views);
+    return true;
+}
+
+std::string cached_mesh::load(const char *filename, unsigned int optimize_flags) {
+    unmap();
+    views.clear();
+    shapes.clear();
+    chains.clear();
+
+    unsigned long long size;
+    long long mtime;
+    if (!stat_file(filename, size, mtime))
+        return std::string("Cannot open file [") + filename + "]";
+
+    std::string cache_path = std::string(filename) + "c";
+    if (map_cache(cache_path, size, mtime, optimize_flags, filename))
+        return std::string();
+
+    size_t src_size;
+    const char *src = map_file(filename, src_size);
+    if (!src)
+        return std::string("Cannot open file [") + filename + "]";
+
+    std::vector<tinyobj::material_t> materials;
+    tinyobj::MaterialFileReader matFileReader("");
+    std::string err = tinyobj::LoadObjParallel(shapes, materials, src, src_size, matFileReader);
+
+    objc_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kObjcMagic;
+    header.version = kObjcVersion;
+    header.source_size = size;
+    header.source_mtime = mtime;
+    header.written = now_ns();
+    header.source_hash = hash_bytes(src, src_size);
+    header.flags = optimize_flags;
+    header.shape_count = shapes.size();
+    unmap_file(src, src_size);
+
+    if (!err.empty()) {
+        // tinyobj ends its messages with a newline; callers add their own
+        while (err.size() > 1 && err[err.size() - 1] == '\n')
+            err.erase(err.size() - 1);
+        return err;
+    }
+
+    if (optimize_flags & ~OPTIMIZE_LOD) {
+        for (size_t i = 0; i < shapes.size(); i++) {
+            std::string name = std::string(filename) + ":" + shapes[i].name;
+            optimize_mesh(shapes[i].mesh, name.c_str(), optimize_flags);
+        }
+    }
+    if (optimize_flags & OPTIMIZE_LOD) {
+        chains.resize(shapes.size());
+        for (size_t i = 0; i < shapes.size(); i++) {
+            const tinyobj::mesh_t &mesh = shapes[i].mesh;
+            std::string name = std::string(filename) + ":" + shapes[i].name;
+            build_lod_chain(mesh.positions.data(), mesh.positions.size() / 3, mesh.indices.data(),
+                            mesh.indices.size(), kMaxLods, name.c_str(), chains[i]);
+        }
+    }
+
+    // A read-only asset directory just means no cache.
+    write_cache(cache_path, header, shapes, chains);
+
+    views.resize(shapes.size());
+    for (size_t i = 0; i < shapes.size(); i++) {
+        const tinyobj::mesh_t &mesh = shapes[i].mesh;
+        mesh_view &view = views[i];
+        view.positions = mesh.positions.empty() ? nullptr : &mesh.positions[0];
+        view.num_positions = mesh.positions.size();
+        view.texcoords = mesh.texcoords.empty() ? nullptr : &mesh.texcoords[0];
+        view.num_texcoords = mesh.texcoords.size();
+        view.normals = mesh.normals.empty() ? nullptr : &mesh.normals[0];
+        view.num_normals = mesh.normals.size();
+        view.indices = mesh.indices.empty() ? nullptr : &mesh.indices[0];
+        view.num_indices = mesh.indices.size();
+        view.num_lods = 1;
+        view.lods[0].indices = view.indices;
+        view.lods[0].num_indices = view.num_indices;
+        view.lods[0].error = 0;
+        for (size_t l = 0; i < chains.size() && l < chains[i].first.size(); l++) {
+            mesh_lod &lod = view.lods[view.num_lods++];
+            lod.indices = &chains[i].indices[chains[i].first[l]];
+            lod.num_indices = chains[i].count[l];
+            lod.error = chains[i].error[l];
+        }
+    }
+    return std::string();
+}
@@ -0,0 +1,79 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <string>
+#include <vector>
+#include <tiny_obj_loader.h>
+#include "mesh_simplifier.h"
+
+// Most levels of detail a shape has, the full mesh included.
+const unsigned int kMaxLods = 5;
+
+// One level of detail: a triangle list over the shape's vertices.
+struct mesh_lod {
+    const unsigned int *indices;
+    size_t num_indices;
+    float error; // how far the surface moved from level 0, in the mesh's units
+};
+
+// Read-only arrays of one shape, laid out like tinyobj::mesh_t.
+// Counts are in elements (floats or indices), not bytes.
+struct mesh_view {
+    const float *positions;
+    size_t num_positions;
+    const float *texcoords;
+    size_t num_texcoords;
+    const float *normals;
+    size_t num_normals;
+    const unsigned int *indices;
+    size_t num_indices;
+    unsigned int num_lods; // 1 unless loaded with OPTIMIZE_LOD
+    mesh_lod lods[kMaxLods]; // lods[0] is 'indices'
+};
+
+// An .obj mesh backed by a binary ".objc" cache stored next to it.
+//
+// The first load parses the .obj text and writes <file>.objc; later loads
+// mmap the cache and hand out pointers straight into it, so the cost no
+// longer depends on the size of the text. The cache is used while the
+// source's size and mtime match the ones recorded in it. If only the mtime
+// changed, or the source was hashed within a couple of seconds of its
+// mtime (too close for coarse timestamps to tell edits apart), the
+// source's content hash decides.
+//
+// 'optimize_flags' (OPTIMIZE_* from mesh_optimizer.h) are applied before the
+// cache is written and recorded in it; a cache built with other flags is
+// rebuilt. With OPTIMIZE_LOD the cache also holds each shape's levels of
+// detail, which index the same vertices.
+class cached_mesh {
+public:
+    cached_mesh();
+    ~cached_mesh();
+
+    // Returns an empty string on success, like tinyobj::LoadObj.
+    std::string load(const char *filename, unsigned int optimize_flags = 0);
+
+    size_t shape_count() const { return views.size(); }
+    const mesh_view &shape(size_t i) const { return views[i]; }
+
+    // True if the data came from the .objc file.
+    bool from_cache() const { return mapped != nullptr; }
+
+private:
+    cached_mesh(const cached_mesh &);
+    cached_mesh &operator=(const cached_mesh &);
+
+    bool map_cache(const std::string &path, unsigned long long size, long long mtime,
+                   unsigned int flags, const char *filename);
+    void unmap();
+
+    std::vector<mesh_view> views;
+
+    // Backing storage: either the mapped cache or the parsed shapes.
+    const char *mapped;
+    size_t mapped_size;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<lod_chain> chains; // by shape, with OPTIMIZE_LOD
+};
+
+#endif // MESH_CACHE_H
@@ -0,0 +1,331 @@
+#include "mesh_optimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+vertex_cache_stats analyze_vertex_cache(const unsigned int *indices, size_t index_count,
+                                        size_t vertex_count, unsigned int cache_size) {
+    // Each vertex remembers the miss count at which it entered the cache; it
+    // is still cached while fewer than 'cache_size' misses happened since.
+    std::vector<size_t> entered(vertex_count, 0);
+    size_t misses = 0;
+    for (size_t i = 0; i < index_count; i++) {
+        size_t &t = entered[indices[i]];
+        if (t == 0 || misses + 1 - t > cache_size) {
+            misses++;
+            t = misses;
+        }
+    }
+
+    vertex_cache_stats stats;
+    stats.acmr = index_count ? (float) misses / (index_count / 3) : 0.0f;
+    stats.atvr = vertex_count ? (float) misses / vertex_count : 0.0f;
+    return stats;
+}
+
+// Applies a new triangle order: triangle i of the result is old triangle order[i].
+static void reorder_triangles(tinyobj::mesh_t &mesh, const std::vector<unsigned int> &order) {
+    std::vector<unsigned int> indices(mesh.indices.size());
+    std::vector<int> material_ids(mesh.material_ids.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        unsigned int t = order[i];
+        indices[3 * i + 0] = mesh.indices[3 * t + 0];
+        indices[3 * i + 1] = mesh.indices[3 * t + 1];
+        indices[3 * i + 2] = mesh.indices[3 * t + 2];
+        if (t < mesh.material_ids.size())
+            material_ids[i] = mesh.material_ids[t];
+    }
+    mesh.indices.swap(indices);
+    mesh.material_ids.swap(material_ids);
+}
+
+namespace {
+
+const int kForsythCacheSize = 32;
+const int kForsythMaxValence = 32;
+
+// Scores from "Linear-Speed Vertex Cache Optimisation", Tom Forsyth, 2006.
+struct forsyth_scores {
+    float cache[kForsythCacheSize];
+    float valence[kForsythMaxValence];
+
+    forsyth_scores() {
+        for (int i = 0; i < kForsythCacheSize; i++) {
+            if (i < 3) {
+                // Vertices of the last triangle get a fixed score, so that
+                // strips are not favoured over fans.
+                cache[i] = 0.75f;
+            } else {
+                float s = 1.0f - (float) (i - 3) / (kForsythCacheSize - 3);
+                cache[i] = powf(s, 1.5f);
+            }
+        }
+        valence[0] = 0.0f;
+        for (int i = 1; i < kForsythMaxValence; i++)
+            valence[i] = 2.0f / sqrtf((float) i);
+    }
+
+    float vertex(int cache_position, unsigned int remaining) const {
+        if (remaining == 0)
+            return -1.0f;
+        float score = cache_position >= 0 ? cache[cache_position] : 0.0f;
+        return score + valence[remaining < kForsythMaxValence ? remaining : kForsythMaxValence - 1];
+    }
+};
+
+}
+
+void optimize_vertex_cache(tinyobj::mesh_t &mesh) {
+    static const forsyth_scores scores;
+
+    const std::vector<unsigned int> &indices = mesh.indices;
+    size_t triangle_count = indices.size() / 3;
+    size_t vertex_count = mesh.positions.size() / 3;
+    if (triangle_count == 0)
+        return;
+
+    // Triangles using each vertex. The first remaining[v] entries of a
+    // vertex's range are the triangles not emitted yet.
+    std::vector<unsigned int> remaining(vertex_count, 0);
+    for (size_t i = 0; i < indices.size(); i++)
+        remaining[indices[i]]++;
+    std::vector<unsigned int> offsets(vertex_count + 1, 0);
+    for (size_t v = 0; v < vertex_count; v++)
+        offsets[v + 1] = offsets[v] + remaining[v];
+    std::vector<unsigned int> adjacency(indices.size());
+    std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < indices.size(); i++)
+        adjacency[fill[indices[i]]++] = i / 3;
+
+    std::vector<int> cache_position(vertex_count, -1);
+    std::vector<float> vertex_score(vertex_count);
+    for (size_t v = 0; v < vertex_count; v++)
+        vertex_score[v] = scores.vertex(-1, remaining[v]);
+
+    std::vector<float> triangle_score(triangle_count);
+    std::vector<bool> emitted(triangle_count, false);
+    for (size_t t = 0; t < triangle_count; t++)
+        triangle_score[t] = vertex_score[indices[3 * t]] + vertex_score[indices[3 * t + 1]] +
+                            vertex_score[indices[3 * t + 2]];
+
+    std::vector<unsigned int> order;
+    order.reserve(triangle_count);
+
+    unsigned int cache[kForsythCacheSize + 3];
+    int cache_count = 0;
+    size_t cursor = 0; // triangles before it are all emitted
+    long best = 0;
+    for (size_t t = 1; t < triangle_count; t++) {
+        if (triangle_score[t] > triangle_score[best])
+            best = t;
+    }
+
+    while (order.size() < triangle_count) {
+        if (best < 0) {
+            // Dead end: nothing in the cache has triangles left.
+            while (emitted[cursor])
+                cursor++;
+            best = cursor;
+        }
+
+        const unsigned int *tri = &indices[3 * best];
+        order.push_back(best);
+        emitted[best] = true;
+
+        // Detach the triangle from its vertices.
+        for (int k = 0; k < 3; k++) {
+            unsigned int v = tri[k];
+            unsigned int *adj = &adjacency[offsets[v]];
+            for (unsigned int i = 0; i < remaining[v]; i++) {
+                if (adj[i] == (unsigned int) best) {
+                    std::swap(adj[i], adj[remaining[v] - 1]);
+                    break;
+                }
+            }
+            remaining[v]--;
+        }
+
+        // Move its vertices to the front of the LRU cache.
+        unsigned int new_cache[kForsythCacheSize + 3];
+        int new_count = 0;
+        for (int k = 0; k < 3; k++)
+            new_cache[new_count++] = tri[k];
+        for (int i = 0; i < cache_count; i++) {
+            unsigned int v = cache[i];
+            if (v != tri[0] && v != tri[1] && v != tri[2])
+                new_cache[new_count++] = v;
+        }
+
+        // Rescore everything that was or is in the cache.
+        for (int i = 0; i < new_count; i++) {
+            unsigned int v = new_cache[i];
+            cache_position[v] = i < kForsythCacheSize ? i : -1;
+            vertex_score[v] = scores.vertex(cache_position[v], remaining[v]);
+        }
+
+        best = -1;
+        float best_score = -1.0f;
+        for (int i = 0; i < new_count; i++) {
+            unsigned int v = new_cache[i];
+            const unsigned int *adj = &adjacency[offsets[v]];
+            for (unsigned int j = 0; j < remaining[v]; j++) {
+                unsigned int t = adj[j];
+                const unsigned int *u = &indices[3 * t];
+                float score = vertex_score[u[0]] + vertex_score[u[1]] + vertex_score[u[2]];
+                triangle_score[t] = score;
+                if (score > best_score) {
+                    best_score = score;
+                    best = t;
+                }
+            }
+        }
+
+        cache_count = std::min(new_count, kForsythCacheSize);
+        std::copy(new_cache, new_cache + cache_count, cache);
+    }
+
+    reorder_triangles(mesh, order);
+}
+
+void optimize_overdraw(tinyobj::mesh_t &mesh) {
+    const std::vector<unsigned int> &indices = mesh.indices;
+    const std::vector<float> &p = mesh.positions;
+    size_t triangle_count = indices.size() / 3;
+    size_t vertex_count = p.size() / 3;
+    if (triangle_count == 0)
+        return;
+
+    // Start a new cluster wherever the cache restarts, i.e. all three
+    // vertices of a triangle miss; keeping clusters whole keeps the cache
+    // order found by optimize_vertex_cache().
+    const unsigned int cache_size = 16;
+    std::vector<size_t> entered(vertex_count, 0);
+    size_t misses = 0;
+    std::vector<size_t> cluster_start;
+    for (size_t t = 0; t < triangle_count; t++) {
+        int tri_misses = 0;
+        for (int k = 0; k < 3; k++) {
+            size_t &e = entered[indices[3 * t + k]];
+            if (e == 0 || misses + 1 - e > cache_size) {
+                misses++;
+                e = misses;
+                tri_misses++;
+            }
+        }
+        if (t == 0 || tri_misses == 3)
+            cluster_start.push_back(t);
+    }
+    cluster_start.push_back(triangle_count);
+
+    float mesh_centroid[3] = {0.0f, 0.0f, 0.0f};
+    for (size_t v = 0; v < vertex_count; v++) {
+        for (int c = 0; c < 3; c++)
+            mesh_centroid[c] += p[3 * v + c];
+    }
+    for (int c = 0; c < 3; c++)
+        mesh_centroid[c] /= vertex_count;
+
+    // Clusters facing away from the mesh centre are likely in front of the
+    // ones facing inward, so they go first.
+    size_t cluster_count = cluster_start.size() - 1;
+    std::vector<std::pair<float, unsigned int> > sort_keys(cluster_count);
+    for (size_t c = 0; c < cluster_count; c++) {
+        float centroid[3] = {0.0f, 0.0f, 0.0f};
+        float normal[3] = {0.0f, 0.0f, 0.0f};
+        float area = 0.0f;
+        for (size_t t = cluster_start[c]; t < cluster_start[c + 1]; t++) {
+            const float *a = &p[3 * indices[3 * t + 0]];
+            const float *b = &p[3 * indices[3 * t + 1]];
+            const float *d = &p[3 * indices[3 * t + 2]];
+            float e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+            float e2[3] = {d[0] - a[0], d[1] - a[1], d[2] - a[2]};
+            float n[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2],
+                          e1[0] * e2[1] - e1[1] * e2[0]};
+            float w = 0.5f * sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            for (int k = 0; k < 3; k++) {
+                centroid[k] += w * (a[k] + b[k] + d[k]) / 3.0f;
+                normal[k] += n[k];
+            }
+            area += w;
+        }
+        float len = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        float dp = 0.0f;
+        if (area > 0.0f && len > 0.0f) {
+            for (int k = 0; k < 3; k++)
+                dp += (centroid[k] / area - mesh_centroid[k]) * normal[k] / len;
+        }
+        sort_keys[c] = std::make_pair(-dp, (unsigned int) c);
+    }
+    std::stable_sort(sort_keys.begin(), sort_keys.end());
+
+    std::vector<unsigned int> order;
+    order.reserve(triangle_count);
+    for (size_t i = 0; i < cluster_count; i++) {
+        unsigned int c = sort_keys[i].second;
+        for (size_t t = cluster_start[c]; t < cluster_start[c + 1]; t++)
+            order.push_back(t);
+    }
+    reorder_triangles(mesh, order);
+}
+
+// Rearranges an attribute array of 'width' floats per vertex so that new
+// vertex i holds old vertex old_of_new[i].
+static void remap_attribute(std::vector<float> &values, size_t width,
+                            const std::vector<unsigned int> &old_of_new) {
+    if (values.size() != width * old_of_new.size())
+        return;
+    std::vector<float> remapped(values.size());
+    for (size_t i = 0; i < old_of_new.size(); i++) {
+        for (size_t k = 0; k < width; k++)
+            remapped[width * i + k] = values[width * old_of_new[i] + k];
+    }
+    values.swap(remapped);
+}
+
+void optimize_vertex_fetch(tinyobj::mesh_t &mesh) {
+    size_t vertex_count = mesh.positions.size() / 3;
+    const unsigned int unused = ~0u;
+    std::vector<unsigned int> new_of_old(vertex_count, unused);
+    std::vector<unsigned int> old_of_new;
+    old_of_new.reserve(vertex_count);
+
+    for (size_t i = 0; i < mesh.indices.size(); i++) {
+        unsigned int &n = new_of_old[mesh.indices[i]];
+        if (n == unused) {
+            n = old_of_new.size();
+            old_of_new.push_back(mesh.indices[i]);
+        }
+        mesh.indices[i] = n;
+    }
+    // Keep vertices no triangle refers to, at the end.
+    for (size_t v = 0; v < vertex_count; v++) {
+        if (new_of_old[v] == unused) {
+            new_of_old[v] = old_of_new.size();
+            old_of_new.push_back(v);
+        }
+    }
+
+    remap_attribute(mesh.positions, 3, old_of_new);
+    remap_attribute(mesh.normals, 3, old_of_new);
+    remap_attribute(mesh.texcoords, 2, old_of_new);
+}
+
+void optimize_mesh(tinyobj::mesh_t &mesh, const char *name, unsigned int flags) {
+    size_t vertex_count = mesh.positions.size() / 3;
+    vertex_cache_stats before = analyze_vertex_cache(mesh.indices.data(), mesh.indices.size(),
+                                                     vertex_count);
+
+    if (flags & OPTIMIZE_VERTEX_CACHE)
+        optimize_vertex_cache(mesh);
+    if (flags & OPTIMIZE_OVERDRAW)
+        optimize_overdraw(mesh);
+    if (flags & OPTIMIZE_VERTEX_FETCH)
+        optimize_vertex_fetch(mesh);
+
+    vertex_cache_stats after = analyze_vertex_cache(mesh.indices.data(), mesh.indices.size(),
+                                                    vertex_count);
+    printf("%s: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", name, before.acmr, after.acmr,
+           before.atvr, after.atvr);
+}
@@ -0,0 +1,40 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <tiny_obj_loader.h>
+
+// Passes run by optimize_mesh(). Also stored in the .objc cache header, so a
+// cache is only reused with the passes it was built with.
+enum {
+    OPTIMIZE_VERTEX_CACHE = 1 << 0, // reorder triangles for post-transform cache hits
+    OPTIMIZE_OVERDRAW = 1 << 1,     // then sort triangle clusters front to back
+    OPTIMIZE_VERTEX_FETCH = 1 << 2, // then renumber vertices in first-use order
+    OPTIMIZE_LOD = 1 << 3           // then build levels of detail (mesh_simplifier.h)
+};
+
+struct vertex_cache_stats {
+    float acmr; // average cache miss ratio: transformed vertices per triangle
+    float atvr; // average transform to vertex ratio: transformed vertices per vertex
+};
+
+// Simulates a FIFO post-transform cache of 'cache_size' entries.
+vertex_cache_stats analyze_vertex_cache(const unsigned int *indices, size_t index_count,
+                                        size_t vertex_count, unsigned int cache_size = 16);
+
+// Reorders triangles with Forsyth's linear-speed vertex cache optimisation.
+void optimize_vertex_cache(tinyobj::mesh_t &mesh);
+
+// Splits the (cache-optimized) triangle order into clusters at cache restarts
+// and sorts the clusters so that outward-facing ones are drawn first.
+void optimize_overdraw(tinyobj::mesh_t &mesh);
+
+// Renumbers vertices in the order the index buffer first uses them, so vertex
+// fetch walks the buffers mostly sequentially.
+void optimize_vertex_fetch(tinyobj::mesh_t &mesh);
+
+// Runs the passes selected by 'flags' and prints ACMR/ATVR before and after.
+// OPTIMIZE_LOD is left to the caller, as tinyobj::mesh_t has no room for
+// the levels.
+void optimize_mesh(tinyobj::mesh_t &mesh, const char *name, unsigned int flags);
+
+#endif // MESH_OPTIMIZER_H
@@ -0,0 +1,303 @@
+#include "mesh_simplifier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdint.h>
+
+namespace {
+
+// Sum of squared distances to a set of planes, as the symmetric 4x4 matrix
+// of Garland and Heckbert, upper triangle.
+struct quadric {
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+    quadric() : a2(0), ab(0), ac(0), ad(0), b2(0), bc(0), bd(0), c2(0), cd(0), d2(0) { }
+
+    void add_plane(double a, double b, double c, double d) {
+        a2 += a * a;
+        ab += a * b;
+        ac += a * c;
+        ad += a * d;
+        b2 += b * b;
+        bc += b * c;
+        bd += b * d;
+        c2 += c * c;
+        cd += c * d;
+        d2 += d * d;
+    }
+
+    void add(const quadric &q) {
+        a2 += q.a2;
+        ab += q.ab;
+        ac += q.ac;
+        ad += q.ad;
+        b2 += q.b2;
+        bc += q.bc;
+        bd += q.bd;
+        c2 += q.c2;
+        cd += q.cd;
+        d2 += q.d2;
+    }
+
+    double error(const float *p) const {
+        double x = p[0], y = p[1], z = p[2];
+        double e = a2 * x * x + b2 * y * y + c2 * z * z + d2 +
+                   2 * (ab * x * y + ac * x * z + ad * x + bc * y * z + bd * y + cd * z);
+        return e > 0 ? e : 0;
+    }
+};
+
+// Collapsing 'from' onto 'to'.
+struct collapse {
+    double cost;
+    unsigned int from, to;
+
+    bool operator<(const collapse &other) const { return cost < other.cost; }
+};
+
+void triangle_normal(const float *a, const float *b, const float *c, double *n) {
+    double e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    double e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+// Vertex -> triangles using it, as offsets into one list.
+struct adjacency {
+    std::vector<unsigned int> start, triangles;
+
+    void build(const std::vector<unsigned int> &indices, size_t vertex_count) {
+        start.assign(vertex_count + 1, 0);
+        for (size_t i = 0; i < indices.size(); i++)
+            start[indices[i] + 1]++;
+        for (size_t v = 0; v < vertex_count; v++)
+            start[v + 1] += start[v];
+        std::vector<unsigned int> next(start.begin(), start.end() - 1);
+        triangles.resize(indices.size());
+        for (size_t i = 0; i < indices.size(); i++)
+            triangles[next[indices[i]]++] = i / 3;
+    }
+};
+
+// Marks vertices of edges that do not have exactly one triangle on each
+// side: borders, seams and non-manifold edges.
+void find_locked(const std::vector<unsigned int> &indices, std::vector<bool> &locked) {
+    std::vector<uint64_t> edges;
+    edges.reserve(indices.size());
+    for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+        for (int k = 0; k < 3; k++) {
+            uint64_t a = indices[t + k], b = indices[t + (k + 1) % 3];
+            edges.push_back(a < b ? (a << 32 | b) : (b << 32 | a));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (size_t i = 0; i < edges.size();) {
+        size_t j = i;
+        while (j < edges.size() && edges[j] == edges[i])
+            j++;
+        if (j - i != 2) {
+            locked[edges[i] >> 32] = true;
+            locked[edges[i] & 0xffffffffu] = true;
+        }
+        i = j;
+    }
+}
+
+// True if moving 'from' onto 'to' keeps the surface manifold and flips no
+// triangle. 'shared' gets the number of triangles that would vanish.
+bool can_collapse(const float *positions, const std::vector<unsigned int> &indices,
+                  const adjacency &adj, unsigned int from, unsigned int to, unsigned int &shared) {
+    // Vertices next to both must be exactly those of the vanishing triangles
+    std::vector<unsigned int> ring_from, ring_to;
+    shared = 0;
+    for (unsigned int i = adj.start[from]; i < adj.start[from + 1]; i++) {
+        const unsigned int *t = &indices[3 * adj.triangles[i]];
+        bool has_to = t[0] == to || t[1] == to || t[2] == to;
+        if (has_to) {
+            shared++;
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            if (t[k] != from)
+                ring_from.push_back(t[k]);
+        }
+        // The triangle with 'from' moved must face the same way
+        double before[3], after[3];
+        const float *p[3], *q[3];
+        for (int k = 0; k < 3; k++) {
+            p[k] = positions + 3 * (size_t) t[k];
+            q[k] = positions + 3 * (size_t) (t[k] == from ? to : t[k]);
+        }
+        triangle_normal(p[0], p[1], p[2], before);
+        triangle_normal(q[0], q[1], q[2], after);
+        double dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+        double len = std::sqrt((before[0] * before[0] + before[1] * before[1] + before[2] * before[2]) *
+                               (after[0] * after[0] + after[1] * after[1] + after[2] * after[2]));
+        if (!(dot > 0.25 * len))
+            return false;
+    }
+    if (shared != 2)
+        return false;
+    for (unsigned int i = adj.start[to]; i < adj.start[to + 1]; i++) {
+        const unsigned int *t = &indices[3 * adj.triangles[i]];
+        for (int k = 0; k < 3; k++) {
+            if (t[k] != to && t[k] != from)
+                ring_to.push_back(t[k]);
+        }
+    }
+    std::sort(ring_from.begin(), ring_from.end());
+    ring_from.erase(std::unique(ring_from.begin(), ring_from.end()), ring_from.end());
+    std::sort(ring_to.begin(), ring_to.end());
+    ring_to.erase(std::unique(ring_to.begin(), ring_to.end()), ring_to.end());
+    size_t common = 0;
+    for (size_t i = 0, j = 0; i < ring_from.size() && j < ring_to.size();) {
+        if (ring_from[i] < ring_to[j]) {
+            i++;
+        } else if (ring_to[j] < ring_from[i]) {
+            j++;
+        } else {
+            common++;
+            i++;
+            j++;
+        }
+    }
+    return common == 2;
+}
+
+}
+
+std::vector<unsigned int> simplify_mesh(const float *positions, size_t vertex_count,
+                                        const unsigned int *indices, size_t index_count,
+                                        size_t target_index_count, float &error) {
+    std::vector<unsigned int> result(indices, indices + index_count - index_count % 3);
+    error = 0;
+
+    std::vector<quadric> quadrics(vertex_count);
+    for (size_t t = 0; t < result.size(); t += 3) {
+        double n[3];
+        const float *a = positions + 3 * (size_t) result[t];
+        triangle_normal(a, positions + 3 * (size_t) result[t + 1],
+                        positions + 3 * (size_t) result[t + 2], n);
+        double len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (len == 0)
+            continue;
+        n[0] /= len;
+        n[1] /= len;
+        n[2] /= len;
+        double d = -(n[0] * a[0] + n[1] * a[1] + n[2] * a[2]);
+        for (int k = 0; k < 3; k++)
+            quadrics[result[t + k]].add_plane(n[0], n[1], n[2], d);
+    }
+    std::vector<bool> locked(vertex_count, false);
+    find_locked(result, locked);
+
+    // Passes of independent collapses, cheapest first: a collapse freezes
+    // the vertices around it until the next pass rebuilds adjacency.
+    adjacency adj;
+    std::vector<collapse> candidates;
+    std::vector<unsigned int> remap(vertex_count);
+    std::vector<bool> frozen;
+    double max_cost = 0;
+    while (result.size() > target_index_count) {
+        adj.build(result, vertex_count);
+        candidates.clear();
+        for (size_t t = 0; t < result.size(); t += 3) {
+            for (int k = 0; k < 3; k++) {
+                unsigned int a = result[t + k], b = result[t + (k + 1) % 3];
+                // Each interior edge is seen from both triangles, once per direction
+                if (locked[a])
+                    continue;
+                quadric q = quadrics[a];
+                q.add(quadrics[b]);
+                collapse c = {q.error(positions + 3 * (size_t) b), a, b};
+                candidates.push_back(c);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        for (size_t v = 0; v < vertex_count; v++)
+            remap[v] = v;
+        frozen.assign(vertex_count, false);
+        size_t triangles = result.size() / 3;
+        size_t target_triangles = target_index_count / 3;
+        // Leave the costliest half for later passes, once quadrics merge
+        size_t limit = candidates.size() / 2 + 1;
+        size_t done = 0;
+        for (size_t i = 0; i < limit && triangles > target_triangles; i++) {
+            const collapse &c = candidates[i];
+            if (frozen[c.from] || frozen[c.to])
+                continue;
+            unsigned int shared;
+            if (!can_collapse(positions, result, adj, c.from, c.to, shared))
+                continue;
+            remap[c.from] = c.to;
+            quadrics[c.to].add(quadrics[c.from]);
+            max_cost = std::max(max_cost, c.cost);
+            for (unsigned int j = adj.start[c.from]; j < adj.start[c.from + 1]; j++) {
+                const unsigned int *t = &result[3 * adj.triangles[j]];
+                frozen[t[0]] = frozen[t[1]] = frozen[t[2]] = true;
+            }
+            triangles -= shared;
+            done++;
+        }
+        if (done == 0)
+            break;
+
+        size_t kept = 0;
+        for (size_t t = 0; t < result.size(); t += 3) {
+            unsigned int a = remap[result[t]], b = remap[result[t + 1]], c = remap[result[t + 2]];
+            if (a == b || b == c || c == a)
+                continue;
+            result[kept++] = a;
+            result[kept++] = b;
+            result[kept++] = c;
+        }
+        result.resize(kept);
+    }
+    error = (float) std::sqrt(max_cost);
+    return result;
+}
+
+void build_lod_chain(const float *positions, size_t vertex_count, const unsigned int *indices,
+                     size_t index_count, unsigned int max_levels, const char *name,
+                     lod_chain &chain) {
+    chain.indices.clear();
+    chain.first.clear();
+    chain.count.clear();
+    chain.error.clear();
+
+    // Levels that far off are not worth having
+    float lo[3] = {0, 0, 0}, hi[3] = {0, 0, 0};
+    for (size_t v = 0; v < vertex_count; v++) {
+        for (int k = 0; k < 3; k++) {
+            float x = positions[3 * v + k];
+            lo[k] = v == 0 || x < lo[k] ? x : lo[k];
+            hi[k] = v == 0 || x > hi[k] ? x : hi[k];
+        }
+    }
+    float max_error = std::sqrt((hi[0] - lo[0]) * (hi[0] - lo[0]) + (hi[1] - lo[1]) * (hi[1] - lo[1]) +
+                                (hi[2] - lo[2]) * (hi[2] - lo[2])) / 8;
+
+    std::vector<unsigned int> level(indices, indices + index_count);
+    float error = 0;
+    printf("%s: LOD 0 %zu triangles", name, index_count / 3);
+    for (unsigned int l = 1; l < max_levels; l++) {
+        size_t target = level.size() / 2 / 3 * 3;
+        float level_error;
+        std::vector<unsigned int> next = simplify_mesh(positions, vertex_count, &level[0],
+                                                       level.size(), target, level_error);
+        // Distances add up along the chain
+        if (next.empty() || next.size() * 4 > level.size() * 3 || error + level_error > max_error)
+            break;
+        error += level_error;
+        chain.first.push_back(chain.indices.size());
+        chain.count.push_back(next.size());
+        chain.error.push_back(error);
+        chain.indices.insert(chain.indices.end(), next.begin(), next.end());
+        printf(", %u %zu (error %g)", l, next.size() / 3, error);
+        level.swap(next);
+    }
+    printf("\n");
+}
@@ -0,0 +1,36 @@
+#ifndef MESH_SIMPLIFIER_H
+#define MESH_SIMPLIFIER_H
+
+#include <vector>
+#include <stddef.h>
+
+// Collapses edges of a triangle list, cheapest first by quadric error
+// metrics (Garland and Heckbert, 1997), until at most 'target_index_count'
+// indices are left or no collapse is allowed. Each collapse moves a vertex
+// onto a neighbour, so the result indexes the same vertex buffer.
+//
+// Vertices on a border, which includes texture seams since their vertices
+// are split, never move; neither do collapses that would flip a triangle
+// or make the surface non-manifold. 'error' gets the largest distance, in
+// the mesh's units, that the surface moved.
+std::vector<unsigned int> simplify_mesh(const float *positions, size_t vertex_count,
+                                        const unsigned int *indices, size_t index_count,
+                                        size_t target_index_count, float &error);
+
+// Levels of detail over one vertex buffer. Level 0 is the mesh itself;
+// each following level has about half the triangles of the one before.
+struct lod_chain {
+    std::vector<unsigned int> indices; // levels 1 and up, back to back
+    std::vector<unsigned int> first, count; // per level from 1, into 'indices'
+    std::vector<float> error; // per level from 1, summed along the chain from level 0
+};
+
+// Simplifies until 'max_levels' levels (level 0 included), until a level
+// would keep more than 3/4 of the triangles before it, or until its error
+// would pass an eighth of the mesh's bounding box diagonal. Prints the
+// triangles and error of each level.
+void build_lod_chain(const float *positions, size_t vertex_count, const unsigned int *indices,
+                     size_t index_count, unsigned int max_levels, const char *name,
+                     lod_chain &chain);
+
+#endif // MESH_SIMPLIFIER_H
@@ -0,0 +1,285 @@
+#include "occlusion.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OCCLUSION_SSE 1
+#include <emmintrin.h>
+#endif
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// out = a * b, column-major
+static void multiply(const float *a, const float *b, float *out) {
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 4; r++)
+            out[4 * c + r] = a[r] * b[4 * c] + a[4 + r] * b[4 * c + 1] +
+                             a[8 + r] * b[4 * c + 2] + a[12 + r] * b[4 * c + 3];
+    }
+}
+
+occlusion_buffer::occlusion_buffer(unsigned int width, unsigned int height)
+    : w((width + 3) & ~3u), h(height ? height : 1), begin_time(0) {
+    // Each level halves the one below, rounding up, down to 1x1
+    unsigned int lw = w, lh = h;
+    for (;;) {
+        level_w.push_back(lw);
+        level_h.push_back(lh);
+        levels.push_back(std::vector<float>((size_t) lw * lh, 1.0f));
+        if (lw == 1 && lh == 1)
+            break;
+        lw = (lw + 1) / 2;
+        lh = (lh + 1) / 2;
+    }
+    for (int i = 0; i < 16; i++)
+        vp[i] = i % 5 == 0 ? 1.0f : 0.0f;
+    last_stats.triangles = 0;
+    last_stats.tested = 0;
+    last_stats.occluded = 0;
+    last_stats.raster_seconds = 0;
+}
+
+void occlusion_buffer::begin(const float *view_projection) {
+    begin_time = now();
+    std::copy(view_projection, view_projection + 16, vp);
+    std::fill(levels[0].begin(), levels[0].end(), 1.0f);
+    last_stats.triangles = 0;
+    last_stats.tested = 0;
+    last_stats.occluded = 0;
+}
+
+void occlusion_buffer::add_occluder(const float *positions, size_t num_positions,
+                                    const unsigned int *indices, size_t num_indices,
+                                    const float *model) {
+    float mvp[16];
+    multiply(vp, model, mvp);
+
+    size_t count = num_positions / 3;
+    screen.resize(4 * count);
+    for (size_t i = 0; i < count; i++) {
+        const float *p = positions + 3 * i;
+        float clip[4];
+        for (int r = 0; r < 4; r++)
+            clip[r] = mvp[r] * p[0] + mvp[4 + r] * p[1] + mvp[8 + r] * p[2] + mvp[12 + r];
+        float *s = &screen[4 * i];
+        s[3] = clip[3] > 0 && clip[2] >= -clip[3] ? 1.0f : 0.0f;
+        if (s[3] != 0) {
+            float inv = 1.0f / clip[3];
+            s[0] = (clip[0] * inv * 0.5f + 0.5f) * w;
+            s[1] = (clip[1] * inv * 0.5f + 0.5f) * h;
+            s[2] = clip[2] * inv;
+        }
+    }
+
+    for (size_t i = 0; i + 2 < num_indices; i += 3) {
+        const float *a = &screen[4 * indices[i]];
+        const float *b = &screen[4 * indices[i + 1]];
+        const float *c = &screen[4 * indices[i + 2]];
+        // Clipping would only add depth, so skipping is safe
+        if (a[3] != 0 && b[3] != 0 && c[3] != 0)
+            draw_triangle(a, b, c);
+    }
+}
+
+// Fills the pixels whose centres are inside a counter-clockwise triangle,
+// keeping the nearer depth.
+void occlusion_buffer::draw_triangle(const float *a, const float *b, const float *c) {
+    float area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+    if (!(area > 0))
+        return;
+
+    float min_x = std::min(a[0], std::min(b[0], c[0]));
+    float max_x = std::max(a[0], std::max(b[0], c[0]));
+    float min_y = std::min(a[1], std::min(b[1], c[1]));
+    float max_y = std::max(a[1], std::max(b[1], c[1]));
+    int x0 = std::max(0, (int) std::ceil(min_x - 0.5f));
+    int x1 = std::min((int) w - 1, (int) std::floor(max_x - 0.5f));
+    int y0 = std::max(0, (int) std::ceil(min_y - 0.5f));
+    int y1 = std::min((int) h - 1, (int) std::floor(max_y - 0.5f));
+    if (x0 > x1 || y0 > y1)
+        return;
+    last_stats.triangles++;
+
+    // Edge functions e = ex * x + ey * y + ec, positive inside, one per
+    // edge and opposite a vertex; depth is their blend over the area.
+    float ex[3], ey[3], ec[3];
+    const float *v[3] = {a, b, c};
+    for (int e = 0; e < 3; e++) {
+        const float *p = v[(e + 1) % 3], *q = v[(e + 2) % 3];
+        ex[e] = p[1] - q[1];
+        ey[e] = q[0] - p[0];
+        ec[e] = p[0] * q[1] - p[1] * q[0];
+    }
+    float inv_area = 1.0f / area;
+    float zx = (ex[0] * a[2] + ex[1] * b[2] + ex[2] * c[2]) * inv_area;
+    float zy = (ey[0] * a[2] + ey[1] * b[2] + ey[2] * c[2]) * inv_area;
+    float zc = (ec[0] * a[2] + ec[1] * b[2] + ec[2] * c[2]) * inv_area;
+
+    float *depth = &levels[0][0];
+    int x_start = x0 & ~3;
+#ifdef OCCLUSION_SSE
+    __m128 step = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+    __m128 zero = _mm_setzero_ps();
+    for (int y = y0; y <= y1; y++) {
+        float py = y + 0.5f;
+        float *row = depth + (size_t) y * w;
+        for (int x = x_start; x <= x1; x += 4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float) x), step);
+            __m128 inside = _mm_cmpge_ps(
+                _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ex[0]), px), _mm_set1_ps(ey[0] * py + ec[0])), zero);
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(
+                _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ex[1]), px), _mm_set1_ps(ey[1] * py + ec[1])), zero));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(
+                _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ex[2]), px), _mm_set1_ps(ey[2] * py + ec[2])), zero));
+            if (_mm_movemask_ps(inside) == 0)
+                continue;
+            __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zx), px), _mm_set1_ps(zy * py + zc));
+            __m128 old = _mm_loadu_ps(row + x);
+            z = _mm_min_ps(old, z);
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, z), _mm_andnot_ps(inside, old)));
+        }
+    }
+#else
+    for (int y = y0; y <= y1; y++) {
+        float py = y + 0.5f;
+        float *row = depth + (size_t) y * w;
+        for (int x = x_start; x <= x1; x++) {
+            float px = x + 0.5f;
+            if (ex[0] * px + ey[0] * py + ec[0] < 0 || ex[1] * px + ey[1] * py + ec[1] < 0 ||
+                ex[2] * px + ey[2] * py + ec[2] < 0)
+                continue;
+            float z = zx * px + zy * py + zc;
+            if (z < row[x])
+                row[x] = z;
+        }
+    }
+#endif
+}
+
+void occlusion_buffer::finish() {
+    for (size_t k = 1; k < levels.size(); k++) {
+        const std::vector<float> &below = levels[k - 1];
+        unsigned int bw = level_w[k - 1], bh = level_h[k - 1];
+        for (unsigned int y = 0; y < level_h[k]; y++) {
+            unsigned int y0 = 2 * y, y1 = std::min(2 * y + 1, bh - 1);
+            for (unsigned int x = 0; x < level_w[k]; x++) {
+                unsigned int x0 = 2 * x, x1 = std::min(2 * x + 1, bw - 1);
+                float farthest = std::max(std::max(below[y0 * bw + x0], below[y0 * bw + x1]),
+                                          std::max(below[y1 * bw + x0], below[y1 * bw + x1]));
+                levels[k][y * level_w[k] + x] = farthest;
+            }
+        }
+    }
+    last_stats.raster_seconds = now() - begin_time;
+}
+
+#ifdef OCCLUSION_SSE
+static float horizontal_min(__m128 v) {
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtss_f32(v);
+}
+
+static float horizontal_max(__m128 v) {
+    v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtss_f32(v);
+}
+#endif
+
+// The NDC rectangle and nearest depth of the box's corners. False if a
+// corner is behind the near plane.
+static bool project_box(const float *vp, const bounds &world, float *rect, float &near_z) {
+#ifdef OCCLUSION_SSE
+    // Each corner's clip position is the min corner's plus some edges
+    __m128 c0 = _mm_loadu_ps(vp), c1 = _mm_loadu_ps(vp + 4);
+    __m128 c2 = _mm_loadu_ps(vp + 8), c3 = _mm_loadu_ps(vp + 12);
+    __m128 corners[8];
+    corners[0] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(world.min[0])),
+                                       _mm_mul_ps(c1, _mm_set1_ps(world.min[1]))),
+                            _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(world.min[2])), c3));
+    __m128 dx = _mm_mul_ps(c0, _mm_set1_ps(world.max[0] - world.min[0]));
+    __m128 dy = _mm_mul_ps(c1, _mm_set1_ps(world.max[1] - world.min[1]));
+    __m128 dz = _mm_mul_ps(c2, _mm_set1_ps(world.max[2] - world.min[2]));
+    corners[1] = _mm_add_ps(corners[0], dx);
+    corners[2] = _mm_add_ps(corners[0], dy);
+    corners[3] = _mm_add_ps(corners[1], dy);
+    for (int i = 0; i < 4; i++)
+        corners[4 + i] = _mm_add_ps(corners[i], dz);
+
+    __m128 lo_x = _mm_set1_ps(1e30f), lo_y = lo_x, lo_z = lo_x;
+    __m128 hi_x = _mm_set1_ps(-1e30f), hi_y = hi_x;
+    for (int g = 0; g < 8; g += 4) {
+        // Four corners as x, y, z and w vectors
+        __m128 x = corners[g], y = corners[g + 1], z = corners[g + 2], cw = corners[g + 3];
+        _MM_TRANSPOSE4_PS(x, y, z, cw);
+        __m128 behind = _mm_or_ps(_mm_cmple_ps(cw, _mm_setzero_ps()),
+                                  _mm_cmplt_ps(z, _mm_sub_ps(_mm_setzero_ps(), cw)));
+        if (_mm_movemask_ps(behind))
+            return false;
+        __m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), cw);
+        x = _mm_mul_ps(x, inv);
+        y = _mm_mul_ps(y, inv);
+        lo_x = _mm_min_ps(lo_x, x);
+        hi_x = _mm_max_ps(hi_x, x);
+        lo_y = _mm_min_ps(lo_y, y);
+        hi_y = _mm_max_ps(hi_y, y);
+        lo_z = _mm_min_ps(lo_z, _mm_mul_ps(z, inv));
+    }
+    rect[0] = horizontal_min(lo_x);
+    rect[1] = horizontal_min(lo_y);
+    rect[2] = horizontal_max(hi_x);
+    rect[3] = horizontal_max(hi_y);
+    near_z = horizontal_min(lo_z);
+#else
+    rect[0] = rect[1] = near_z = 1e30f;
+    rect[2] = rect[3] = -1e30f;
+    for (int i = 0; i < 8; i++) {
+        float p[3] = {i & 1 ? world.max[0] : world.min[0], i & 2 ? world.max[1] : world.min[1],
+                      i & 4 ? world.max[2] : world.min[2]};
+        float clip[4];
+        for (int r = 0; r < 4; r++)
+            clip[r] = vp[r] * p[0] + vp[4 + r] * p[1] + vp[8 + r] * p[2] + vp[12 + r];
+        if (clip[3] <= 0 || clip[2] < -clip[3])
+            return false;
+        float inv = 1.0f / clip[3];
+        rect[0] = std::min(rect[0], clip[0] * inv);
+        rect[1] = std::min(rect[1], clip[1] * inv);
+        rect[2] = std::max(rect[2], clip[0] * inv);
+        rect[3] = std::max(rect[3], clip[1] * inv);
+        near_z = std::min(near_z, clip[2] * inv);
+    }
+#endif
+    return true;
+}
+
+bool occlusion_buffer::visible(const bounds &world) {
+    last_stats.tested++;
+    float rect[4], near_z;
+    if (!project_box(vp, world, rect, near_z))
+        return true;
+    float min_x = (rect[0] * 0.5f + 0.5f) * w, max_x = (rect[2] * 0.5f + 0.5f) * w;
+    float min_y = (rect[1] * 0.5f + 0.5f) * h, max_y = (rect[3] * 0.5f + 0.5f) * h;
+    if (max_x < 0 || max_y < 0 || min_x >= w || min_y >= h)
+        return true; // off screen: for the frustum to decide
+
+    int x0 = std::max(0, (int) min_x), x1 = std::min((int) w - 1, (int) max_x);
+    int y0 = std::max(0, (int) min_y), y1 = std::min((int) h - 1, (int) max_y);
+    // The level where the box spans at most 2x2 texels
+    size_t k = 0;
+    while (k + 1 < levels.size() && ((x1 >> k) - (x0 >> k) > 1 || (y1 >> k) - (y0 >> k) > 1))
+        k++;
+    const std::vector<float> &level = levels[k];
+    for (int y = y0 >> k; y <= y1 >> k; y++) {
+        for (int x = x0 >> k; x <= x1 >> k; x++) {
+            if (near_z <= level[y * level_w[k] + x])
+                return true;
+        }
+    }
+    last_stats.occluded++;
+    return false;
+}
@@ -0,0 +1,62 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <vector>
+#include <stddef.h>
+
+#include "culling.h"
+
+// Work done since the last occlusion_buffer::begin().
+struct occlusion_stats {
+    unsigned int triangles; // occluder triangles drawn
+    unsigned int tested;    // boxes given to visible()
+    unsigned int occluded;  // ... found hidden
+    double raster_seconds;  // from begin() to the end of finish()
+};
+
+// A small depth buffer that a few large occluders are drawn into on the
+// CPU, and a pyramid of its farthest depths. Boxes are tested against the
+// pyramid level where they cover at most 2x2 texels, so each test reads at
+// most four values whatever the box's size on screen.
+//
+// Occluders are rasterized four pixels at a time with SSE, sampled at pixel
+// centres. Triangles crossing the near plane are skipped, and so are boxes
+// crossing it, which count as visible.
+class occlusion_buffer {
+public:
+    // The width is rounded up to a multiple of 4.
+    occlusion_buffer(unsigned int width = 256, unsigned int height = 192);
+
+    // Clears the depth buffer for a frame seen through the column-major
+    // view-projection matrix 'vp'.
+    void begin(const float *vp);
+    // Draws the triangles that 'indices' make of 'positions' (xyz,
+    // 'num_positions' floats), moved by the column-major 'model'. Only
+    // front faces, counter-clockwise on screen, are drawn.
+    void add_occluder(const float *positions, size_t num_positions, const unsigned int *indices,
+                      size_t num_indices, const float *model);
+    // Builds the pyramid; call once all occluders are added.
+    void finish();
+
+    // False if 'world's box is behind the occluders.
+    bool visible(const bounds &world);
+
+    unsigned int width() const { return w; }
+    unsigned int height() const { return h; }
+    // Depth at pixel (x, y), y up: NDC z, 1 where nothing was drawn.
+    float depth(unsigned int x, unsigned int y) const { return levels[0][y * w + x]; }
+    const occlusion_stats &stats() const { return last_stats; }
+
+private:
+    void draw_triangle(const float *a, const float *b, const float *c);
+
+    unsigned int w, h;
+    float vp[16];
+    std::vector<float> screen; // per occluder vertex: pixel x, y, NDC z, 1 if past the near plane
+    std::vector<std::vector<float> > levels; // levels[0] is the depth buffer, row by row
+    std::vector<unsigned int> level_w, level_h;
+    double begin_time;
+    occlusion_stats last_stats;
+};
+
+#endif // OCCLUSION_H
@@ -0,0 +1,257 @@
+#include "profiler.h"
+
+#include <GL/glew.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+
+profiler::profiler()
+    : on(false), use_gpu(false), frame(0), origin(0), gpu_origin(0), dropped(0) { }
+
+double profiler::now() const {
+    return std::chrono::duration<double, std::micro>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void profiler::init(bool gpu) {
+    on = true;
+    use_gpu = gpu;
+    origin = now();
+    if (use_gpu) {
+        GLint64 timestamp = 0;
+        glGetInteger64v(GL_TIMESTAMP, &timestamp);
+        gpu_origin = timestamp;
+    }
+}
+
+void profiler::release() {
+    for (unsigned int i = 0; i < kLatency; i++) {
+        gpu_frame &slot = ring[i];
+        for (size_t s = 0; s < slot.scopes.size(); s++) {
+            slot.free_queries.push_back(slot.scopes[s].begin_query);
+            if (slot.scopes[s].end_query)
+                slot.free_queries.push_back(slot.scopes[s].end_query);
+        }
+        slot.scopes.clear();
+        if (!slot.free_queries.empty())
+            glDeleteQueries(slot.free_queries.size(), &slot.free_queries[0]);
+        slot.free_queries.clear();
+    }
+    on = false;
+}
+
+void profiler::begin_frame() {
+    if (!on)
+        return;
+    if (use_gpu) {
+        // Written kLatency frames ago; the GPU should be long done with it
+        gpu_frame &slot = ring[frame % kLatency];
+        collect(slot, false);
+        slot.frame = frame;
+        open_gpu.clear();
+    }
+    begin("frame");
+}
+
+void profiler::end_frame() {
+    if (!on)
+        return;
+    while (!open.empty())
+        end();
+    frame++;
+}
+
+void profiler::begin(const char *name) {
+    if (!on)
+        return;
+    profile_event event = {name, now() - origin, 0, frame, (unsigned int) open.size(), false};
+    open.push_back(events.size());
+    events.push_back(event);
+}
+
+void profiler::end() {
+    if (!on || open.empty())
+        return;
+    profile_event &event = events[open.back()];
+    event.duration = now() - origin - event.start;
+    open.pop_back();
+}
+
+unsigned int profiler::new_query(gpu_frame &slot) {
+    if (slot.free_queries.empty()) {
+        GLuint query;
+        glGenQueries(1, &query);
+        return query;
+    }
+    unsigned int query = slot.free_queries.back();
+    slot.free_queries.pop_back();
+    return query;
+}
+
+void profiler::begin_gpu(const char *name) {
+    if (!on || !use_gpu)
+        return;
+    gpu_frame &slot = ring[frame % kLatency];
+    gpu_scope scope = {name, (unsigned int) open_gpu.size(), new_query(slot), 0};
+    glQueryCounter(scope.begin_query, GL_TIMESTAMP);
+    open_gpu.push_back(slot.scopes.size());
+    slot.scopes.push_back(scope);
+}
+
+void profiler::end_gpu() {
+    if (!on || !use_gpu || open_gpu.empty())
+        return;
+    gpu_frame &slot = ring[frame % kLatency];
+    gpu_scope &scope = slot.scopes[open_gpu.back()];
+    scope.end_query = new_query(slot);
+    glQueryCounter(scope.end_query, GL_TIMESTAMP);
+    open_gpu.pop_back();
+}
+
+// Turns the slot's finished queries into events and frees them all.
+// Without 'wait', results not available yet are dropped.
+void profiler::collect(gpu_frame &slot, bool wait) {
+    for (size_t s = 0; s < slot.scopes.size(); s++) {
+        const gpu_scope &scope = slot.scopes[s];
+        slot.free_queries.push_back(scope.begin_query);
+        if (!scope.end_query)
+            continue; // never ended
+        slot.free_queries.push_back(scope.end_query);
+        // Timestamps complete in order, so the end one is checked alone
+        GLuint available = GL_TRUE;
+        if (!wait)
+            glGetQueryObjectuiv(scope.end_query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            dropped++;
+            continue;
+        }
+        GLuint64 begin_ns = 0, end_ns = 0;
+        glGetQueryObjectui64v(scope.begin_query, GL_QUERY_RESULT, &begin_ns);
+        glGetQueryObjectui64v(scope.end_query, GL_QUERY_RESULT, &end_ns);
+        profile_event event = {scope.name, ((long long) begin_ns - gpu_origin) / 1000.0,
+                               ((long long) end_ns - (long long) begin_ns) / 1000.0, slot.frame,
+                               scope.depth, true};
+        events.push_back(event);
+    }
+    slot.scopes.clear();
+}
+
+// Sums each scope's events per frame, scopes in order of first appearance.
+void profiler::summarize(std::vector<scope_summary> &scopes) {
+    if (use_gpu) {
+        for (unsigned int i = 0; i < kLatency; i++)
+            collect(ring[i], true);
+    }
+    std::map<std::pair<std::string, bool>, size_t> index;
+    std::vector<std::map<unsigned int, double> > totals;
+    scopes.clear();
+    for (size_t i = 0; i < events.size(); i++) {
+        const profile_event &event = events[i];
+        std::pair<std::string, bool> key(event.name, event.gpu);
+        std::map<std::pair<std::string, bool>, size_t>::iterator it = index.find(key);
+        if (it == index.end()) {
+            it = index.insert(std::make_pair(key, scopes.size())).first;
+            scope_summary summary;
+            summary.name = event.name;
+            summary.gpu = event.gpu;
+            scopes.push_back(summary);
+            totals.push_back(std::map<unsigned int, double>());
+        }
+        totals[it->second][event.frame] += event.duration / 1000.0;
+    }
+    for (size_t s = 0; s < scopes.size(); s++) {
+        for (std::map<unsigned int, double>::const_iterator it = totals[s].begin();
+             it != totals[s].end(); ++it)
+            scopes[s].per_frame.push_back(it->second);
+        std::sort(scopes[s].per_frame.begin(), scopes[s].per_frame.end());
+    }
+}
+
+// Nearest rank of sorted 'values'.
+static double percentile(const std::vector<double> &values, double p) {
+    if (values.empty())
+        return 0;
+    size_t rank = (size_t) std::ceil(p * values.size());
+    return values[rank > 0 ? rank - 1 : 0];
+}
+
+static double mean(const std::vector<double> &values) {
+    double sum = 0;
+    for (size_t i = 0; i < values.size(); i++)
+        sum += values[i];
+    return values.empty() ? 0 : sum / values.size();
+}
+
+// Quotes 'text' for JSON.
+static std::string json_string(const std::string &text) {
+    std::string quoted = "\"";
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '"' || text[i] == '\\')
+            quoted += '\\';
+        quoted += text[i];
+    }
+    return quoted + "\"";
+}
+
+std::string profiler::write(const std::string &filename) {
+    std::vector<scope_summary> scopes;
+    summarize(scopes);
+
+    FILE *fp = fopen(filename.c_str(), "w");
+    if (!fp)
+        return std::string("Cannot open file [") + filename + "]";
+    bool trace = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0;
+    if (trace) {
+        // CPU scopes on thread 1, GPU scopes on thread 2
+        fprintf(fp, "{\"traceEvents\":[\n");
+        for (size_t i = 0; i < events.size(); i++) {
+            const profile_event &event = events[i];
+            fprintf(fp, "{\"name\":%s,\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"args\":{\"frame\":%u}},\n",
+                    json_string(event.name).c_str(), event.gpu ? 2 : 1, event.start,
+                    event.duration, event.frame);
+        }
+        fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+                    "\"args\":{\"name\":\"CPU\"}},\n");
+        fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,"
+                    "\"args\":{\"name\":\"GPU\"}}\n],\n\"otherData\":{");
+        for (size_t s = 0; s < scopes.size(); s++) {
+            const scope_summary &scope = scopes[s];
+            std::string name = scope.name + (scope.gpu ? " (gpu)" : "");
+            fprintf(fp, "%s%s:\"p50 %.3f ms, p95 %.3f ms, p99 %.3f ms\"", s ? ",\n" : "\n",
+                    json_string(name).c_str(), percentile(scope.per_frame, 0.5),
+                    percentile(scope.per_frame, 0.95), percentile(scope.per_frame, 0.99));
+        }
+        fprintf(fp, "\n}}\n");
+    } else {
+        fprintf(fp, "scope,timer,frames,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+        for (size_t s = 0; s < scopes.size(); s++) {
+            const scope_summary &scope = scopes[s];
+            fprintf(fp, "%s,%s,%zu,%.4f,%.4f,%.4f,%.4f,%.4f\n", scope.name.c_str(),
+                    scope.gpu ? "gpu" : "cpu", scope.per_frame.size(), mean(scope.per_frame),
+                    percentile(scope.per_frame, 0.5), percentile(scope.per_frame, 0.95),
+                    percentile(scope.per_frame, 0.99),
+                    scope.per_frame.empty() ? 0 : scope.per_frame.back());
+        }
+    }
+    if (fclose(fp) != 0)
+        return std::string("Cannot write file [") + filename + "]";
+    return std::string();
+}
+
+void profiler::print_summary() {
+    std::vector<scope_summary> scopes;
+    summarize(scopes);
+    printf("%-12s %5s %8s %8s %8s %8s (ms, %u frames)\n", "scope", "timer", "mean", "p50", "p95",
+           "p99", frame);
+    for (size_t s = 0; s < scopes.size(); s++) {
+        const scope_summary &scope = scopes[s];
+        printf("%-12s %5s %8.3f %8.3f %8.3f %8.3f\n", scope.name.c_str(), scope.gpu ? "gpu" : "cpu",
+               mean(scope.per_frame), percentile(scope.per_frame, 0.5),
+               percentile(scope.per_frame, 0.95), percentile(scope.per_frame, 0.99));
+    }
+    if (dropped)
+        printf("%u GPU timings dropped, not ready after %u frames\n", dropped, kLatency);
+}
@@ -0,0 +1,105 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+#include <vector>
+
+// One timed scope of one frame, in microseconds since profiler::init().
+struct profile_event {
+    const char *name; // must outlive the profiler; string literals do
+    double start, duration;
+    unsigned int frame;
+    unsigned int depth; // of nesting, 0 for the outermost scopes
+    bool gpu;
+};
+
+// Frame profiler: nestable CPU scopes timed with the steady clock, and GPU
+// scopes timed with GL_TIMESTAMP queries. Timestamps, unlike
+// GL_TIME_ELAPSED, may nest. GPU queries go into a ring of kLatency frames
+// and are read when their slot comes round again. A result that is still
+// not available then is dropped rather than waited for, so profiling never
+// stalls the pipeline.
+//
+// Per frame: begin_frame(), any number of begin()/end() and
+// begin_gpu()/end_gpu() pairs, then end_frame(). Everything is recorded
+// until write(), which drains the ring and saves the events.
+class profiler {
+public:
+    static const unsigned int kLatency = 4;
+
+    profiler();
+
+    // 'gpu' needs a current context with timer queries.
+    void init(bool gpu);
+    void release();
+    bool enabled() const { return on; }
+
+    void begin_frame();
+    void end_frame();
+
+    void begin(const char *name);
+    void end();
+    void begin_gpu(const char *name);
+    void end_gpu();
+
+    // Saves to 'filename': a Chrome trace (chrome://tracing, Perfetto) of
+    // every event if it ends in ".json", else a CSV of the percentiles. In
+    // a trace, the percentiles go in "otherData". Returns an empty string
+    // on success.
+    std::string write(const std::string &filename);
+    // Prints the percentiles.
+    void print_summary();
+
+    unsigned int gpu_dropped() const { return dropped; }
+
+private:
+    struct gpu_scope {
+        const char *name;
+        unsigned int depth;
+        unsigned int begin_query, end_query;
+    };
+    struct gpu_frame {
+        unsigned int frame;
+        std::vector<gpu_scope> scopes;
+        std::vector<unsigned int> free_queries;
+    };
+    // Milliseconds each scope took in each frame it ran in
+    struct scope_summary {
+        std::string name;
+        bool gpu;
+        std::vector<double> per_frame;
+    };
+
+    profiler(const profiler &);
+    profiler &operator=(const profiler &);
+
+    double now() const;
+    unsigned int new_query(gpu_frame &slot);
+    void collect(gpu_frame &slot, bool wait);
+    void summarize(std::vector<scope_summary> &scopes);
+
+    bool on, use_gpu;
+    unsigned int frame;
+    double origin; // steady clock, in microseconds
+    long long gpu_origin; // GL_TIMESTAMP at init(), in nanoseconds
+    std::vector<profile_event> events;
+    std::vector<unsigned int> open; // indices into 'events' of open CPU scopes
+    gpu_frame ring[kLatency];
+    std::vector<unsigned int> open_gpu; // indices into the current slot's scopes
+    unsigned int dropped;
+};
+
+// Times the enclosing block as a CPU scope.
+class profile_scope {
+public:
+    profile_scope(profiler &p, const char *name) : prof(p) { prof.begin(name); }
+    ~profile_scope() { prof.end(); }
+
+private:
+    profile_scope(const profile_scope &);
+    profile_scope &operator=(const profile_scope &);
+
+    profiler &prof;
+};
+
+#endif // PROFILER_H
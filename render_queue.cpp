@@ -0,0 +1,409 @@
+#include "render_queue.h"
+#include "thread_pool.h"
+
+#include <GL/glew.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static const int kDepthBits = 24;
+static const int kVaoBits = 16;
+static const int kTextureBits = 16;
+static const int kProgramBits = 8;
+
+static const float kIdentity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+
+draw_item::draw_item()
+    : program(0), vao(0), texture(0), layer(0), index_type(GL_UNSIGNED_INT), index_size(4),
+      lod(0), instanced(false), instance_count(0) {
+    memcpy(model, kIdentity, sizeof(model));
+}
+
+render_queue::render_queue()
+    : dirty(false), frame(0), use_base_instance(false), models_dirty(false), id_buffer(0),
+      id_capacity(0) {
+    last_stats.draw_calls = 0;
+    last_stats.instances = 0;
+    last_stats.state_changes = 0;
+    last_stats.state_skipped = 0;
+    last_stats.culled = 0;
+    last_stats.triangles = 0;
+    last_stats.record_seconds = 0;
+    last_stats.replay_seconds = 0;
+}
+
+void render_queue::init(bool base_instance, bool persistent) {
+    use_base_instance = base_instance;
+    model_stream.init(persistent, GL_RGBA32F);
+    if (use_base_instance)
+        glGenBuffers(1, &id_buffer);
+}
+
+void render_queue::release() {
+    model_stream.release();
+    glDeleteBuffers(1, &id_buffer);
+    id_buffer = 0;
+    id_capacity = 0;
+    id_vaos.clear();
+}
+
+// Ids past the field's range share the last one; those items still draw
+// correctly, they just sort less well.
+unsigned int render_queue::intern(std::map<unsigned int, unsigned int> &ids, unsigned int name,
+                                  unsigned int limit) {
+    std::map<unsigned int, unsigned int>::iterator it = ids.find(name);
+    if (it != ids.end())
+        return it->second;
+    unsigned int id = std::min((unsigned int) ids.size(), limit - 1);
+    ids[name] = id;
+    return id;
+}
+
+uint64_t render_queue::state_key(const draw_item &item) {
+    uint64_t program = intern(program_ids, item.program, 1u << kProgramBits);
+    uint64_t texture = intern(texture_ids, item.texture, 1u << kTextureBits);
+    uint64_t vao = intern(vao_ids, item.vao, 1u << kVaoBits);
+    return (program << (kTextureBits + kVaoBits + kDepthBits)) |
+           (texture << (kVaoBits + kDepthBits)) |
+           (vao << kDepthBits);
+}
+
+static uint64_t depth_key(float depth) {
+    const uint64_t max = (1u << kDepthBits) - 1;
+    if (!(depth > 0.0f)) // also catches NaN
+        return 0;
+    if (depth >= 1.0f)
+        return max;
+    return (uint64_t) (depth * max);
+}
+
+unsigned int render_queue::add(const draw_item &item, float depth) {
+    unsigned int handle;
+    if (!free_slots.empty()) {
+        handle = free_slots.back();
+        free_slots.pop_back();
+    } else {
+        handle = slots.size();
+        slots.push_back(slot());
+    }
+    if (program_ids.find(item.program) == program_ids.end()) {
+        // The sampler only needs setting once per program
+        glUseProgram(item.program);
+        glUniform1i(glGetUniformLocation(item.program, "models"), kModelsUnit);
+    }
+    slots[handle].item = item;
+    slots[handle].key = state_key(item) | depth_key(depth);
+    slots[handle].used = true;
+    slots[handle].visible_frame = 0;
+    dirty = true;
+    models.resize(16 * slots.size());
+    memcpy(&models[16 * handle], item.model, sizeof(item.model));
+    models_dirty = true;
+    if (!item.instanced)
+        prepare(handle);
+    return handle;
+}
+
+// With base instances, makes sure the id buffer reaches 'handle' and the
+// item's VAO reads kItemAttrib from it.
+void render_queue::prepare(unsigned int handle) {
+    if (!use_base_instance)
+        return;
+    if (handle >= id_capacity) {
+        // Same buffer name, so VAOs pointed at it before stay valid
+        id_capacity = std::max<size_t>(2 * id_capacity, std::max<size_t>(handle + 1, 1024));
+        std::vector<unsigned int> ids(id_capacity);
+        for (size_t i = 0; i < ids.size(); i++)
+            ids[i] = i;
+        glBindBuffer(GL_ARRAY_BUFFER, id_buffer);
+        glBufferData(GL_ARRAY_BUFFER, ids.size() * sizeof(unsigned int), &ids[0], GL_STATIC_DRAW);
+    }
+    unsigned int vao = slots[handle].item.vao;
+    if (!id_vaos.insert(vao).second)
+        return;
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, id_buffer);
+    glEnableVertexAttribArray(kItemAttrib);
+    glVertexAttribIPointer(kItemAttrib, 1, GL_UNSIGNED_INT, 0, 0);
+    glVertexAttribDivisor(kItemAttrib, 1);
+    glBindVertexArray(0);
+}
+
+void render_queue::remove(unsigned int handle) {
+    if (handle >= slots.size() || !slots[handle].used)
+        return;
+    slots[handle].used = false;
+    slots[handle].item.draws.clear();
+    free_slots.push_back(handle);
+    dirty = true;
+}
+
+void render_queue::set_depth(unsigned int handle, float depth) {
+    if (handle >= slots.size() || !slots[handle].used)
+        return;
+    const uint64_t depth_mask = (1u << kDepthBits) - 1;
+    uint64_t key = (slots[handle].key & ~depth_mask) | depth_key(depth);
+    if (key != slots[handle].key) {
+        slots[handle].key = key;
+        dirty = true;
+    }
+}
+
+void render_queue::set_model(unsigned int handle, const float *model) {
+    if (handle >= slots.size() || !slots[handle].used)
+        return;
+    memcpy(&models[16 * handle], model, 16 * sizeof(float));
+    models_dirty = true;
+}
+
+void render_queue::set_texture(unsigned int handle, unsigned int texture, unsigned int layer) {
+    if (handle >= slots.size() || !slots[handle].used)
+        return;
+    const uint64_t depth_mask = (1u << kDepthBits) - 1;
+    draw_item &item = slots[handle].item;
+    item.texture = texture;
+    item.layer = layer;
+    slots[handle].key = state_key(item) | (slots[handle].key & depth_mask);
+    dirty = true;
+}
+
+void render_queue::set_lod(unsigned int handle, unsigned int lod) {
+    if (handle < slots.size() && slots[handle].used)
+        slots[handle].item.lod = lod;
+}
+
+void render_queue::set_instance_count(unsigned int handle, unsigned int count) {
+    if (handle < slots.size() && slots[handle].used)
+        slots[handle].item.instance_count = count;
+}
+
+void render_queue::clear() {
+    slots.clear();
+    free_slots.clear();
+    order.clear();
+    dirty = false;
+    models.clear();
+    models_dirty = false;
+}
+
+void render_queue::sort() {
+    order.clear();
+    for (unsigned int i = 0; i < slots.size(); i++) {
+        if (slots[i].used)
+            order.push_back(std::make_pair(slots[i].key, i));
+    }
+    std::sort(order.begin(), order.end());
+    dirty = false;
+}
+
+void render_queue::bind(bound_state &state, unsigned int program, unsigned int vao,
+                        unsigned int texture, unsigned int layer, render_stats &stats) {
+    if (state.first || program != state.program) {
+        glUseProgram(program);
+        state.program = program;
+        stats.state_changes++;
+    } else {
+        stats.state_skipped++;
+    }
+    if (state.first || vao != state.vao) {
+        glBindVertexArray(vao);
+        state.vao = vao;
+        stats.state_changes++;
+    } else {
+        stats.state_skipped++;
+    }
+    if (state.first || texture != state.texture) {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        state.texture = texture;
+        stats.state_changes++;
+    } else {
+        stats.state_skipped++;
+    }
+    // Like the model matrix, the layer is a current attribute value
+    if (state.first || layer != state.layer) {
+        glVertexAttrib1f(kLayerAttrib, (float) layer);
+        state.layer = layer;
+    }
+    state.first = false;
+}
+
+// Records order[begin, end) into 'out'. Only reads the queue, so ranges can
+// be recorded on several threads at once.
+void render_queue::record(size_t begin, size_t end, bool use_visible, command_buffer &out) const {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    out.commands.clear();
+    out.culled = out.instances = out.triangles = 0;
+    for (size_t i = begin; i < end; i++) {
+        const slot &s = slots[order[i].second];
+        if (use_visible && s.visible_frame != frame) {
+            out.culled++;
+            continue;
+        }
+        const draw_item &item = s.item;
+        if (item.instanced && item.instance_count == 0)
+            continue;
+
+        size_t first = 0, last = item.draws.size();
+        if (item.lod + 1 < item.lod_starts.size()) {
+            first = item.lod_starts[item.lod];
+            last = item.lod_starts[item.lod + 1];
+        }
+        unsigned int instances = item.instanced ? item.instance_count : 0;
+        for (size_t d = first; d < last; d++) {
+            const index_range &range = item.draws[d];
+            draw_command command = {item.program, item.vao, item.texture, item.layer,
+                                    item.index_type, range.count, instances, range.base_vertex,
+                                    (size_t) range.first * item.index_size, order[i].second};
+            out.commands.push_back(command);
+            out.triangles += range.count / 3 * (instances ? instances : 1);
+        }
+        out.instances += instances ? instances : 1;
+    }
+    out.record_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Like the layer, kItemAttrib is a current attribute value.
+void render_queue::set_item(bound_state &state, unsigned int item) {
+    if (state.item_set && item == state.item)
+        return;
+    glVertexAttribI1ui(kItemAttrib, item);
+    state.item = item;
+    state.item_set = true;
+}
+
+// Draws 'item' once, with its model matrix.
+void render_queue::draw_one(bound_state &state, unsigned int item, unsigned int index_type,
+                            unsigned int count, size_t offset, int base_vertex) {
+    if (use_base_instance) {
+        glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, count, index_type,
+                                                      (const void *) offset, 1, base_vertex, item);
+        return;
+    }
+    set_item(state, item);
+    glDrawElementsBaseVertex(GL_TRIANGLES, count, index_type, (const void *) offset, base_vertex);
+}
+
+// Copies every model matrix into the next buffer of the stream, if any
+// changed, and binds the current one.
+void render_queue::upload_models() {
+    if (models_dirty && !models.empty()) {
+        size_t bytes = models.size() * sizeof(float);
+        memcpy(model_stream.map(bytes), &models[0], bytes);
+        model_stream.unmap();
+        models_dirty = false;
+    }
+    glActiveTexture(GL_TEXTURE0 + kModelsUnit);
+    glBindTexture(GL_TEXTURE_BUFFER, model_stream.texture());
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void render_queue::replay(const command_buffer &buffer, bound_state &state, render_stats &stats) {
+    for (size_t i = 0; i < buffer.commands.size(); i++) {
+        const draw_command &c = buffer.commands[i];
+        bind(state, c.program, c.vao, c.texture, c.layer, stats);
+        if (c.instances) {
+            set_item(state, kNoItem);
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, c.count, c.index_type,
+                                              (const void *) c.offset, c.instances, c.base_vertex);
+        } else {
+            draw_one(state, c.item, c.index_type, c.count, c.offset, c.base_vertex);
+        }
+        stats.draw_calls++;
+    }
+    stats.culled += buffer.culled;
+    stats.instances += buffer.instances;
+    stats.triangles += buffer.triangles;
+}
+
+void render_queue::draw(const std::vector<unsigned int> *visible, thread_pool *workers) {
+    if (dirty)
+        sort();
+
+    // Mark this frame's visible items rather than sorting the list
+    frame++;
+    if (visible) {
+        for (size_t i = 0; i < visible->size(); i++) {
+            unsigned int handle = (*visible)[i];
+            if (handle < slots.size())
+                slots[handle].visible_frame = frame;
+        }
+    }
+
+    render_stats stats = {0, 0, 0, 0, 0, 0, 0, 0};
+    // Other code (uniform setup, texture loading) binds state behind our
+    // back, so start each frame from nothing bound.
+    bound_state state = {0, 0, 0, 0, 0, true, false};
+    upload_models();
+
+    if (workers) {
+        size_t count = workers->size();
+        size_t grain = (order.size() + count - 1) / count;
+        // One buffer per range with items in it, so that none is left over
+        // from an earlier frame with more items
+        recorded.resize(grain ? (order.size() + grain - 1) / grain : 0);
+        if (recorded.empty()) {
+            glBindVertexArray(0);
+            model_stream.fence();
+            last_stats = stats;
+            return;
+        }
+        workers->parallel_for(order.size(), grain, [&](size_t begin, size_t end) {
+            record(begin, end, visible != nullptr, recorded[begin / grain]);
+        });
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t b = 0; b < recorded.size(); b++) {
+            replay(recorded[b], state, stats);
+            stats.record_seconds = std::max(stats.record_seconds, recorded[b].record_seconds);
+        }
+        stats.replay_seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        glBindVertexArray(0);
+        model_stream.fence();
+        last_stats = stats;
+        return;
+    }
+
+    for (size_t i = 0; i < order.size(); i++) {
+        if (visible && slots[order[i].second].visible_frame != frame) {
+            stats.culled++;
+            continue;
+        }
+        const draw_item &item = slots[order[i].second].item;
+        if (item.instanced && item.instance_count == 0)
+            continue;
+        bind(state, item.program, item.vao, item.texture, item.layer, stats);
+
+        size_t begin = 0, end = item.draws.size();
+        if (item.lod + 1 < item.lod_starts.size()) {
+            begin = item.lod_starts[item.lod];
+            end = item.lod_starts[item.lod + 1];
+        }
+
+        if (item.instanced) {
+            set_item(state, kNoItem);
+            for (size_t d = begin; d < end; d++) {
+                const index_range &range = item.draws[d];
+                glDrawElementsInstancedBaseVertex(GL_TRIANGLES, range.count, item.index_type,
+                                                  (const void *) ((size_t) range.first * item.index_size),
+                                                  item.instance_count, range.base_vertex);
+                stats.draw_calls++;
+                stats.triangles += range.count / 3 * item.instance_count;
+            }
+            stats.instances += item.instance_count;
+            continue;
+        }
+
+        for (size_t d = begin; d < end; d++) {
+            const index_range &range = item.draws[d];
+            draw_one(state, order[i].second, item.index_type, range.count,
+                     (size_t) range.first * item.index_size, range.base_vertex);
+            stats.draw_calls++;
+            stats.triangles += range.count / 3;
+        }
+        stats.instances++;
+    }
+    glBindVertexArray(0);
+    model_stream.fence();
+    last_stats = stats;
+}
@@ -0,0 +1,191 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <map>
+#include <utility>
+#include <vector>
+#include <set>
+#include <stdint.h>
+#include "stream_buffer.h"
+#include "vertex_format.h"
+
+class thread_pool;
+
+// First of the four vec4 vertex attributes that hold the model matrix of
+// instanced items (see shader/vs.txt), fed from a per-instance buffer.
+const unsigned int kModelAttrib = 3;
+
+// Integer vertex attribute holding the item whose model matrix to fetch
+// from the queue's texture buffer, or kNoItem for instanced items.
+const unsigned int kItemAttrib = 7;
+const unsigned int kNoItem = 0xffffffffu;
+
+// Texture unit of the queue's model matrices. The shaders' "models"
+// samplerBuffer reads it.
+const unsigned int kModelsUnit = 2;
+
+// Vertex attribute holding the layer of the texture array to sample, set
+// as a constant per item.
+const unsigned int kLayerAttrib = 8;
+
+// Everything needed to draw one object.
+struct draw_item {
+    unsigned int program;
+    unsigned int vao;
+    unsigned int texture; // a GL_TEXTURE_2D_ARRAY
+    unsigned int layer;
+    unsigned int index_type; // GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    unsigned int index_size; // in bytes
+    std::vector<index_range> draws; // one glDrawElementsBaseVertex each
+    // Levels of detail as in packed_indices; if set, only the ranges of
+    // level 'lod' are drawn
+    std::vector<unsigned int> lod_starts;
+    unsigned int lod;
+
+    // Instanced items draw 'instance_count' copies in one call per range,
+    // each with the matrix from the VAO's instance buffer. Others draw once
+    // with 'model' (column-major, identity by default) as given to add();
+    // set_model() changes the queue's copy, not this one.
+    bool instanced;
+    unsigned int instance_count;
+    float model[16];
+
+    draw_item();
+};
+
+// One draw call, recorded without touching GL so that any thread can
+// record it. Plain data, replayed on the GL thread.
+struct draw_command {
+    unsigned int program, vao, texture, layer;
+    unsigned int index_type;
+    unsigned int count;
+    unsigned int instances; // 0 to draw once with the item's model
+    int base_vertex;
+    size_t offset; // into the element buffer, in bytes
+    unsigned int item; // handle, which selects the model matrix
+};
+
+// The draws one thread recorded for a range of the queue's sorted items.
+struct command_buffer {
+    std::vector<draw_command> commands;
+    unsigned int culled, instances, triangles;
+    double record_seconds;
+};
+
+// State changes made by the last render_queue::draw().
+struct render_stats {
+    unsigned int draw_calls;
+    unsigned int instances;     // objects drawn, counting every instance
+    unsigned int state_changes; // glUseProgram, glBindVertexArray and glBindTexture issued
+    unsigned int state_skipped; // ... skipped because the state was already bound
+    unsigned int culled;        // items left out of the visible list
+    unsigned int triangles;     // submitted, counting every instance
+    double record_seconds;      // with workers: the slowest buffer's recording
+    double replay_seconds;      // ... and replaying all of them
+};
+
+// Draw items kept sorted by a 64-bit key of
+//
+//   program (8 bits) | texture (16 bits) | vao (16 bits) | depth (24 bits)
+//
+// so that objects sharing state are drawn back to back, and front to back
+// within the same state. GL names are mapped to small ids in first-seen
+// order to fit the key. The sorted order is kept across frames and only
+// rebuilt after add(), remove(), set_texture() or a set_depth() that moves
+// an item.
+//
+// The model matrices of items that are not instanced live in one array,
+// indexed by handle. In a frame where any of them changed, the whole array
+// is copied into a stream_buffer, and the shader reads it as a texture
+// buffer. With ARB_base_instance, each item's VAO also gets kItemAttrib from
+// a buffer holding 0, 1, 2, ..., and the draw's base instance selects the
+// handle. Then a draw needs no call but the draw itself. Without it,
+// kItemAttrib's current value is set before each draw.
+class render_queue {
+public:
+    render_queue();
+
+    // Needs a current context, before the first add().
+    void init(bool base_instance, bool persistent);
+    void release();
+
+    // Returns a handle that stays valid until remove(). The other calls
+    // ignore handles that are not valid.
+    unsigned int add(const draw_item &item, float depth = 0.0f);
+    void remove(unsigned int handle);
+
+    // 'depth' is in [0, 1], 0 being nearest; values outside are clamped.
+    void set_depth(unsigned int handle, float depth);
+
+    void set_model(unsigned int handle, const float *model);
+    void set_texture(unsigned int handle, unsigned int texture, unsigned int layer);
+    void set_instance_count(unsigned int handle, unsigned int count);
+    // Picks the item's level of detail; see draw_item::lod_starts.
+    void set_lod(unsigned int handle, unsigned int lod);
+
+    const draw_item &item(unsigned int handle) const { return slots[handle].item; }
+
+    void clear();
+
+    // Issues the draws, skipping state that is already bound. Binds VAO 0
+    // when done. If 'visible' is given, only the items whose handles it
+    // lists are drawn, still in sorted order.
+    //
+    // With 'workers', the sorted items are split into one range per thread
+    // and each thread records its range into a command_buffer. The buffers
+    // are then replayed here, in range order, which keeps the sorted order.
+    void draw(const std::vector<unsigned int> *visible = nullptr, thread_pool *workers = nullptr);
+
+    const render_stats &stats() const { return last_stats; }
+    // The buffers of the last draw() with workers, one per range.
+    const std::vector<command_buffer> &buffers() const { return recorded; }
+
+private:
+    struct slot {
+        draw_item item;
+        uint64_t key;
+        bool used;
+        unsigned int visible_frame; // last draw() that listed it as visible
+    };
+
+    // What is bound during a draw()
+    struct bound_state {
+        unsigned int program, vao, texture, layer;
+        unsigned int item; // kItemAttrib's current value
+        bool first, item_set;
+    };
+
+    unsigned int intern(std::map<unsigned int, unsigned int> &ids, unsigned int name,
+                        unsigned int limit);
+    uint64_t state_key(const draw_item &item);
+    void sort();
+    void bind(bound_state &state, unsigned int program, unsigned int vao, unsigned int texture,
+              unsigned int layer, render_stats &stats);
+    void set_item(bound_state &state, unsigned int item);
+    void draw_one(bound_state &state, unsigned int item, unsigned int index_type,
+                  unsigned int count, size_t offset, int base_vertex);
+    void prepare(unsigned int handle);
+    void upload_models();
+    void record(size_t begin, size_t end, bool use_visible, command_buffer &out) const;
+    void replay(const command_buffer &buffer, bound_state &state, render_stats &stats);
+
+    std::vector<slot> slots;
+    std::vector<unsigned int> free_slots;
+    std::vector<std::pair<uint64_t, unsigned int> > order; // (key, slot), sorted
+    bool dirty;
+    unsigned int frame;
+
+    std::map<unsigned int, unsigned int> program_ids, texture_ids, vao_ids;
+
+    bool use_base_instance;
+    std::vector<float> models; // 16 per slot
+    bool models_dirty;
+    stream_buffer model_stream;
+    unsigned int id_buffer; // 0, 1, 2, ... for kItemAttrib, with base instances
+    size_t id_capacity;
+    std::set<unsigned int> id_vaos; // VAOs given kItemAttrib
+    std::vector<command_buffer> recorded;
+    render_stats last_stats;
+};
+
+#endif // RENDER_QUEUE_H
@@ -0,0 +1,90 @@
+#include "render_target.h"
+
+#include <GL/glew.h>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+render_target::render_target() : fbo(0), color(0), depth(0), w(0), h(0) { }
+
+std::string render_target::init(unsigned int width, unsigned int height) {
+    w = width;
+    h = height;
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        char message[64];
+        snprintf(message, sizeof(message), "Framebuffer incomplete (0x%x)", status);
+        release();
+        return message;
+    }
+    return std::string();
+}
+
+void render_target::release() {
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &color);
+    glDeleteRenderbuffers(1, &depth);
+    fbo = color = depth = 0;
+}
+
+void render_target::bind() {
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, w, h);
+}
+
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    put16(p, v & 0xffff);
+    put16(p + 2, v >> 16);
+}
+
+std::string save_framebuffer(const char *filename, unsigned int width, unsigned int height) {
+    // GL reads bottom row first with rows padded to 4 bytes, which is how
+    // BMP stores them.
+    size_t stride = ((size_t) width * 3 + 3) & ~(size_t) 3;
+    std::vector<unsigned char> pixels(stride * height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, pixels.data());
+
+    // BITMAPFILEHEADER then BITMAPINFOHEADER
+    unsigned char header[54];
+    memset(header, 0, sizeof(header));
+    header[0] = 'B';
+    header[1] = 'M';
+    put32(header + 2, sizeof(header) + pixels.size());
+    put32(header + 10, sizeof(header));
+    put32(header + 14, 40);
+    put32(header + 18, width);
+    put32(header + 22, height);
+    put16(header + 26, 1);
+    put16(header + 28, 24);
+    put32(header + 34, pixels.size());
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+        return std::string("Cannot open file [") + filename + "]";
+    bool ok = fwrite(header, sizeof(header), 1, fp) == 1 &&
+              (pixels.empty() || fwrite(pixels.data(), pixels.size(), 1, fp) == 1);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+        return std::string("Cannot write file [") + filename + "]";
+    return std::string();
+}
@@ -0,0 +1,35 @@
+#ifndef RENDER_TARGET_H
+#define RENDER_TARGET_H
+
+#include <string>
+
+// An offscreen framebuffer: an RGBA8 color and a 24-bit depth renderbuffer.
+// Headless runs draw into it instead of the window, which stays hidden and
+// is never swapped, so nothing waits on a display.
+class render_target {
+public:
+    render_target();
+
+    // Needs a current context. Returns an empty string on success.
+    std::string init(unsigned int width, unsigned int height);
+    void release();
+
+    // Makes it the framebuffer drawn to and read from, viewport included.
+    void bind();
+
+    unsigned int width() const { return w; }
+    unsigned int height() const { return h; }
+
+private:
+    render_target(const render_target &);
+    render_target &operator=(const render_target &);
+
+    unsigned int fbo, color, depth;
+    unsigned int w, h;
+};
+
+// Writes the bound read framebuffer's bottom-left 'width' x 'height' pixels
+// to 'filename' as a 24-bit BMP. Returns an empty string on success.
+std::string save_framebuffer(const char *filename, unsigned int width, unsigned int height);
+
+#endif // RENDER_TARGET_H
@@ -0,0 +1,299 @@
+#include "scene_graph.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCENE_GRAPH_X86 1
+#include <immintrin.h>
+#endif
+
+// Locals are built this many at a time, so they stay in L1 until multiplied.
+static const size_t kChunk = 256;
+
+typedef void (*multiply_fn)(float *worlds, const unsigned int *parents, const unsigned int *slots,
+                            const float *locals, size_t count);
+
+// world[slot] = world[parent] * local, column-major, for each slot
+static void multiply_scalar(float *worlds, const unsigned int *parents, const unsigned int *slots,
+                            const float *locals, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const float *a = worlds + 16 * (size_t) parents[slots[i]];
+        const float *b = locals + 16 * i;
+        float *out = worlds + 16 * (size_t) slots[i];
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++)
+                out[4 * c + r] = a[r] * b[4 * c] + a[4 + r] * b[4 * c + 1] +
+                                 a[8 + r] * b[4 * c + 2] + a[12 + r] * b[4 * c + 3];
+        }
+    }
+}
+
+#ifdef SCENE_GRAPH_X86
+// One output column per step: the four columns of 'a' scaled by the
+// column's elements of 'b'.
+__attribute__((target("sse2")))
+static void multiply_sse(float *worlds, const unsigned int *parents, const unsigned int *slots,
+                         const float *locals, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const float *a = worlds + 16 * (size_t) parents[slots[i]];
+        const float *b = locals + 16 * i;
+        float *out = worlds + 16 * (size_t) slots[i];
+        __m128 a0 = _mm_loadu_ps(a), a1 = _mm_loadu_ps(a + 4);
+        __m128 a2 = _mm_loadu_ps(a + 8), a3 = _mm_loadu_ps(a + 12);
+        for (int c = 0; c < 4; c++) {
+            __m128 col = _mm_loadu_ps(b + 4 * c);
+            __m128 r = _mm_mul_ps(a0, _mm_shuffle_ps(col, col, 0x00));
+            r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_shuffle_ps(col, col, 0x55)));
+            r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_shuffle_ps(col, col, 0xaa)));
+            r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_shuffle_ps(col, col, 0xff)));
+            _mm_storeu_ps(out + 4 * c, r);
+        }
+    }
+}
+
+// Two output columns per step: each 128-bit half holds one.
+__attribute__((target("avx2,fma")))
+static void multiply_avx2(float *worlds, const unsigned int *parents, const unsigned int *slots,
+                          const float *locals, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const float *a = worlds + 16 * (size_t) parents[slots[i]];
+        const float *b = locals + 16 * i;
+        float *out = worlds + 16 * (size_t) slots[i];
+        __m256 a0 = _mm256_broadcast_ps((const __m128 *) a);
+        __m256 a1 = _mm256_broadcast_ps((const __m128 *) (a + 4));
+        __m256 a2 = _mm256_broadcast_ps((const __m128 *) (a + 8));
+        __m256 a3 = _mm256_broadcast_ps((const __m128 *) (a + 12));
+        for (int c = 0; c < 16; c += 8) {
+            __m256 cols = _mm256_loadu_ps(b + c);
+            __m256 r = _mm256_mul_ps(a0, _mm256_shuffle_ps(cols, cols, 0x00));
+            r = _mm256_fmadd_ps(a1, _mm256_shuffle_ps(cols, cols, 0x55), r);
+            r = _mm256_fmadd_ps(a2, _mm256_shuffle_ps(cols, cols, 0xaa), r);
+            r = _mm256_fmadd_ps(a3, _mm256_shuffle_ps(cols, cols, 0xff), r);
+            _mm256_storeu_ps(out + c, r);
+        }
+    }
+}
+#endif
+
+simd_level best_simd_level() {
+#ifdef SCENE_GRAPH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE;
+#endif
+    return SIMD_SCALAR;
+}
+
+const char *simd_name(simd_level level) {
+    switch (level) {
+    case SIMD_AVX2:
+        return "avx2";
+    case SIMD_SSE:
+        return "sse";
+    default:
+        return "scalar";
+    }
+}
+
+static multiply_fn multiply_for(simd_level level) {
+#ifdef SCENE_GRAPH_X86
+    if (level == SIMD_AVX2)
+        return multiply_avx2;
+    if (level == SIMD_SSE)
+        return multiply_sse;
+#endif
+    return multiply_scalar;
+}
+
+scene_graph::scene_graph()
+    : order_dirty(false), dirty_count(0), simd(best_simd_level()) {
+    level_start.push_back(0);
+}
+
+void scene_graph::set_simd(simd_level level) {
+    simd_level best = best_simd_level();
+    simd = level < best ? level : best;
+}
+
+unsigned int scene_graph::add(unsigned int parent) {
+    unsigned int node = slot_of.size();
+    unsigned int slot = parents.size();
+    slot_of.push_back(slot);
+    parent_of.push_back(parent);
+    depths.push_back(parent == kNone ? 0 : depths[parent] + 1);
+
+    static const float identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    handle_of.push_back(node);
+    parents.push_back(parent);
+    if (parent != kNone)
+        parents.back() = slot_of[parent];
+    tx.push_back(0);
+    ty.push_back(0);
+    tz.push_back(0);
+    qx.push_back(0);
+    qy.push_back(0);
+    qz.push_back(0);
+    qw.push_back(1);
+    sx.push_back(1);
+    sy.push_back(1);
+    sz.push_back(1);
+    worlds.insert(worlds.end(), identity, identity + 16);
+    dirty_flags.push_back(0);
+    changed_flags.push_back(0);
+    touch(slot);
+    order_dirty = true;
+    return node;
+}
+
+void scene_graph::touch(unsigned int slot) {
+    if (!dirty_flags[slot]) {
+        dirty_flags[slot] = 1;
+        dirty_count++;
+    }
+}
+
+void scene_graph::set_translation(unsigned int node, float x, float y, float z) {
+    unsigned int s = slot_of[node];
+    tx[s] = x;
+    ty[s] = y;
+    tz[s] = z;
+    touch(s);
+}
+
+void scene_graph::set_rotation(unsigned int node, float angle, float x, float y, float z) {
+    unsigned int s = slot_of[node];
+    float sine = std::sin(angle * 0.5f);
+    qx[s] = x * sine;
+    qy[s] = y * sine;
+    qz[s] = z * sine;
+    qw[s] = std::cos(angle * 0.5f);
+    touch(s);
+}
+
+void scene_graph::set_scale(unsigned int node, float x, float y, float z) {
+    unsigned int s = slot_of[node];
+    sx[s] = x;
+    sy[s] = y;
+    sz[s] = z;
+    touch(s);
+}
+
+namespace {
+template <typename T>
+void permute(std::vector<T> &v, const std::vector<unsigned int> &from, size_t width = 1) {
+    std::vector<T> out(v.size());
+    for (size_t i = 0; i < from.size(); i++)
+        memcpy(&out[width * i], &v[width * from[i]], width * sizeof(T));
+    v.swap(out);
+}
+}
+
+// Stable counting sort of the slots by depth.
+void scene_graph::sort_by_depth() {
+    size_t n = parents.size();
+    unsigned int levels = 0;
+    for (size_t h = 0; h < n; h++) {
+        if (depths[h] + 1 > levels)
+            levels = depths[h] + 1;
+    }
+    level_start.assign(levels + 1, 0);
+    for (size_t s = 0; s < n; s++)
+        level_start[depths[handle_of[s]] + 1]++;
+    for (unsigned int d = 0; d < levels; d++)
+        level_start[d + 1] += level_start[d];
+
+    std::vector<unsigned int> next(level_start.begin(), level_start.end() - 1);
+    std::vector<unsigned int> from(n); // new slot -> old slot
+    for (size_t s = 0; s < n; s++)
+        from[next[depths[handle_of[s]]]++] = s;
+
+    permute(handle_of, from);
+    for (size_t s = 0; s < n; s++)
+        slot_of[handle_of[s]] = s;
+    for (size_t s = 0; s < n; s++) {
+        unsigned int parent = parent_of[handle_of[s]];
+        parents[s] = parent != kNone ? slot_of[parent] : parent;
+    }
+    permute(tx, from);
+    permute(ty, from);
+    permute(tz, from);
+    permute(qx, from);
+    permute(qy, from);
+    permute(qz, from);
+    permute(qw, from);
+    permute(sx, from);
+    permute(sy, from);
+    permute(sz, from);
+    permute(worlds, from, 16);
+    permute(dirty_flags, from);
+    permute(changed_flags, from);
+    order_dirty = false;
+}
+
+// Local matrix T * R * S of each slot, column-major.
+void scene_graph::build_locals(const unsigned int *slots, size_t count, float *out) const {
+    for (size_t i = 0; i < count; i++, out += 16) {
+        unsigned int s = slots[i];
+        float x = qx[s], y = qy[s], z = qz[s], w = qw[s];
+        out[0] = (1 - 2 * (y * y + z * z)) * sx[s];
+        out[1] = 2 * (x * y + z * w) * sx[s];
+        out[2] = 2 * (x * z - y * w) * sx[s];
+        out[3] = 0;
+        out[4] = 2 * (x * y - z * w) * sy[s];
+        out[5] = (1 - 2 * (x * x + z * z)) * sy[s];
+        out[6] = 2 * (y * z + x * w) * sy[s];
+        out[7] = 0;
+        out[8] = 2 * (x * z + y * w) * sz[s];
+        out[9] = 2 * (y * z - x * w) * sz[s];
+        out[10] = (1 - 2 * (x * x + y * y)) * sz[s];
+        out[11] = 0;
+        out[12] = tx[s];
+        out[13] = ty[s];
+        out[14] = tz[s];
+        out[15] = 1;
+    }
+}
+
+void scene_graph::update() {
+    for (size_t i = 0; i < updated.size(); i++)
+        changed_flags[updated[i]] = 0;
+    updated.clear();
+    if (order_dirty)
+        sort_by_depth();
+    if (dirty_count == 0)
+        return;
+
+    multiply_fn multiply = multiply_for(simd);
+    locals.resize(16 * kChunk);
+    for (size_t d = 0; d + 1 < level_start.size(); d++) {
+        // Changed nodes and the children of nodes changed a level up
+        batch.clear();
+        for (unsigned int s = level_start[d]; s < level_start[d + 1]; s++) {
+            unsigned int p = parents[s];
+            if (dirty_flags[s] || (p != kNone && changed_flags[p]))
+                batch.push_back(s);
+        }
+
+        for (size_t i = 0; i < batch.size(); i += kChunk) {
+            size_t count = batch.size() - i < kChunk ? batch.size() - i : kChunk;
+            build_locals(&batch[i], count, &locals[0]);
+            if (d == 0) {
+                // Only roots are at depth 0
+                for (size_t j = 0; j < count; j++)
+                    memcpy(&worlds[16 * (size_t) batch[i + j]], &locals[16 * j], 16 * sizeof(float));
+            } else {
+                multiply(&worlds[0], &parents[0], &batch[i], &locals[0], count);
+            }
+        }
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            dirty_flags[batch[i]] = 0;
+            changed_flags[batch[i]] = 1;
+        }
+        updated.insert(updated.end(), batch.begin(), batch.end());
+    }
+    dirty_count = 0;
+}
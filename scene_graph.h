@@ -0,0 +1,86 @@
+#ifndef SCENE_GRAPH_H
+#define SCENE_GRAPH_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Instruction sets scene_graph::update() can multiply matrices with.
+enum simd_level {
+    SIMD_SCALAR,
+    SIMD_SSE,
+    SIMD_AVX2 // with FMA
+};
+
+// The best level this CPU runs. AVX2 is only detected with GCC or Clang on
+// x86; SSE is assumed on x86-64.
+simd_level best_simd_level();
+const char *simd_name(simd_level level);
+
+// A transform hierarchy kept as structure of arrays: parent, local
+// translation / rotation / scale and world matrix per node.
+//
+// Nodes are stored sorted by depth, so every parent comes before its
+// children and each level of the tree is one contiguous run whose parents
+// are all done when it is reached. update() recomputes only nodes whose
+// local transform changed and their descendants, level by level, in
+// batches of world = parent world * local.
+//
+// Handles stay valid as nodes are added; adding re-sorts the storage on
+// the next update().
+class scene_graph {
+public:
+    static const unsigned int kNone = ~0u;
+
+    scene_graph();
+
+    // Adds a node with the identity transform under 'parent', or as a root
+    // if it is kNone. The parent must exist already.
+    unsigned int add(unsigned int parent = kNone);
+
+    void set_translation(unsigned int node, float x, float y, float z);
+    // 'angle' radians about the unit vector (x, y, z).
+    void set_rotation(unsigned int node, float angle, float x, float y, float z);
+    void set_scale(unsigned int node, float x, float y, float z);
+
+    void update();
+
+    // Column-major, as of the last update().
+    const float *world(unsigned int node) const { return &worlds[16 * slot_of[node]]; }
+    // True if the last update() recomputed 'node'.
+    bool changed(unsigned int node) const { return changed_flags[slot_of[node]] != 0; }
+
+    size_t size() const { return parents.size(); }
+    // Nodes the last update() recomputed.
+    size_t last_updated() const { return updated.size(); }
+
+    // Defaults to best_simd_level(); lower levels are for comparison, and
+    // higher ones are lowered to it.
+    void set_simd(simd_level level);
+
+private:
+    void touch(unsigned int slot);
+    void sort_by_depth();
+    void build_locals(const unsigned int *slots, size_t count, float *out) const;
+
+    // By handle
+    std::vector<unsigned int> slot_of, parent_of, depths;
+
+    // By slot: sorted by depth, level d spanning [level_start[d], level_start[d + 1])
+    std::vector<unsigned int> handle_of, parents; // parents as slots, kNone for roots
+    std::vector<float> tx, ty, tz;                // translation
+    std::vector<float> qx, qy, qz, qw;            // rotation quaternion
+    std::vector<float> sx, sy, sz;                // scale
+    std::vector<float> worlds;                    // 16 per node
+    std::vector<uint8_t> dirty_flags, changed_flags;
+    std::vector<unsigned int> level_start;
+
+    std::vector<unsigned int> updated; // slots of changed_flags set
+    std::vector<unsigned int> batch;
+    std::vector<float> locals;
+    bool order_dirty;
+    size_t dirty_count;
+    simd_level simd;
+};
+
+#endif // SCENE_GRAPH_H
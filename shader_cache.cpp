@@ -0,0 +1,275 @@
+#include "shader_cache.h"
+
+#include <GL/glew.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// program_<hash>.bin layout (native byte order): binary_header, then
+// 'length' bytes from glGetProgramBinary. Bump kBinaryVersion whenever the
+// layout or the key changes; files with another version are compiled again.
+static const uint32_t kBinaryMagic = 0x42475250; // "PRGB"
+static const uint32_t kBinaryVersion = 1;
+
+struct binary_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t format; // for glProgramBinary
+    uint32_t length;
+};
+
+// 64-bit FNV-1a, continuing from 'h'.
+static uint64_t hash_string(uint64_t h, const std::string &text) {
+    const uint64_t prime = 0x100000001b3ULL;
+    for (size_t i = 0; i < text.size(); i++)
+        h = (h ^ (unsigned char) text[i]) * prime;
+    // Ends every string, so "ab" + "c" and "a" + "bc" differ
+    return (h ^ 0xff) * prime;
+}
+
+static const uint64_t kHashSeed = 0xcbf29ce484222325ULL;
+
+static bool read_text(const char *filename, std::string &text) {
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs)
+        return false;
+    text.assign((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// 'source' with 'defines' after its #version line, which must stay first.
+static std::string with_defines(const std::string &source, const std::string &defines) {
+    if (defines.empty())
+        return source;
+    size_t line_end = 0;
+    if (source.compare(0, 8, "#version") == 0) {
+        line_end = source.find('\n');
+        line_end = line_end == std::string::npos ? source.size() : line_end + 1;
+    }
+    std::string text = source.substr(0, line_end) + defines;
+    if (defines[defines.size() - 1] != '\n')
+        text += '\n';
+    return text + source.substr(line_end);
+}
+
+static std::string info_log(unsigned int object, bool program) {
+    GLint length = 0;
+    if (program)
+        glGetProgramiv(object, GL_INFO_LOG_LENGTH, &length);
+    else
+        glGetShaderiv(object, GL_INFO_LOG_LENGTH, &length);
+    // The length includes the NUL character
+    std::vector<char> log(length > 0 ? length : 1, '\0');
+    if (program)
+        glGetProgramInfoLog(object, log.size(), nullptr, &log[0]);
+    else
+        glGetShaderInfoLog(object, log.size(), nullptr, &log[0]);
+    return std::string(&log[0]);
+}
+
+static unsigned int compile(unsigned int type, const std::string &source, std::string &error) {
+    GLuint shader = glCreateShader(type);
+    const GLchar *text = source.c_str();
+    glShaderSource(shader, 1, &text, nullptr);
+    glCompileShader(shader);
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status == GL_FALSE) {
+        error = (type == GL_VERTEX_SHADER ? "Vertex Shader Error: " : "Fragment Shader Error: ") +
+                info_log(shader, false);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static unsigned int link(const std::string &vertex, const std::string &fragment, bool retrievable,
+                         std::string &error) {
+    GLuint vs = compile(GL_VERTEX_SHADER, vertex, error);
+    if (!vs)
+        return 0;
+    GLuint fs = compile(GL_FRAGMENT_SHADER, fragment, error);
+    if (!fs) {
+        glDeleteShader(vs);
+        return 0;
+    }
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    if (retrievable)
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+    // The program keeps what it needs; the shaders go with it
+    glDetachShader(program, vs);
+    glDetachShader(program, fs);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE) {
+        error = "Link Error: " + info_log(program, true);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+program_cache::program_cache() : driver(kHashSeed) {
+    totals.requests = 0;
+    totals.programs = 0;
+    totals.from_disk = 0;
+    totals.seconds = 0;
+}
+
+void program_cache::init(const std::string &directory) {
+    dir.clear();
+    const char *names[3] = {(const char *) glGetString(GL_VENDOR),
+                            (const char *) glGetString(GL_RENDERER),
+                            (const char *) glGetString(GL_VERSION)};
+    driver = kHashSeed;
+    for (int i = 0; i < 3; i++)
+        driver = hash_string(driver, names[i] ? names[i] : "");
+    // Some drivers expose the extension with no formats to save in
+    GLint formats = 0;
+    if (GLEW_ARB_get_program_binary)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats > 0)
+        dir = directory;
+}
+
+unsigned int program_cache::acquire(const char *vertex_file, const char *fragment_file,
+                                    const std::string &defines, std::string &error) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    totals.requests++;
+    unsigned int program = 0;
+    std::string vertex, fragment;
+    if (!read_text(vertex_file, vertex))
+        error = std::string("Cannot open file [") + vertex_file + "]";
+    else if (!read_text(fragment_file, fragment))
+        error = std::string("Cannot open file [") + fragment_file + "]";
+    else {
+        uint64_t key = hash_string(hash_string(hash_string(kHashSeed, vertex), fragment), defines);
+        std::map<uint64_t, entry>::iterator it = by_key.find(key);
+        if (it != by_key.end()) {
+            it->second.references++;
+            program = it->second.program;
+        } else {
+            std::string path;
+            if (!dir.empty()) {
+                char name[40];
+                snprintf(name, sizeof(name), "/program_%016llx.bin",
+                         (unsigned long long) (key ^ driver));
+                path = dir + name;
+                program = load_binary(path, key);
+            }
+            if (program) {
+                totals.from_disk++;
+            } else {
+                program = link(with_defines(vertex, defines), with_defines(fragment, defines),
+                               !path.empty(), error);
+                if (program && !path.empty())
+                    save_binary(path, key, program);
+            }
+            if (program) {
+                entry e = {program, 1};
+                by_key[key] = e;
+                by_program[program] = key;
+                totals.programs++;
+            }
+        }
+    }
+    totals.seconds +=
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return program;
+}
+
+void program_cache::release(unsigned int program) {
+    std::map<unsigned int, uint64_t>::iterator it = by_program.find(program);
+    if (it == by_program.end())
+        return;
+    std::map<uint64_t, entry>::iterator e = by_key.find(it->second);
+    if (--e->second.references > 0)
+        return;
+    glDeleteProgram(program);
+    by_key.erase(e);
+    by_program.erase(it);
+}
+
+void program_cache::clear() {
+    for (std::map<unsigned int, uint64_t>::iterator it = by_program.begin();
+         it != by_program.end(); ++it)
+        glDeleteProgram(it->first);
+    by_key.clear();
+    by_program.clear();
+}
+
+// Returns 0 if there is no usable binary at 'path'.
+unsigned int program_cache::load_binary(const std::string &path, uint64_t key) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return 0;
+    binary_header header;
+    std::vector<char> data;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 && header.magic == kBinaryMagic &&
+              header.version == kBinaryVersion && header.key == key && header.length > 0;
+    if (ok) {
+        data.resize(header.length);
+        ok = fread(&data[0], 1, data.size(), fp) == data.size();
+    }
+    fclose(fp);
+    if (!ok)
+        return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.format, &data[0], data.size());
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE) {
+        // Saved by another driver build; compiled and saved again
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Best effort: a binary that cannot be saved only costs the next start.
+void program_cache::save_binary(const std::string &path, uint64_t key, unsigned int program) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    std::vector<char> data(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, &data[0]);
+    if (length <= 0)
+        return;
+    binary_header header = {kBinaryMagic, kBinaryVersion, key, format, (uint32_t) length};
+
+    // Write to a temporary file and rename it, so that a crash or a second
+    // instance never leaves a truncated binary behind.
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp%d", pid);
+    std::string tmp = path + suffix;
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+        return;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(&data[0], 1, length, fp) == (size_t) length;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+        remove(tmp.c_str());
+}
@@ -0,0 +1,65 @@
+#ifndef SHADER_CACHE_H
+#define SHADER_CACHE_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+// Running totals, for reporting what the cache saved.
+struct shader_cache_stats {
+    unsigned int requests;  // acquire() calls
+    unsigned int programs;  // programs actually made
+    unsigned int from_disk; // of those, loaded from a saved binary
+    double seconds;         // spent in acquire(), reading the sources included
+};
+
+// Shares linked GL programs. A program is keyed by a hash of its vertex and
+// fragment sources and the #defines put in front of them, so asking twice
+// for the same shaders returns the same program. Programs are reference
+// counted and deleted when the last user releases them.
+//
+// With a directory given to init() and GL_ARB_get_program_binary, every
+// linked program is also saved there as <dir>/program_<hash>.bin. Later runs
+// load the binary instead of compiling. The file name also hashes the GL
+// vendor, renderer and version, and a binary the driver rejects is
+// compiled again and overwritten, so a driver update only costs one cold
+// start.
+class program_cache {
+public:
+    program_cache();
+
+    // 'dir' empty keeps binaries in memory only. Needs a current context.
+    void init(const std::string &dir);
+
+    // The program of the two shader files, each with 'defines' inserted
+    // after its #version line. Returns 0 and fills 'error' on failure.
+    unsigned int acquire(const char *vertex_file, const char *fragment_file,
+                         const std::string &defines, std::string &error);
+    // Drops one reference to 'program', deleting it after the last.
+    void release(unsigned int program);
+    // Deletes every program, referenced or not.
+    void clear();
+
+    bool saves_binaries() const { return !dir.empty(); }
+    const shader_cache_stats &stats() const { return totals; }
+
+private:
+    struct entry {
+        unsigned int program;
+        unsigned int references;
+    };
+
+    program_cache(const program_cache &);
+    program_cache &operator=(const program_cache &);
+
+    unsigned int load_binary(const std::string &path, uint64_t key);
+    void save_binary(const std::string &path, uint64_t key, unsigned int program);
+
+    std::string dir;
+    uint64_t driver; // hash of GL_VENDOR, GL_RENDERER and GL_VERSION
+    std::map<uint64_t, entry> by_key;
+    std::map<unsigned int, uint64_t> by_program;
+    shader_cache_stats totals;
+};
+
+#endif // SHADER_CACHE_H
@@ -0,0 +1,166 @@
+#include "simulation.h"
+
+#include <cmath>
+
+pose decompose_pose(const float *m) {
+    pose p;
+    for (int k = 0; k < 3; k++) {
+        p.t[k] = m[12 + k];
+        p.s[k] = std::sqrt(m[4 * k] * m[4 * k] + m[4 * k + 1] * m[4 * k + 1] + m[4 * k + 2] * m[4 * k + 2]);
+    }
+    // Rotation r[column][row], scale divided out
+    float r[3][3];
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < 3; k++)
+            r[c][k] = p.s[c] > 0 ? m[4 * c + k] / p.s[c] : (c == k);
+    }
+    // Largest of w, x, y, z first, for precision
+    float trace = r[0][0] + r[1][1] + r[2][2];
+    if (trace > 0) {
+        float s = 2 * std::sqrt(1 + trace);
+        p.q[3] = 0.25f * s;
+        p.q[0] = (r[1][2] - r[2][1]) / s;
+        p.q[1] = (r[2][0] - r[0][2]) / s;
+        p.q[2] = (r[0][1] - r[1][0]) / s;
+    } else if (r[0][0] > r[1][1] && r[0][0] > r[2][2]) {
+        float s = 2 * std::sqrt(1 + r[0][0] - r[1][1] - r[2][2]);
+        p.q[3] = (r[1][2] - r[2][1]) / s;
+        p.q[0] = 0.25f * s;
+        p.q[1] = (r[1][0] + r[0][1]) / s;
+        p.q[2] = (r[2][0] + r[0][2]) / s;
+    } else if (r[1][1] > r[2][2]) {
+        float s = 2 * std::sqrt(1 + r[1][1] - r[0][0] - r[2][2]);
+        p.q[3] = (r[2][0] - r[0][2]) / s;
+        p.q[0] = (r[1][0] + r[0][1]) / s;
+        p.q[1] = 0.25f * s;
+        p.q[2] = (r[2][1] + r[1][2]) / s;
+    } else {
+        float s = 2 * std::sqrt(1 + r[2][2] - r[0][0] - r[1][1]);
+        p.q[3] = (r[0][1] - r[1][0]) / s;
+        p.q[0] = (r[2][0] + r[0][2]) / s;
+        p.q[1] = (r[2][1] + r[1][2]) / s;
+        p.q[2] = 0.25f * s;
+    }
+    return p;
+}
+
+void compose_pose(const pose &p, float *m) {
+    float x = p.q[0], y = p.q[1], z = p.q[2], w = p.q[3];
+    float r[3][3] = {{1 - 2 * (y * y + z * z), 2 * (x * y + z * w), 2 * (x * z - y * w)},
+                     {2 * (x * y - z * w), 1 - 2 * (x * x + z * z), 2 * (y * z + x * w)},
+                     {2 * (x * z + y * w), 2 * (y * z - x * w), 1 - 2 * (x * x + y * y)}};
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < 3; k++)
+            m[4 * c + k] = r[c][k] * p.s[c];
+        m[4 * c + 3] = 0;
+    }
+    m[12] = p.t[0];
+    m[13] = p.t[1];
+    m[14] = p.t[2];
+    m[15] = 1;
+}
+
+pose interpolate_pose(const pose &a, const pose &b, float alpha) {
+    pose p;
+    for (int k = 0; k < 3; k++) {
+        p.t[k] = a.t[k] + (b.t[k] - a.t[k]) * alpha;
+        p.s[k] = a.s[k] + (b.s[k] - a.s[k]) * alpha;
+    }
+    // q and -q are the same rotation; take the nearer one
+    float dot = a.q[0] * b.q[0] + a.q[1] * b.q[1] + a.q[2] * b.q[2] + a.q[3] * b.q[3];
+    float sign = dot < 0 ? -1.0f : 1.0f;
+    float length = 0;
+    for (int k = 0; k < 4; k++) {
+        p.q[k] = a.q[k] + (sign * b.q[k] - a.q[k]) * alpha;
+        length += p.q[k] * p.q[k];
+    }
+    length = std::sqrt(length);
+    for (int k = 0; k < 4; k++)
+        p.q[k] = length > 0 ? p.q[k] / length : (k == 3);
+    return p;
+}
+
+simulation::simulation(double step)
+    : step_seconds(step), count(0), stopping(false), have_snapshot(false), tick_count(0),
+      resync_count(0), last_tick_seconds(0) { }
+
+simulation::~simulation() {
+    stop();
+}
+
+double simulation::seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - origin).count();
+}
+
+void simulation::start(size_t objects, const update_fn &fn) {
+    stop();
+    count = objects;
+    update = fn;
+    have_snapshot = false;
+    stopping = false;
+    origin = std::chrono::steady_clock::now();
+    worker = std::thread(&simulation::run, this);
+}
+
+void simulation::stop() {
+    if (!worker.joinable())
+        return;
+    stopping = true;
+    worker.join();
+}
+
+void simulation::run() {
+    std::vector<float> worlds(16 * count);
+    std::vector<pose> previous, current(count);
+    unsigned long long tick = 0;
+    while (!stopping) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        update(tick * step_seconds, worlds);
+        previous.swap(current);
+        current.resize(count);
+        for (size_t i = 0; i < count; i++)
+            current[i] = decompose_pose(&worlds[16 * i]);
+        if (tick == 0)
+            previous = current;
+
+        sim_snapshot &snapshot = snapshots.write_slot();
+        snapshot.tick = tick;
+        snapshot.previous = previous;
+        snapshot.current = current;
+        snapshots.publish();
+        tick_count++;
+        last_tick_seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        // Tick k is due at k steps after start. Far behind, skip ahead
+        // rather than spin through the backlog.
+        tick++;
+        double due = tick * step_seconds, now = seconds();
+        if (now - due > kMaxBehind * step_seconds) {
+            tick = (unsigned long long) (now / step_seconds);
+            resync_count++;
+        } else if (due > now) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(due - now));
+        }
+    }
+}
+
+bool simulation::sample(std::vector<float> &worlds) {
+    have_snapshot = snapshots.take() || have_snapshot;
+    if (!have_snapshot)
+        return false;
+    const sim_snapshot &snapshot = snapshots.read_slot();
+    // Between the last two ticks, one step behind the clock
+    double alpha = (seconds() - snapshot.tick * step_seconds) / step_seconds;
+    alpha = alpha < 0 ? 0 : alpha > 1 ? 1 : alpha;
+    worlds.resize(16 * snapshot.current.size());
+    for (size_t i = 0; i < snapshot.current.size(); i++)
+        compose_pose(interpolate_pose(snapshot.previous[i], snapshot.current[i], (float) alpha),
+                     &worlds[16 * i]);
+    return true;
+}
+
+sim_stats simulation::stats() const {
+    sim_stats s = {tick_count, resync_count, last_tick_seconds};
+    return s;
+}
@@ -0,0 +1,115 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Hands the latest value from one writer thread to one reader thread
+// without locks. Of the three slots, the writer fills one and the reader
+// holds one; the third is the latest published, swapped in by either side
+// with one atomic exchange. Neither side ever waits, and the reader may
+// skip values the writer published in between.
+template <class T>
+class triple_buffer {
+public:
+    triple_buffer() : back(0), front(1), middle(2) { }
+
+    // The writer's slot; publish() hands it over.
+    T &write_slot() { return slots[back]; }
+    void publish() { back = middle.exchange(back | kFresh) & kIndex; }
+
+    // Takes the latest published value, if newer than read_slot().
+    bool take() {
+        if (!(middle.load() & kFresh))
+            return false;
+        front = middle.exchange(front) & kIndex;
+        return true;
+    }
+    const T &read_slot() const { return slots[front]; }
+
+private:
+    static const unsigned int kIndex = 3, kFresh = 4;
+
+    T slots[3];
+    unsigned int back, front;     // owned by the writer and the reader
+    std::atomic<unsigned int> middle; // slot index, with kFresh once published
+};
+
+// Translation, rotation (unit quaternion x, y, z, w) and scale of a
+// column-major matrix without shear.
+struct pose {
+    float t[3];
+    float q[4];
+    float s[3];
+};
+
+pose decompose_pose(const float *m);
+void compose_pose(const pose &p, float *m);
+// 'a' to 'b' at 'alpha' in [0, 1]; rotations are normalized lerps.
+pose interpolate_pose(const pose &a, const pose &b, float alpha);
+
+// The poses of the simulated objects at one tick and the tick before.
+struct sim_snapshot {
+    unsigned long long tick;
+    std::vector<pose> previous, current;
+};
+
+// Counters since start().
+struct sim_stats {
+    unsigned long long ticks;
+    unsigned long long resyncs; // times the thread fell kMaxBehind ticks behind and skipped ahead
+    double tick_seconds;        // of the last tick's work
+};
+
+// Runs a simulation at a fixed step on its own thread. Every tick calls
+// 'update' with the simulated time, which fills one column-major matrix
+// per object. The poses of that tick and the one before are published
+// through a triple_buffer. The render thread then calls sample(), which
+// interpolates to its own time, at most one step behind. A slow frame
+// never holds up the simulation, and a slow tick never holds up a frame.
+class simulation {
+public:
+    // Ticks behind the clock before the simulation gives up catching up
+    static const unsigned int kMaxBehind = 8;
+
+    // 'update(time, worlds)' runs on the simulation thread, which must be
+    // the only one touching what it reads.
+    typedef std::function<void(double, std::vector<float> &)> update_fn;
+
+    explicit simulation(double step);
+    ~simulation();
+
+    void start(size_t objects, const update_fn &update);
+    void stop();
+
+    // Fills 'worlds' with 16 floats per object, interpolated to now.
+    // False until the first tick is published.
+    bool sample(std::vector<float> &worlds);
+
+    double step() const { return step_seconds; }
+    sim_stats stats() const;
+
+private:
+    simulation(const simulation &);
+    simulation &operator=(const simulation &);
+
+    void run();
+    double seconds() const;
+
+    double step_seconds;
+    size_t count;
+    update_fn update;
+    std::chrono::steady_clock::time_point origin;
+    std::thread worker;
+    std::atomic<bool> stopping;
+    triple_buffer<sim_snapshot> snapshots;
+    bool have_snapshot; // reader side
+
+    std::atomic<unsigned long long> tick_count, resync_count;
+    std::atomic<double> last_tick_seconds;
+};
+
+#endif // SIMULATION_H
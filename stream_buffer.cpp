@@ -0,0 +1,121 @@
+#include "stream_buffer.h"
+
+#include <GL/glew.h>
+
+static const size_t kInitialCapacity = 64 * 1024;
+static const GLbitfield kPersistentFlags =
+    GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+stream_buffer::stream_buffer()
+    : current(0), capacity(0), use_persistent(false), format(0) {
+    for (unsigned int i = 0; i < kRegions; i++) {
+        regions[i].buffer = regions[i].texture = 0;
+        regions[i].data = regions[i].sync = nullptr;
+    }
+    totals.maps = totals.waits = totals.grows = 0;
+}
+
+void stream_buffer::init(bool persistent, unsigned int texture_format) {
+    use_persistent = persistent;
+    format = texture_format;
+    capacity = kInitialCapacity;
+    for (unsigned int i = 0; i < kRegions; i++) {
+        if (format)
+            glGenTextures(1, &regions[i].texture);
+        create(regions[i]);
+    }
+}
+
+void stream_buffer::release() {
+    for (unsigned int i = 0; i < kRegions; i++) {
+        destroy(regions[i]);
+        glDeleteTextures(1, &regions[i].texture);
+        regions[i].texture = 0;
+    }
+    capacity = 0;
+}
+
+// Allocates r.buffer at 'capacity' bytes and points r.texture at it.
+void stream_buffer::create(region &r) {
+    glGenBuffers(1, &r.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, r.buffer);
+    if (use_persistent) {
+        glBufferStorage(GL_COPY_WRITE_BUFFER, capacity, nullptr, kPersistentFlags);
+        r.data = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, capacity, kPersistentFlags);
+    } else {
+        glBufferData(GL_COPY_WRITE_BUFFER, capacity, nullptr, GL_STREAM_DRAW);
+    }
+    if (r.texture) {
+        glBindTexture(GL_TEXTURE_BUFFER, r.texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, r.buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+}
+
+void stream_buffer::destroy(region &r) {
+    if (r.sync)
+        glDeleteSync((GLsync) r.sync);
+    // Deleting a buffer unmaps it
+    glDeleteBuffers(1, &r.buffer);
+    r.buffer = 0;
+    r.data = r.sync = nullptr;
+}
+
+// Blocks until the GPU is done with 'r'. Returns true if it was not yet.
+bool stream_buffer::wait(region &r) {
+    if (!r.sync)
+        return false;
+    GLsync sync = (GLsync) r.sync;
+    bool waited = false;
+    GLbitfield flags = 0;
+    // Flush on the second try, in case the fence is still in our queue
+    while (glClientWaitSync(sync, flags, waited ? 1000000 : 0) == GL_TIMEOUT_EXPIRED) {
+        waited = true;
+        flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+    }
+    glDeleteSync(sync);
+    r.sync = nullptr;
+    return waited;
+}
+
+void *stream_buffer::map(size_t size) {
+    totals.maps++;
+    current = (current + 1) % kRegions;
+    region &r = regions[current];
+    if (wait(r))
+        totals.waits++;
+
+    if (size > capacity) {
+        // Every buffer, so they stay interchangeable; only while growing
+        for (unsigned int i = 0; i < kRegions; i++) {
+            wait(regions[i]);
+            destroy(regions[i]);
+        }
+        while (capacity < size)
+            capacity *= 2;
+        for (unsigned int i = 0; i < kRegions; i++)
+            create(regions[i]);
+        totals.grows++;
+    }
+
+    if (use_persistent)
+        return r.data;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, r.buffer);
+    return glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size,
+                            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+                            GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+void stream_buffer::unmap() {
+    if (use_persistent)
+        return;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, regions[current].buffer);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+}
+
+void stream_buffer::fence() {
+    region &r = regions[current];
+    if (r.sync)
+        glDeleteSync((GLsync) r.sync);
+    r.sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
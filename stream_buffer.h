@@ -0,0 +1,70 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include <stddef.h>
+
+// Counters since init().
+struct stream_stats {
+    unsigned int maps;  // map() calls
+    unsigned int waits; // ... that found the GPU still reading the buffer
+    unsigned int grows; // ... that had to reallocate every buffer
+};
+
+// Data rewritten by the CPU every frame (or whenever it changes), such as
+// transforms. A ring of kRegions buffers is used in turn, each fenced after
+// the draws that read it, so the CPU writes one buffer while the GPU reads
+// the others and neither waits for the other.
+//
+// With ARB_buffer_storage the buffers are mapped once, persistently and
+// coherently, so map() is just a fence check. Without it, map() maps the
+// buffer with GL_MAP_UNSYNCHRONIZED_BIT, the fences doing the syncing.
+//
+// Per frame: map(), write, unmap(), bind buffer() or texture(), draw, then
+// fence(). If nothing changed, skip map() and unmap() but still fence(), as
+// the same buffer is read again.
+class stream_buffer {
+public:
+    static const unsigned int kRegions = 3;
+
+    stream_buffer();
+
+    // Needs a current context. 'texture_format', if not 0 (e.g. GL_RGBA32F),
+    // gives every buffer a GL_TEXTURE_BUFFER view in that format.
+    void init(bool persistent, unsigned int texture_format = 0);
+    void release();
+
+    // Moves to the next buffer of the ring and returns it for writing at
+    // least 'size' bytes. Its old contents are undefined.
+    void *map(size_t size);
+    // Makes the writes visible to GL.
+    void unmap();
+    // Marks the end of the draws that read the current buffer.
+    void fence();
+
+    unsigned int buffer() const { return regions[current].buffer; }
+    unsigned int texture() const { return regions[current].texture; }
+
+    bool persistent() const { return use_persistent; }
+    const stream_stats &stats() const { return totals; }
+
+private:
+    struct region {
+        unsigned int buffer;
+        unsigned int texture;
+        void *data;  // persistent mapping
+        void *sync;  // GLsync of the last fence(), or null
+    };
+
+    void create(region &r);
+    void destroy(region &r);
+    bool wait(region &r);
+
+    region regions[kRegions];
+    unsigned int current;
+    size_t capacity; // bytes per buffer
+    bool use_persistent;
+    unsigned int format;
+    stream_stats totals;
+};
+
+#endif // STREAM_BUFFER_H
@@ -0,0 +1,155 @@
+#include "texture_manager.h"
+
+#include <GL/glew.h>
+#include <cstring>
+
+// 64-bit FNV-1a over the image size, format and rows.
+static uint64_t hash_image(unsigned int width, unsigned int height, unsigned int format,
+                           size_t size, const unsigned char *pixels) {
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = (h ^ width) * prime;
+    h = (h ^ height) * prime;
+    h = (h ^ format) * prime;
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ pixels[i]) * prime;
+    return h;
+}
+
+// A second 64-bit hash of another family (multiply-rotate over 8-byte
+// words, Murmur3's finalizer), so that a layer is only shared when both
+// agree. An FNV-1a collision alone would hand out the wrong image.
+static uint64_t check_image(size_t size, const unsigned char *pixels) {
+    const uint64_t k1 = 0x87c37b91114253d5ULL, k2 = 0x4cf5ad432745937fULL;
+    uint64_t h = size * k2;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, pixels + i, 8);
+        word *= k1;
+        word = ((word << 31) | (word >> 33)) * k2;
+        h ^= word;
+        h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+    }
+    for (; i < size; i++)
+        h = (h ^ pixels[i]) * k1;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+texture_manager::texture_manager() {
+    totals.requests = 0;
+    totals.unique = 0;
+    totals.arrays = 0;
+    totals.bytes = 0;
+}
+
+bool texture_manager::find(const std::string &path, texture_ref &ref) {
+    std::map<std::string, texture_ref>::iterator it = by_path.find(path);
+    if (it == by_path.end())
+        return false;
+    ref = it->second;
+    totals.requests++;
+    return true;
+}
+
+size_t texture_manager::array_bytes(const texture_array &array) const {
+    size_t bytes = 0;
+    unsigned int w = array.width, h = array.height;
+    for (;;) {
+        bytes += (size_t) w * h * 4 * array.capacity;
+        if (w == 1 && h == 1)
+            break;
+        w = w > 1 ? w / 2 : 1;
+        h = h > 1 ? h / 2 : 1;
+    }
+    return bytes;
+}
+
+texture_manager::texture_array &texture_manager::array_for(unsigned int width, unsigned int height) {
+    for (size_t i = 0; i < arrays.size(); i++) {
+        if (arrays[i].width == width && arrays[i].height == height)
+            return arrays[i];
+    }
+    texture_array array;
+    glGenTextures(1, &array.texture);
+    array.width = width;
+    array.height = height;
+    array.layers = 0;
+    array.capacity = 0;
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+    arrays.push_back(array);
+    totals.arrays++;
+    return arrays.back();
+}
+
+// Doubles the layer count of 'array', keeping its texture name, so refs
+// handed out earlier stay valid. Expects the array to be bound.
+void texture_manager::grow(texture_array &array) {
+    std::vector<unsigned char> old;
+    if (array.layers > 0) {
+        old.resize((size_t) array.width * array.height * 4 * array.layers);
+        glGetTexImage(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, GL_UNSIGNED_BYTE, &old[0]);
+    }
+    totals.bytes -= array_bytes(array);
+    array.capacity = array.capacity ? 2 * array.capacity : 1;
+    totals.bytes += array_bytes(array);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, array.width, array.height, array.capacity, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    if (!old.empty())
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, array.width, array.height, array.layers,
+                        GL_RGBA, GL_UNSIGNED_BYTE, &old[0]);
+}
+
+texture_ref texture_manager::add(const std::string &path, unsigned int width, unsigned int height,
+                                 unsigned int format, unsigned int bytes_per_pixel,
+                                 const unsigned char *pixels) {
+    size_t row = ((size_t) width * bytes_per_pixel + 3) & ~(size_t) 3;
+    uint64_t hash = hash_image(width, height, format, row * height, pixels);
+    uint64_t check = check_image(row * height, pixels);
+    std::vector<stored_image> &same_hash = by_hash[hash];
+    for (size_t i = 0; i < same_hash.size(); i++) {
+        if (same_hash[i].check == check) {
+            by_path[path] = same_hash[i].ref;
+            return same_hash[i].ref;
+        }
+    }
+
+    texture_array &array = array_for(width, height);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+    if (array.layers == array.capacity)
+        grow(array);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, array.layers, width, height, 1,
+                    format, GL_UNSIGNED_BYTE, pixels);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+    texture_ref ref;
+    ref.texture = array.texture;
+    ref.layer = array.layers++;
+    by_path[path] = ref;
+    stored_image stored = {check, ref};
+    same_hash.push_back(stored);
+    totals.unique++;
+    return ref;
+}
+
+void texture_manager::add_missing(const std::string &path) {
+    texture_ref ref = {0, 0};
+    by_path[path] = ref;
+}
+
+void texture_manager::release() {
+    for (size_t i = 0; i < arrays.size(); i++)
+        glDeleteTextures(1, &arrays[i].texture);
+    arrays.clear();
+    by_path.clear();
+    by_hash.clear();
+    totals.unique = 0;
+    totals.arrays = 0;
+    totals.bytes = 0;
+}
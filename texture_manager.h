@@ -0,0 +1,77 @@
+#ifndef TEXTURE_MANAGER_H
+#define TEXTURE_MANAGER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// A texture as a layer of a GL_TEXTURE_2D_ARRAY. 'texture' is 0 if the
+// image could not be loaded.
+struct texture_ref {
+    unsigned int texture;
+    unsigned int layer;
+};
+
+// Running totals, for reporting how much sharing saved.
+struct texture_stats {
+    unsigned int requests;    // find() hits
+    unsigned int unique;      // images actually stored
+    unsigned int arrays;      // GL_TEXTURE_2D_ARRAY objects
+    size_t bytes;             // video memory of all arrays, mipmaps included
+};
+
+// Shares images between objects. An image is looked up by path first and
+// then by two hashes of its pixels, of different families, so the same
+// picture under two names is stored once. Images of the same size are layers of one
+// GL_TEXTURE_2D_ARRAY (RGBA8, mipmapped), so objects with different
+// textures of one size need no texture bind between them.
+//
+// An array starts with one layer and doubles when full; growing reads the
+// old layers back with glGetTexImage, which only happens while loading.
+class texture_manager {
+public:
+    texture_manager();
+
+    // True and 'ref' filled in if 'path' was added before.
+    bool find(const std::string &path, texture_ref &ref);
+    // Like find(), but not counted as a request.
+    bool has(const std::string &path) const { return by_path.count(path) != 0; }
+
+    // Adds an image decoded from 'path'. 'format' is the GL pixel format of
+    // 'pixels' (GL_BGR, GL_BGRA, ...), rows padded to 4 bytes.
+    texture_ref add(const std::string &path, unsigned int width, unsigned int height,
+                    unsigned int format, unsigned int bytes_per_pixel,
+                    const unsigned char *pixels);
+
+    // Remembers that 'path' has no image, so it is not tried again.
+    void add_missing(const std::string &path);
+
+    void release();
+
+    const texture_stats &stats() const { return totals; }
+
+private:
+    struct texture_array {
+        unsigned int texture;
+        unsigned int width, height;
+        unsigned int layers, capacity;
+    };
+
+    // One of the images with the same FNV-1a hash, told apart by 'check'
+    struct stored_image {
+        uint64_t check;
+        texture_ref ref;
+    };
+
+    texture_array &array_for(unsigned int width, unsigned int height);
+    void grow(texture_array &array);
+    size_t array_bytes(const texture_array &array) const;
+
+    std::vector<texture_array> arrays;
+    std::map<std::string, texture_ref> by_path;
+    std::map<uint64_t, std::vector<stored_image> > by_hash;
+    texture_stats totals;
+};
+
+#endif // TEXTURE_MANAGER_H
@@ -0,0 +1,110 @@
+#include "thread_pool.h"
+
+thread_pool::thread_pool(unsigned int num_threads)
+    : generation(0), stopping(false), remaining(0), steal_count(0) {
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0)
+        num_threads = 1;
+    for (unsigned int i = 0; i < num_threads; i++)
+        queues.push_back(new chunk_queue);
+    for (unsigned int i = 0; i + 1 < num_threads; i++)
+        workers.push_back(std::thread(&thread_pool::worker, this, i));
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    for (size_t i = 0; i < queues.size(); i++)
+        delete queues[i];
+}
+
+void thread_pool::worker(unsigned int index) {
+    unsigned int seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stopping && generation == seen)
+                wake.wait(guard);
+            if (stopping)
+                return;
+            seen = generation;
+        }
+        run_chunks(index);
+    }
+}
+
+// Own chunks newest first, then other threads' oldest first.
+bool thread_pool::take(unsigned int index, chunk &c) {
+    {
+        chunk_queue &own = *queues[index];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.chunks.empty()) {
+            c = own.chunks.back();
+            own.chunks.pop_back();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); k++) {
+        chunk_queue &victim = *queues[(index + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.chunks.empty()) {
+            c = victim.chunks.front();
+            victim.chunks.pop_front();
+            steal_count++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void thread_pool::run_chunks(unsigned int index) {
+    chunk c;
+    while (take(index, c)) {
+        job(c.begin, c.end);
+        if (remaining.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> guard(lock);
+            done.notify_all();
+        }
+    }
+}
+
+void thread_pool::parallel_for(size_t count, size_t grain,
+                               const std::function<void(size_t, size_t)> &fn) {
+    if (grain == 0)
+        grain = 1;
+    size_t chunks = (count + grain - 1) / grain;
+    if (queues.size() == 1 || chunks <= 1) {
+        for (size_t begin = 0; begin < count; begin += grain)
+            fn(begin, begin + grain < count ? begin + grain : count);
+        return;
+    }
+
+    // Contiguous runs of chunks per thread, so most work stays local
+    job = fn;
+    remaining = chunks;
+    size_t n = queues.size();
+    for (size_t t = 0; t < n; t++) {
+        chunk_queue &q = *queues[t];
+        std::lock_guard<std::mutex> guard(q.lock);
+        for (size_t k = t * chunks / n; k < (t + 1) * chunks / n; k++) {
+            chunk c = {k * grain, (k + 1) * grain < count ? (k + 1) * grain : count};
+            q.chunks.push_back(c);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        generation++;
+    }
+    wake.notify_all();
+
+    run_chunks(n - 1);
+    std::unique_lock<std::mutex> guard(lock);
+    while (remaining.load() != 0)
+        done.wait(guard);
+}
@@ -0,0 +1,66 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads for short, CPU-bound loops that the caller waits for,
+// such as culling. Unlike asset_loader, whose jobs may block on disk for a
+// long time, this pool only runs parallel_for().
+//
+// Each thread, the caller included, has its own deque of chunks. A thread
+// takes chunks from the back of its own deque and, once that is empty,
+// steals from the front of the others, so uneven chunks still keep every
+// thread busy until the loop is done.
+class thread_pool {
+public:
+    // 0 threads means one per hardware thread. The calling thread counts as
+    // one, so 'num_threads' - 1 workers are started.
+    explicit thread_pool(unsigned int num_threads = 0);
+    ~thread_pool();
+
+    // Calls fn(begin, end) for chunks of at most 'grain' indices covering
+    // [0, count), spread over all threads; returns when all are done. Must
+    // not be called from inside 'fn' or from two threads at once.
+    void parallel_for(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn);
+
+    // Threads running chunks, the caller included.
+    unsigned int size() const { return queues.size(); }
+    // Chunks taken from another thread's deque, since construction.
+    unsigned int steals() const { return steal_count; }
+
+private:
+    thread_pool(const thread_pool &);
+    thread_pool &operator=(const thread_pool &);
+
+    struct chunk {
+        size_t begin, end;
+    };
+
+    struct chunk_queue {
+        std::mutex lock;
+        std::deque<chunk> chunks;
+    };
+
+    void worker(unsigned int index);
+    void run_chunks(unsigned int index);
+    bool take(unsigned int index, chunk &c);
+
+    std::vector<std::thread> workers;
+    std::vector<chunk_queue *> queues; // the caller's is the last
+    std::function<void(size_t, size_t)> job;
+
+    std::mutex lock;
+    std::condition_variable wake, done;
+    unsigned int generation; // guarded by 'lock'; bumped per parallel_for()
+    bool stopping;           // guarded by 'lock'
+    std::atomic<size_t> remaining; // chunks not finished yet
+    std::atomic<unsigned int> steal_count;
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,205 @@
+#include "vertex_format.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+unsigned short float_to_half(float f) {
+    unsigned int x;
+    memcpy(&x, &f, sizeof(x));
+    unsigned int sign = (x >> 16) & 0x8000;
+    unsigned int exp = (x >> 23) & 0xff;
+    unsigned int mant = x & 0x7fffff;
+
+    if (exp == 0xff) // inf or nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+    int e = (int) exp - 127 + 15;
+    if (e >= 0x1f) // overflow
+        return sign | 0x7c00;
+
+    if (e <= 0) {
+        // Subnormal half, or zero.
+        if (e < -10)
+            return sign;
+        mant |= 0x800000;
+        unsigned int shift = 14 - e;
+        unsigned int half = mant >> shift;
+        unsigned int rest = mant & ((1u << shift) - 1);
+        unsigned int halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | half;
+    }
+
+    unsigned int half = ((unsigned int) e << 10) | (mant >> 13);
+    unsigned int rest = mant & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++; // may carry into the exponent, which rounds up correctly
+    return sign | half;
+}
+
+unsigned int pack_normal_10_10_10_2(const float *n) {
+    unsigned int packed = 0;
+    for (int i = 0; i < 3; i++) {
+        float c = n[i] < -1.0f ? -1.0f : (n[i] > 1.0f ? 1.0f : n[i]);
+        int v = (int) floorf(c * 511.0f + 0.5f);
+        packed |= ((unsigned int) v & 0x3ff) << (10 * i);
+    }
+    return packed;
+}
+
+template <typename T>
+static void store_indices(const unsigned int *indices, const index_range &range,
+                          unsigned char *out) {
+    T *dst = reinterpret_cast<T *>(out) + range.first;
+    for (unsigned int i = 0; i < range.count; i++)
+        dst[i] = (T) (indices[range.first + i] - range.base_vertex);
+}
+
+packed_indices pack_indices(const unsigned int *indices, size_t index_count,
+                            size_t vertex_count, unsigned int min_index_size) {
+    packed_indices packed;
+
+    index_range whole;
+    whole.first = 0;
+    whole.count = index_count;
+    whole.base_vertex = 0;
+
+    if (min_index_size >= 4) {
+        packed.index_size = 4;
+        packed.ranges.push_back(whole);
+    } else if (vertex_count <= 256 && min_index_size <= 1) {
+        packed.index_size = 1;
+        packed.ranges.push_back(whole);
+    } else if (vertex_count <= 65536 && min_index_size <= 2) {
+        packed.index_size = 2;
+        packed.ranges.push_back(whole);
+    } else {
+        // Greedily grow a run while its vertices fit in a 16-bit window.
+        // tinyobj numbers vertices in first-use order, so runs are long.
+        packed.index_size = 2;
+        size_t run = 0;
+        unsigned int lo = ~0u, hi = 0;
+        for (size_t t = 0; t + 3 <= index_count; t += 3) {
+            unsigned int tri_lo = std::min(indices[t], std::min(indices[t + 1], indices[t + 2]));
+            unsigned int tri_hi = std::max(indices[t], std::max(indices[t + 1], indices[t + 2]));
+            if (tri_hi - tri_lo > 0xffff) {
+                packed.index_size = 4;
+                packed.ranges.clear();
+                packed.ranges.push_back(whole);
+                break;
+            }
+            unsigned int new_lo = std::min(lo, tri_lo), new_hi = std::max(hi, tri_hi);
+            if (new_hi - new_lo > 0xffff) {
+                index_range range;
+                range.first = run;
+                range.count = t - run;
+                range.base_vertex = lo;
+                packed.ranges.push_back(range);
+                run = t;
+                new_lo = tri_lo;
+                new_hi = tri_hi;
+            }
+            lo = new_lo;
+            hi = new_hi;
+        }
+        if (packed.index_size == 2 && run < index_count) {
+            index_range range;
+            range.first = run;
+            range.count = index_count - run;
+            range.base_vertex = lo;
+            packed.ranges.push_back(range);
+        }
+    }
+
+    packed.lod_starts.push_back(0);
+    packed.lod_starts.push_back(packed.ranges.size());
+    packed.data.resize(index_count * packed.index_size);
+    if (index_count == 0)
+        return packed;
+    for (size_t i = 0; i < packed.ranges.size(); i++) {
+        if (packed.index_size == 1)
+            store_indices<unsigned char>(indices, packed.ranges[i], &packed.data[0]);
+        else if (packed.index_size == 2)
+            store_indices<unsigned short>(indices, packed.ranges[i], &packed.data[0]);
+        else
+            store_indices<unsigned int>(indices, packed.ranges[i], &packed.data[0]);
+    }
+    return packed;
+}
+
+packed_indices pack_lods(const mesh_view &shape, unsigned int min_index_size) {
+    size_t vertex_count = shape.num_positions / 3;
+    std::vector<packed_indices> levels(shape.num_lods);
+    unsigned int index_size = min_index_size;
+    // A level needing wider indices than the others widens them all
+    for (unsigned int l = 0; l < shape.num_lods; l++) {
+        levels[l] = pack_indices(shape.lods[l].indices, shape.lods[l].num_indices, vertex_count,
+                                 index_size);
+        if (levels[l].index_size > index_size) {
+            index_size = levels[l].index_size;
+            l = ~0u; // start over
+        }
+    }
+
+    packed_indices packed = levels[0];
+    for (unsigned int l = 1; l < shape.num_lods; l++) {
+        unsigned int first = packed.data.size() / index_size;
+        for (size_t r = 0; r < levels[l].ranges.size(); r++) {
+            index_range range = levels[l].ranges[r];
+            range.first += first;
+            packed.ranges.push_back(range);
+        }
+        packed.lod_starts.push_back(packed.ranges.size());
+        packed.data.insert(packed.data.end(), levels[l].data.begin(), levels[l].data.end());
+    }
+    return packed;
+}
+
+vertex_format interleave_vertices(const mesh_view &shape, bool compact,
+                                  std::vector<unsigned char> &out) {
+    size_t count = shape.num_positions / 3;
+    bool has_texcoords = shape.num_texcoords >= 2 * count && count > 0;
+    bool has_normals = shape.num_normals >= 3 * count && count > 0;
+
+    vertex_format format;
+    format.compact = compact;
+    format.position_offset = 0;
+    format.stride = 3 * sizeof(float);
+    format.texcoord_offset = -1;
+    if (has_texcoords) {
+        format.texcoord_offset = format.stride;
+        format.stride += compact ? 2 * sizeof(unsigned short) : 2 * sizeof(float);
+    }
+    format.normal_offset = -1;
+    if (has_normals) {
+        format.normal_offset = format.stride;
+        format.stride += compact ? sizeof(unsigned int) : 3 * sizeof(float);
+    }
+
+    out.resize(count * format.stride);
+    unsigned char *dst = out.empty() ? nullptr : &out[0];
+    for (size_t i = 0; i < count; i++, dst += format.stride) {
+        memcpy(dst, shape.positions + 3 * i, 3 * sizeof(float));
+        if (has_texcoords) {
+            const float *uv = shape.texcoords + 2 * i;
+            if (compact) {
+                unsigned short half[2] = {float_to_half(uv[0]), float_to_half(uv[1])};
+                memcpy(dst + format.texcoord_offset, half, sizeof(half));
+            } else {
+                memcpy(dst + format.texcoord_offset, uv, 2 * sizeof(float));
+            }
+        }
+        if (has_normals) {
+            const float *n = shape.normals + 3 * i;
+            if (compact) {
+                unsigned int packed = pack_normal_10_10_10_2(n);
+                memcpy(dst + format.normal_offset, &packed, sizeof(packed));
+            } else {
+                memcpy(dst + format.normal_offset, n, 3 * sizeof(float));
+            }
+        }
+    }
+    return format;
+}
@@ -0,0 +1,65 @@
+#ifndef VERTEX_FORMAT_H
+#define VERTEX_FORMAT_H
+
+#include <vector>
+#include "mesh_cache.h"
+
+enum vertex_layout {
+    LAYOUT_SEPARATE,    // one buffer per attribute, 32-bit floats
+    LAYOUT_INTERLEAVED, // one buffer, position/texcoord/normal per vertex, 32-bit floats
+    LAYOUT_COMPACT      // like LAYOUT_INTERLEAVED with half-float texcoords
+                        // and 10:10:10:2 normals
+};
+
+// Byte offsets of each attribute inside one interleaved vertex.
+// An offset of -1 means the mesh has no such attribute.
+struct vertex_format {
+    unsigned int stride;
+    int position_offset;
+    int texcoord_offset;
+    int normal_offset;
+    bool compact;
+};
+
+// Packs the attributes of 'shape' into one interleaved array in 'out'.
+// Only the attributes the mesh has take up space in a vertex.
+vertex_format interleave_vertices(const mesh_view &shape, bool compact,
+                                  std::vector<unsigned char> &out);
+
+// One draw over part of an index buffer: 'count' indices starting at index
+// 'first', each offset by 'base_vertex'.
+struct index_range {
+    unsigned int first;
+    unsigned int count;
+    int base_vertex;
+};
+
+// Indices stored in the narrowest type that can address the mesh.
+struct packed_indices {
+    unsigned int index_size; // 1, 2 or 4 bytes
+    std::vector<unsigned char> data;
+    std::vector<index_range> ranges;
+    // Level of detail k draws ranges [lod_starts[k], lod_starts[k + 1])
+    std::vector<unsigned int> lod_starts;
+};
+
+// Packs 'indices' into 8-bit indices if the mesh has at most 256 vertices and
+// 16-bit ones up to 65536 vertices. Larger meshes are split into runs of
+// triangles whose vertices all lie within 65536 of a base vertex, one range
+// per run; only if some triangle spans more than that do they stay 32-bit.
+// 'min_index_size' widens small meshes, for buffers shared by many meshes.
+packed_indices pack_indices(const unsigned int *indices, size_t index_count,
+                            size_t vertex_count, unsigned int min_index_size = 1);
+
+// Like pack_indices, for every level of detail of 'shape' one after the
+// other, all with the same index type.
+packed_indices pack_lods(const mesh_view &shape, unsigned int min_index_size = 1);
+
+// IEEE 754 binary16, round to nearest even.
+unsigned short float_to_half(float f);
+
+// Signed normalized x, y, z in 10 bits each, w = 0, as read by
+// GL_INT_2_10_10_10_REV.
+unsigned int pack_normal_10_10_10_2(const float *n);
+
+#endif // VERTEX_FORMAT_H